@@ -23,11 +23,28 @@
 #define EXT2_ROOT_INO		 2	/* Root inode */
 #define EXT2_BOOT_LOADER_INO	 5	/* Boot loader inode */
 #define EXT2_UNDEL_DIR_INO	 6	/* Undelete directory inode */
+#define EXT2_RESIZE_INO		 7	/* Reserved group descriptors inode */
 
 #define EXT2_GOOD_OLD_FIRST_INO	11
 
-#define EXT2_BLOCK_SIZE     1024
-#define	EXT2_ADDR_PER_BLOCK EXT2_BLOCK_SIZE / sizeof (unsigned int)
+#define EXT2_SUPER_MAGIC	0xEF53
+
+#define EXT2_GOOD_OLD_REV	0	/* The good old (original) format */
+#define EXT2_GOOD_OLD_INODE_SIZE 128
+
+#define EXT2_MIN_BLOCK_SIZE 1024
+#define	EXT2_MAX_BLOCK_SIZE 4096
+#define EXT2_MIN_BLOCK_LOG_SIZE 10
+#define EXT2_MAX_BLOCK_LOG_SIZE 12
+
+/*
+ * Constants relative to the data blocks
+ */
+#define	EXT2_NDIR_BLOCKS		12
+#define	EXT2_IND_BLOCK			EXT2_NDIR_BLOCKS
+#define	EXT2_DIND_BLOCK			(EXT2_IND_BLOCK + 1)
+#define	EXT2_TIND_BLOCK			(EXT2_DIND_BLOCK + 1)
+#define	EXT2_N_BLOCKS			(EXT2_TIND_BLOCK + 1)
 
 
 /*
@@ -39,9 +56,12 @@
 #define EXT2_FRAG_SIZE(s)		(EXT2_SB(s)->s_frag_size)
 #define EXT2_FRAGS_PER_BLOCK(s)		(EXT2_SB(s)->s_frags_per_block)
 
+/*
+ * A block of any supported size; only the first block_size bytes belong to it
+ */
 struct ext2_block
 {
-	unsigned int addr[EXT2_ADDR_PER_BLOCK];
+	unsigned int addr[EXT2_MAX_BLOCK_SIZE / sizeof (unsigned int)];
 };
 
 /*
@@ -59,6 +79,11 @@ struct ext2_group_desc
 	unsigned int	bg_reserved[3];
 };
 
+/*
+ * Inode flags
+ */
+#define EXT2_INDEX_FL			0x00001000 /* hash-indexed directory */
+
 #define EXT2_S_IFREG	0x8000	/* regular file */
 #define EXT2_S_IFDIR	0x4000	/* directory */
 
@@ -134,7 +159,7 @@ struct ext2_super_block {
 	unsigned int	s_inodes_per_group;	/* # Inodes per group */
 	unsigned int	s_mtime;		/* Mount time */
 	unsigned int	s_wtime;		/* Write time */
-	unsigned int	s_mnt_count;		/* Mount count */
+	unsigned short	s_mnt_count;		/* Mount count */
 	unsigned short	s_max_mnt_count;	/* Maximal mount count */
 	unsigned short	s_magic;		/* Magic signature */
 	unsigned short	s_state;		/* File system state */
@@ -175,7 +200,7 @@ struct ext2_super_block {
 	 */
 	unsigned char	s_prealloc_blocks;	/* Nr of blocks to try to preallocate*/
 	unsigned char	s_prealloc_dir_blocks;	/* Nr to preallocate for dirs */
-	unsigned short	s_padding1;
+	unsigned short	s_reserved_gdt_blocks;	/* Per group desc for online growth */
 	/*
 	 * Journaling support valid if EXT3_FEATURE_COMPAT_HAS_JOURNAL set.
 	 */
@@ -187,16 +212,39 @@ struct ext2_super_block {
 	unsigned char	s_def_hash_version;	/* Default hash version to use */
 	unsigned char	s_reserved_char_pad;
 	unsigned short	s_reserved_word_pad;
+ 	unsigned int	s_default_mount_opts;
  	unsigned int	s_first_meta_bg; 	/* First metablock block group */
-	unsigned int	s_reserved[190];	/* Padding to the end of the block */
+	unsigned int	s_mkfs_time;		/* When the filesystem was created */
+	unsigned int	s_jnl_blocks[17]; 	/* Backup of the journal inode */
+	unsigned int	s_reserved_hi[3];	/* High 32 bits of 64 bit block counts */
+	unsigned short	s_min_extra_isize;	/* All inodes have at least # bytes */
+	unsigned short	s_want_extra_isize; 	/* New inodes should reserve # bytes */
+	unsigned int	s_flags;		/* Miscellaneous flags */
+	unsigned int	s_reserved[167];	/* Padding to the end of the block */
 };
 
+/*
+ * Feature set definitions
+ */
+#define EXT2_FEATURE_COMPAT_RESIZE_INO		0x0010
+#define EXT2_FEATURE_COMPAT_DIR_INDEX		0x0020
+
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001
+
+/*
+ * Miscellaneous superblock flags
+ */
+#define EXT2_FLAGS_SIGNED_HASH		0x0001	/* Signed dirhash in use */
+#define EXT2_FLAGS_UNSIGNED_HASH	0x0002	/* Unsigned dirhash in use */
+
 /*
  * Codes for operating systems
  */
 #define EXT2_OS_LINUX		0
 
 
+#define EXT2_NAME_LEN 255
+
 struct ext2_dir_entry {
 	unsigned int	inode;			/* Inode number */
 	unsigned short	rec_len;		/* Directory entry length */
@@ -234,6 +282,38 @@ enum {
 	EXT2_FT_MAX
 };
 
+/*
+ * Hash tree (dir_index) structures. Block 0 of an indexed directory holds the
+ * "." and ".." entries, with ".." spanning the rest of the block, followed by
+ * dx_root_info and the root dx_entry array. Interior nodes are blocks holding
+ * one empty directory entry spanning the block, followed by a dx_entry array.
+ * The first dx_entry of every array holds a dx_countlimit in place of its hash.
+ * Blocks in dx_entry are logical block numbers within the directory.
+ */
+struct dx_root_info {
+	unsigned int	reserved_zero;
+	unsigned char	hash_version;
+	unsigned char	info_length;	/* 8 */
+	unsigned char	indirect_levels;
+	unsigned char	unused_flags;
+};
 
+struct dx_entry {
+	unsigned int	hash;
+	unsigned int	block;
+};
 
+struct dx_countlimit {
+	unsigned short	limit;
+	unsigned short	count;
+};
 
+/*
+ * Directory hash versions
+ */
+#define DX_HASH_LEGACY			0
+#define DX_HASH_HALF_MD4		1
+#define DX_HASH_TEA			2
+#define DX_HASH_LEGACY_UNSIGNED		3
+#define DX_HASH_HALF_MD4_UNSIGNED	4
+#define DX_HASH_TEA_UNSIGNED		5
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2_utils.h"
+
+#define BATCH_MAX_WORDS 8 /* longest command is ln -s <target> <path> */
+
+/*
+ * Splits line into at most max words in place, honouring '...' and "..." quoting,
+ * backslash escapes outside single quotes and # comments. Returns the number of 
+ * words, or -1 if there are too many or a quote is left open.
+ */
+static int split_words(char *line, char **words, int max) {
+	char *in = line, *out = line;
+	int count = 0;
+
+	while (1) {
+		while (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r') in++;
+		if (*in == '\0' || *in == '#') return count;
+		if (count == max) return -1;
+
+		words[count++] = out;
+		char quote = 0;
+		while (*in && (quote || !(*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r'))) {
+			if (quote && *in == quote) {
+				quote = 0;
+				in++;
+			}
+			else if (!quote && (*in == '\'' || *in == '"')) {
+				quote = *in++;
+			}
+			else if (*in == '\\' && quote != '\'' && in[1]) {
+				*out++ = in[1];
+				in += 2;
+			}
+			else {
+				*out++ = *in++;
+			}
+		}
+		if (quote) return -1;
+
+		/* the terminator may overwrite the separator just consumed, never unread input */
+		if (*in) in++;
+		*out++ = '\0';
+	}
+}
+
+int main(int argc, char **argv) {
+	struct ext2_fs *fs;
+	char *words[BATCH_MAX_WORDS];
+	char *line = NULL;
+	size_t line_size = 0;
+	unsigned long line_number = 0, failed = 0;
+	int err;
+
+	if(argc != 2 && argc != 3) {
+		fprintf(stderr, "Usage: ext2_batch <image file name> [command file]\n");
+		exit(1);
+	}
+	if ((err = ext2_open(argv[1], EXT2_FS_JOURNAL, &fs))) { /* initialize disk once for all commands */
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(err));
+		exit(1);
+	}
+
+	FILE *commands = stdin;
+	if (argc == 3 && strcmp(argv[2], "-") && (commands = fopen(argv[2], "r")) == NULL) {
+		fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+		exit(1);
+	}
+
+	/* one status line per command on stderr: line number, errno value, message */
+	while (getline(&line, &line_size, commands) != -1) {
+		line_number ++;
+		int count = split_words(line, words, BATCH_MAX_WORDS);
+		if (count == 0) continue;
+
+		err = (count < 0) ? EINVAL : run_command(fs, count, words);
+		if (err) failed ++;
+
+		fflush(stdout);
+		fprintf(stderr, "%lu %d %s\n", line_number, err, err ? strerror(err) : "ok");
+	}
+
+	free(line);
+	if (commands != stdin) fclose(commands);
+
+	/* everything since the last sync command commits as one group */
+	if ((err = ext2_close(fs))) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(err));
+		return 1;
+	}
+	return failed ? 1 : 0;
+}
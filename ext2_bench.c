@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "ext2_utils.h"
+
+/*
+ * Times the core primitives on fresh images of several sizes (micro) and whole
+ * runs of the tools (macro), printing one JSON object per result to stdout.
+ * Images are made with mke2fs in the scratch directory and removed afterwards.
+ */
+
+#define BENCH_MIN_NS 200000000ULL  /* repeated measurements run at least this long */
+#define BENCH_FILE_MAX (64 << 20)  /* largest file written by a micro benchmark */
+#define BENCH_MACRO_MB 256         /* image size for the macro benchmarks */
+#define BENCH_MACRO_FILE (32 << 20)
+#define BENCH_MACRO_RUNS 200       /* tool runs for operations without data */
+
+static const unsigned int image_sizes[] = {16, 128, 1024}; /* MiB */
+static const unsigned int fanouts[] = {16, 256, 4096};
+
+static char scratch[PATH_MAX];     /* directory for images and host files */
+static char tools[PATH_MAX];       /* directory holding the ext2_ tools */
+static unsigned int seed = 1;
+
+
+static unsigned long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ * Fixed sequence, so every run looks up the same names.
+ */
+static unsigned int bench_rand(void) {
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) & 0xFFFFFF;
+}
+
+
+/*
+ * Prints a result. Throughput is only given for operations moving bytes of data.
+ */
+static void report(const char *level, const char *name, unsigned int image_mb, unsigned int fanout,
+	unsigned long long ops, unsigned long long ns, unsigned long long bytes) {
+	printf("{\"level\": \"%s\", \"name\": \"%s\", \"image_mb\": %u, \"fanout\": %u, \"ops\": %llu, \"ns_per_op\": %.1f, \"mb_per_s\": ",
+		level, name, image_mb, fanout, ops, ops ? (double) ns / ops : 0.0);
+	if (bytes && ns) printf("%.1f}\n", (double) bytes / (1 << 20) / ((double) ns / 1e9));
+	else printf("null}\n");
+	fflush(stdout);
+}
+
+
+/*
+ * Runs argv with output to /dev/null, returning 0 if it exited with 0.
+ */
+static int run_tool(char **argv) {
+	int status;
+	pid_t pid = fork();
+
+	if (pid < 0) return errno;
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0) return errno;
+	return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : EIO;
+}
+
+
+static int make_image(char *image, unsigned int mb) {
+	char blocks[16];
+	char *argv[] = {"/sbin/mke2fs", "-q", "-F", "-t", "ext2", "-b", "1024", image, blocks, NULL};
+
+	sprintf(blocks, "%u", mb * 1024);
+	unlink(image);
+	if (access(argv[0], X_OK)) argv[0] = "/usr/sbin/mke2fs";
+	return run_tool(argv);
+}
+
+
+/*
+ * Writes a host file of size bytes with no block of zeros, so none becomes a hole.
+ */
+static int make_data(char *path, unsigned int size) {
+	unsigned char buf[EXT2_MIN_BLOCK_SIZE]; /* the smallest block, so no block of any size is all zeros */
+	unsigned int i, done;
+
+	FILE *stream = fopen(path, "w");
+	if (stream == NULL) return errno;
+	for (done = 0; done < size; done += sizeof(buf)) {
+		for (i = 0; i < sizeof(buf); i++) buf[i] = 1 + bench_rand() % 255;
+		fwrite(buf, 1, sizeof(buf), stream);
+	}
+	return fclose(stream) ? errno : 0;
+}
+
+
+
+
+/* MICRO BENCHMARKS */
+
+static void bench_allocate_block(struct ext2_fs *fs, unsigned int image_mb) {
+	unsigned int n = fs->super_block->s_free_blocks_count / 2, i;
+	unsigned int *blocks = malloc(n * sizeof(unsigned int));
+	if (blocks == NULL) return;
+
+	unsigned long long start = now_ns();
+	for (i = 0; i < n && (blocks[i] = allocate_block(fs)); i++);
+	report("micro", "allocate_block", image_mb, 0, i, now_ns() - start, 0);
+
+	while (i > 0) free_block(fs, blocks[--i]);
+	free(blocks);
+}
+
+
+static void bench_allocate_inode(struct ext2_fs *fs, unsigned int image_mb) {
+	unsigned int n = fs->super_block->s_free_inodes_count / 2, i;
+	unsigned int *inodes = malloc(n * sizeof(unsigned int));
+	if (inodes == NULL) return;
+
+	unsigned long long start = now_ns();
+	for (i = 0; i < n && (inodes[i] = allocate_inode(fs)); i++);
+	report("micro", "allocate_inode", image_mb, 0, i, now_ns() - start, 0);
+
+	while (i > 0) free_inode(fs, inodes[--i]);
+	free(inodes);
+}
+
+
+/*
+ * Writes data into new inodes until BENCH_MIN_NS has passed, then leaves the
+ * last one in place for bench_next_slot, returning its index.
+ */
+static unsigned int bench_populate_inode(struct ext2_fs *fs, unsigned int image_mb, char *data, unsigned int size) {
+	unsigned long long ns = 0, ops = 0;
+	unsigned int inode_index = 0;
+
+	FILE *stream = fopen(data, "r");
+	if (stream == NULL) return 0;
+	while (ns < BENCH_MIN_NS) {
+		if (inode_index) free_inode(fs, inode_index);
+		if ((inode_index = allocate_inode(fs)) == 0) break;
+		rewind(stream);
+
+		unsigned long long start = now_ns();
+		int err = populate_inode(fs, inode_index, stream);
+		ns += now_ns() - start;
+		get_inode(fs, inode_index)->i_mode |= 8 << 12;
+		if (err) break;
+		ops ++;
+	}
+	fclose(stream);
+	report("micro", "populate_inode", image_mb, 0, ops, ns, ops * size);
+	return inode_index;
+}
+
+
+static void bench_next_slot(struct ext2_fs *fs, unsigned int image_mb, unsigned int inode_index) {
+	struct next_slot_state state;
+	struct ptr_with_err result;
+	unsigned long long ops = 0;
+
+	unsigned long long start = now_ns();
+	while (now_ns() - start < BENCH_MIN_NS) {
+		initialize_state(fs, &state, inode_index);
+		while ((result = next_slot(&state)).ptr != NULL && result.err == NO_ERR) {
+			ops ++;
+		}
+	}
+	report("micro", "next_slot", image_mb, 0, ops, now_ns() - start, ops * fs->block_size);
+}
+
+
+/*
+ * Fills a new directory with fanout names of one file, timing add_entry, then
+ * looks up names at random through dir_find and inode_from_path.
+ */
+static void bench_directory(struct ext2_fs *fs, unsigned int image_mb, unsigned int fanout, unsigned int file_inode) {
+	char path[64], (*names)[16] = malloc(fanout * sizeof(*names));
+	unsigned int dir_inode, found, i;
+	unsigned long long ops, start;
+	if (names == NULL) return;
+
+	sprintf(path, "/fanout%u", fanout);
+	if (cmd_mkdir(fs, path) || inode_from_path(fs, path, &dir_inode)) {
+		free(names);
+		return;
+	}
+	for (i = 0; i < fanout; i++) sprintf(names[i], "entry%u", i);
+
+	start = now_ns();
+	for (i = 0; i < fanout; i++) {
+		if (add_entry(fs, dir_inode, file_inode, strlen(names[i]), EXT2_FT_REG_FILE, names[i])) break;
+	}
+	report("micro", "add_entry", image_mb, fanout, i, now_ns() - start, 0);
+
+	start = now_ns();
+	for (ops = 0; ops % 1024 || now_ns() - start < BENCH_MIN_NS; ops++) {
+		dir_find(fs, dir_inode, names[bench_rand() % fanout]);
+	}
+	report("micro", "dir_find", image_mb, fanout, ops, now_ns() - start, 0);
+
+	start = now_ns();
+	for (ops = 0; ops % 1024 || now_ns() - start < BENCH_MIN_NS; ops++) {
+		sprintf(path, "/fanout%u/%s", fanout, names[bench_rand() % fanout]);
+		inode_from_path(fs, path, &found);
+	}
+	report("micro", "inode_from_path", image_mb, fanout, ops, now_ns() - start, 0);
+	free(names);
+}
+
+
+static int bench_micro(unsigned int image_mb) {
+	char image[PATH_MAX + 32], data[PATH_MAX + 32];
+	struct ext2_fs *fs;
+	unsigned int size = image_mb << 17, i; /* an eighth of the image */
+	int err;
+
+	if (size > BENCH_FILE_MAX) size = BENCH_FILE_MAX;
+	snprintf(image, sizeof(image), "%s/ext2_bench_%u.img", scratch, image_mb);
+	snprintf(data, sizeof(data), "%s/ext2_bench_%u.data", scratch, image_mb);
+	if ((err = make_image(image, image_mb)) || (err = make_data(data, size))) return err;
+	if ((err = ext2_open(image, 0, &fs))) return err;
+
+	bench_allocate_block(fs, image_mb);
+	bench_allocate_inode(fs, image_mb);
+	unsigned int file_inode = bench_populate_inode(fs, image_mb, data, size);
+	if (file_inode) {
+		bench_next_slot(fs, image_mb, file_inode);
+		get_inode(fs, file_inode)->i_links_count = 0;
+		for (i = 0; i < sizeof(fanouts) / sizeof(fanouts[0]); i++) bench_directory(fs, image_mb, fanouts[i], file_inode);
+	}
+
+	err = ext2_close(fs);
+	unlink(image);
+	unlink(data);
+	return err;
+}
+
+
+
+
+/* MACRO BENCHMARKS */
+
+/*
+ * Runs tool runs times on image, with source (if any) and a path built by format
+ * from the run number as further arguments.
+ */
+static void bench_tool(char *tool, char *image, char *source, char *format, unsigned int runs, unsigned long long bytes) {
+	char program[PATH_MAX + 32], path[64];
+	char *argv[5] = {program, image};
+	unsigned int i, n = 2;
+
+	snprintf(program, sizeof(program), "%s/%s", tools, tool);
+	if (source) argv[n++] = source;
+	argv[n++] = path;
+	argv[n] = NULL;
+
+	unsigned long long start = now_ns();
+	for (i = 0; i < runs; i++) {
+		sprintf(path, format, i);
+		if (run_tool(argv)) break;
+	}
+	report("macro", tool, BENCH_MACRO_MB, 0, i, now_ns() - start, i * bytes);
+}
+
+
+static int bench_macro(void) {
+	char image[PATH_MAX + 32], data[PATH_MAX + 32];
+	unsigned int runs = BENCH_MACRO_MB / 2 / (BENCH_MACRO_FILE >> 20); /* half the image */
+	int err;
+
+	snprintf(image, sizeof(image), "%s/ext2_bench_macro.img", scratch);
+	snprintf(data, sizeof(data), "%s/ext2_bench_macro.data", scratch);
+	if ((err = make_image(image, BENCH_MACRO_MB)) || (err = make_data(data, BENCH_MACRO_FILE))) return err;
+
+	bench_tool("ext2_mkdir", image, NULL, "/dir%u", BENCH_MACRO_RUNS, 0);
+	bench_tool("ext2_cp", image, data, "/file%u", runs, BENCH_MACRO_FILE);
+	bench_tool("ext2_cat", image, NULL, "/file%u", runs, BENCH_MACRO_FILE);
+
+	unlink(image);
+	unlink(data);
+	return 0;
+}
+
+
+int main(int argc, char **argv) {
+	unsigned int i;
+	int err;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: ext2_bench [scratch directory]\n");
+		exit(1);
+	}
+	snprintf(scratch, sizeof(scratch), "%s", argc == 2 ? argv[1] : "/tmp");
+
+	/* the tools are expected next to this one */
+	snprintf(tools, sizeof(tools), "%s", argv[0]);
+	char *slash = strrchr(tools, '/');
+	if (slash) *slash = '\0';
+	else strcpy(tools, ".");
+
+	for (i = 0; i < sizeof(image_sizes) / sizeof(image_sizes[0]); i++) {
+		if ((err = bench_micro(image_sizes[i]))) {
+			fprintf(stderr, "%u MiB image: %s\n", image_sizes[i], strerror(err));
+			exit(err);
+		}
+	}
+	if ((err = bench_macro())) {
+		fprintf(stderr, "%s: %s\n", scratch, strerror(err));
+		exit(err);
+	}
+	return 0;
+}
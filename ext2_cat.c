@@ -1,23 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <errno.h>
+#include <string.h>
 #include "ext2_utils.h"
 
 int main(int argc, char **argv) {
+	struct ext2_fs *fs;
+	int err;
+
 	if(argc != 3) {
 		fprintf(stderr, "Usage: ext2_cat <image file name> <path to file>\n");
 		exit(1);
 	}
-	disk_initialization(argv[1]); /* initialize disk */
-	unsigned int inode_index = inode_from_path(argv[2]); /* get inode index from path */
-
-	if (has_file_type(EXT2_INODE_FT_DIR, inode_index)) { 
-		fprintf(stderr, "%s: is a directory\n", argv[2]);
-		exit(EISDIR);
+	if ((err = ext2_open(argv[1], EXT2_FS_RDONLY, &fs))) { /* initialize disk */
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(err));
+		exit(1);
 	}
-	else {
-		/* print the file contents */
-		print_file(inode_index);
+
+	if ((err = cmd_cat(fs, argv[2]))) {
+		fprintf(stderr, "%s: %s\n", argv[2], strerror(err));
+		exit(err);
 	}
+
+	ext2_close(fs);
 	return 0;
 }
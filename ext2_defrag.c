@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ext2_utils.h"
+
+int main(int argc, char **argv) {
+	struct ext2_fs *fs;
+	int err;
+
+	int report = (argc > 2 && argv[2][0] == '-');
+	if(argc != 3 + report || (report && strcmp(argv[2], "-n"))) {
+		fprintf(stderr, "Usage: ext2_defrag <image file name> [-n] <path>\n");
+		exit(1);
+	}
+	if ((err = ext2_open(argv[1], report ? EXT2_FS_RDONLY : EXT2_FS_JOURNAL, &fs))) { /* initialize disk */
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(err));
+		exit(1);
+	}
+
+	if ((err = cmd_defrag(fs, argv[2 + report], !report))) {
+		fprintf(stderr, "%s: %s\n", argv[2 + report], strerror(err));
+		exit(err);
+	}
+
+	if ((err = ext2_close(fs))) { /* commit */
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(err));
+		exit(err);
+	}
+	return 0;
+}
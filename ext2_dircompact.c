@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ext2_utils.h"
+
+int main(int argc, char **argv) {
+	struct ext2_fs *fs;
+	unsigned int freed = 0;
+	int err;
+
+	int recursive = (argc > 2 && argv[2][0] == '-');
+	if(argc != 3 + recursive || (recursive && strcmp(argv[2], "-r"))) {
+		fprintf(stderr, "Usage: ext2_dircompact <image file name> [-r] <path to directory>\n");
+		exit(1);
+	}
+	if ((err = ext2_open(argv[1], EXT2_FS_JOURNAL, &fs))) { /* initialize disk */
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(err));
+		exit(1);
+	}
+
+	if ((err = cmd_dircompact(fs, argv[2 + recursive], recursive, &freed))) {
+		fprintf(stderr, "%s: %s\n", argv[2 + recursive], strerror(err));
+		exit(err);
+	}
+
+	if ((err = ext2_close(fs))) { /* commit */
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(err));
+		exit(err);
+	}
+	printf("%u blocks freed\n", freed);
+	return 0;
+}
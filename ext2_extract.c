@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ext2_utils.h"
+
+int main(int argc, char **argv) {
+	struct ext2_fs *fs;
+	long threads = 0;
+	int err;
+
+	int jobs = (argc > 2 && argv[2][0] == '-') ? 2 : 0;
+	if (argc != 4 + jobs || (jobs && (strcmp(argv[2], "-j") || (threads = atol(argv[3])) <= 0))) {
+		fprintf(stderr, "Usage: ext2_extract <image file name> [-j threads] <path in target fs> <path in native fs>\n");
+		exit(1);
+	}
+	if ((err = ext2_open(argv[1], EXT2_FS_RDONLY, &fs))) { /* initialize disk */
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(err));
+		exit(1);
+	}
+
+	err = jobs ? export_tree(fs, argv[2 + jobs], argv[3 + jobs], threads) : cmd_extract(fs, argv[2], argv[3]);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", argv[2 + jobs], strerror(err));
+		exit(err);
+	}
+
+	ext2_close(fs);
+	return 0;
+}
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "ext2_utils.h"
+
+#define FIND_BUFFER_SIZE 65536
+
+/*
+ * Predicates of one run, unset ones match everything.
+ */
+struct find_query {
+	char *name;              /* glob matched against the last path component */
+	unsigned short type;     /* EXT2_INODE_FT_* or 0 */
+	int size_cmp;            /* -1 less than, 0 exactly, 1 more than */
+	unsigned long long size; /* in units of size_unit, rounded up */
+	unsigned long size_unit;
+	int has_size;
+
+	pthread_mutex_t out_lock;
+	char **buffers; /* one output buffer per thread, flushed under out_lock */
+	size_t *used;
+};
+
+
+static void flush_buffer(struct find_query *query, unsigned int worker) {
+	pthread_mutex_lock(&query->out_lock);
+	fwrite(query->buffers[worker], 1, query->used[worker], stdout);
+	pthread_mutex_unlock(&query->out_lock);
+	query->used[worker] = 0;
+}
+
+
+static int find_visit(struct ext2_fs *fs, struct walk_entry *entry, void *arg) {
+	struct find_query *query = arg;
+
+	if (query->type && (entry->in->i_mode >> 12) != query->type) return 0;
+
+	if (query->name) {
+		char *name = strrchr(entry->path, '/');
+		name = (name && name[1]) ? name + 1 : entry->path;
+		if (fnmatch(query->name, name, 0)) return 0;
+	}
+
+	if (query->has_size) {
+		unsigned long long units = (entry->in->i_size + query->size_unit - 1) / query->size_unit;
+		if (query->size_cmp < 0 ? units >= query->size : query->size_cmp > 0 ? units <= query->size : units != query->size) return 0;
+	}
+
+	size_t len = strlen(entry->path);
+	if (query->used[entry->worker] + len + 1 > FIND_BUFFER_SIZE) flush_buffer(query, entry->worker);
+	if (len + 1 > FIND_BUFFER_SIZE) {
+		pthread_mutex_lock(&query->out_lock);
+		puts(entry->path);
+		pthread_mutex_unlock(&query->out_lock);
+		return 0;
+	}
+	memcpy(query->buffers[entry->worker] + query->used[entry->worker], entry->path, len);
+	query->used[entry->worker] += len;
+	query->buffers[entry->worker][query->used[entry->worker]++] = '\n';
+	return 0;
+}
+
+
+/*
+ * Parses a find style size, [+-]N[c|k|M], in 512 byte blocks by default.
+ */
+static int parse_size(char *arg, struct find_query *query) {
+	char *end;
+
+	query->size_cmp = (*arg == '+') ? 1 : (*arg == '-') ? -1 : 0;
+	if (*arg == '+' || *arg == '-') arg++;
+	if (*arg < '0' || *arg > '9') return 1;
+	query->size = strtoull(arg, &end, 10);
+	switch (*end) {
+		case '\0': query->size_unit = 512; break;
+		case 'c': query->size_unit = 1; end++; break;
+		case 'k': query->size_unit = 1024; end++; break;
+		case 'M': query->size_unit = 1024 * 1024; end++; break;
+		default: return 1;
+	}
+	query->has_size = 1;
+	return *end != '\0';
+}
+
+
+int main(int argc, char **argv) {
+	struct ext2_fs *fs;
+	struct find_query query = {0};
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int err, i, bad = (argc < 3);
+
+	for (i = 3; !bad && i < argc; i += 2) {
+		if (i + 1 >= argc) bad = 1;
+		else if (!strcmp(argv[i], "-name")) query.name = argv[i + 1];
+		else if (!strcmp(argv[i], "-type")) {
+			if (!strcmp(argv[i + 1], "f")) query.type = EXT2_INODE_FT_REG_FILE;
+			else if (!strcmp(argv[i + 1], "d")) query.type = EXT2_INODE_FT_DIR;
+			else if (!strcmp(argv[i + 1], "l")) query.type = EXT2_INODE_FT_SYMLINK;
+			else bad = 1;
+		}
+		else if (!strcmp(argv[i], "-size")) bad = parse_size(argv[i + 1], &query);
+		else if (!strcmp(argv[i], "-j")) bad = (threads = atol(argv[i + 1])) <= 0;
+		else bad = 1;
+	}
+	if (bad) {
+		fprintf(stderr, "Usage: ext2_find <image file name> <path> [-name pattern] [-type f|d|l] [-size [+-]N[c|k|M]] [-j threads]\n");
+		exit(1);
+	}
+	if (threads <= 0) threads = 1;
+
+	if ((err = ext2_open(argv[1], EXT2_FS_RDONLY, &fs))) { /* initialize disk */
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(err));
+		exit(1);
+	}
+
+	pthread_mutex_init(&query.out_lock, NULL);
+	query.buffers = calloc(threads, sizeof(char *));
+	query.used = calloc(threads, sizeof(size_t));
+	for (i = 0; query.buffers && i < threads; i++) {
+		if ((query.buffers[i] = malloc(FIND_BUFFER_SIZE)) == NULL) break;
+	}
+	if (query.buffers == NULL || query.used == NULL || i < threads) {
+		fprintf(stderr, "%s\n", strerror(ENOMEM));
+		exit(ENOMEM);
+	}
+
+	err = walk_tree(fs, argv[2], threads, find_visit, &query);
+	for (i = 0; i < threads; i++) {
+		flush_buffer(&query, i);
+		free(query.buffers[i]);
+	}
+	if (err) {
+		fprintf(stderr, "%s: %s\n", argv[2], strerror(err));
+		exit(err);
+	}
+
+	free(query.buffers);
+	free(query.used);
+	pthread_mutex_destroy(&query.out_lock);
+	ext2_close(fs);
+	return 0;
+}
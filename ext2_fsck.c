@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ext2_utils.h"
+
+/*
+ * Exits as e2fsck does: 0 if the image is clean, 1 if every problem was fixed,
+ * 4 if problems are left, 8 on an operational error.
+ */
+int main(int argc, char **argv) {
+	struct ext2_fs *fs;
+	unsigned int found = 0, left = 0;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int err;
+
+	int repair = (argc == 3 && !strcmp(argv[2], "-y"));
+	if (argc != 2 + repair) {
+		fprintf(stderr, "Usage: ext2_fsck <image file name> [-y]\n");
+		exit(8);
+	}
+	if (threads <= 0) threads = 1;
+	if ((err = ext2_open(argv[1], repair ? EXT2_FS_JOURNAL : EXT2_FS_RDONLY, &fs))) { /* initialize disk */
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(err));
+		exit(8);
+	}
+
+	if ((err = check_fs(fs, repair, threads, &found, &left))) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(err));
+		exit(8);
+	}
+
+	if ((err = ext2_close(fs))) { /* commit */
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(err));
+		exit(8);
+	}
+	printf("%s: %u problems found, %u left\n", argv[1], found, left);
+	return left ? 4 : found ? 1 : 0;
+}
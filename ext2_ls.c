@@ -1,22 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "ext2_utils.h"
 
 int main(int argc, char **argv) {
+	struct ext2_fs *fs;
+	int err;
+
 	if(argc != 3) {
 		fprintf(stderr, "Usage: ext2_ls <image file name> <path to directory>\n");
 		exit(1);
 	}
-
-	disk_initialization(argv[1]); /* initialize disk */
-	unsigned int inode_index = inode_from_path(argv[2]); /* get inode index from path */
-
-	if (has_file_type(EXT2_INODE_FT_DIR, inode_index)) {
-		// Case: inode has directory filetype
-		print_dir(inode_index); /* prints the directory contents */
+	if ((err = ext2_open(argv[1], EXT2_FS_RDONLY, &fs))) { /* initialize disk */
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(err));
+		exit(1);
 	}
-	else {
-		fprintf(stderr, "%s: is not a directory\n", argv[2]);
+
+	if ((err = cmd_ls(fs, argv[2]))) {
+		fprintf(stderr, "%s: %s\n", argv[2], strerror(err));
+		exit(err);
 	}
+
+	ext2_close(fs);
 	return 0;
 }
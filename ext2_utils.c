@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -5,37 +6,597 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <time.h>
+#include <stdarg.h>
 #include "ext2_utils.h"
 
 
+
 /* DISK INITIALIZATION */
 
-void disk_initialization(char *filename){
-	int fd = open(filename, O_RDWR);
-	disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+/*
+ * Hints the kernel to read in the given range of blocks ahead of use.
+ */
+static void prefetch_blocks(struct ext2_fs *fs, unsigned int first, unsigned int count) {
+	long page = sysconf(_SC_PAGESIZE);
+	size_t start = (size_t) first * fs->block_size;
+	size_t end = start + (size_t) count * fs->block_size;
+	start -= start % page;
+	if (end > fs->disk_size) end = fs->disk_size;
+	if (start < end) madvise(fs->disk + start, end - start, MADV_WILLNEED);
+}
+
+
+/*
+ * Flushes the directory holding path, so a file created or removed there stays so.
+ */
+static int sync_parent(char *path) {
+	char *slash = strrchr(path, '/');
+	int err = 0;
+
+	char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+	if (dir == NULL) return ENOMEM;
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || fsync(fd)) err = errno;
+	if (fd >= 0) close(fd);
+	free(dir);
+	return err;
+}
+
+
+int ext2_open(char *filename, int flags, struct ext2_fs **fsp) {
+	struct ext2_super_block sb;
+	struct stat st;
+	unsigned int g;
+	int prot = (flags & EXT2_FS_RDONLY) ? PROT_READ : PROT_READ | PROT_WRITE;
+	int err;
+
+	if (flags & EXT2_FS_RDONLY) flags &= ~EXT2_FS_JOURNAL;
+	if ((err = journal_recover(filename))) return err;
+
+	int fd = open(filename, (flags & EXT2_FS_RDONLY) ? O_RDONLY : O_RDWR);
+	if (fd < 0) return errno;
+
+	/* size the mapping from the superblock rather than assuming a fixed image */
+	if (pread(fd, &sb, sizeof(sb), 1024) != sizeof(sb) || sb.s_magic != EXT2_SUPER_MAGIC 
+		|| sb.s_log_block_size > EXT2_MAX_BLOCK_LOG_SIZE - EXT2_MIN_BLOCK_LOG_SIZE) {
+		// Case: not ext2, or blocks larger than this build handles
+		close(fd);
+		return EINVAL;
+	}
+
+	unsigned int block_size = EXT2_MIN_BLOCK_SIZE << sb.s_log_block_size;
+	size_t disk_size = (size_t) sb.s_blocks_count * block_size;
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < disk_size) {
+		// Case: image smaller than its block count
+		close(fd);
+		return EINVAL;
+	}
+
+	/* a journaled handle writes to a private copy, so nothing reaches the file uncommitted */
+	unsigned char *disk = mmap(NULL, disk_size, prot, (flags & EXT2_FS_JOURNAL) ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+	err = errno;
+	if (disk == MAP_FAILED) {
+		close(fd);
+		return err;
+	}
+
+	struct ext2_fs *fs = calloc(1, sizeof(struct ext2_fs));
+	char *journal_path = malloc(strlen(filename) + sizeof(".journal"));
+	if (fs == NULL || journal_path == NULL) {
+		free(fs);
+		free(journal_path);
+		munmap(disk, disk_size);
+		close(fd);
+		return ENOMEM;
+	}
+	sprintf(journal_path, "%s.journal", filename);
+	if (!(flags & EXT2_FS_JOURNAL)) {
+		close(fd);
+		fd = -1;
+	}
+	fs->fd = fd;
+	fs->journal_fd = -1;
+	fs->journal_path = journal_path;
+	fs->flags = flags;
+	fs->disk = disk;
+	fs->disk_size = disk_size;
+	fs->super_block = (struct ext2_super_block *)(fs->disk + 1024);
+
+	fs->inodes_count = fs->super_block->s_inodes_count;
+	fs->blocks_count = fs->super_block->s_blocks_count;
+	fs->inodes_per_group = fs->super_block->s_inodes_per_group;
+	fs->blocks_per_group = fs->super_block->s_blocks_per_group;
+	fs->first_data_block = fs->super_block->s_first_data_block;
+	fs->block_size = block_size;
+	fs->addr_per_block = block_size / sizeof(unsigned int);
+	fs->inode_size = (fs->super_block->s_rev_level == EXT2_GOOD_OLD_REV) ? EXT2_GOOD_OLD_INODE_SIZE : fs->super_block->s_inode_size;
+	fs->groups_count = (fs->blocks_count - fs->first_data_block + fs->blocks_per_group - 1) / fs->blocks_per_group;
+
+	/* group descriptor table follows the superblock */
+	fs->block_group = (struct ext2_group_desc *) (fs->disk + (fs->first_data_block + 1) * fs->block_size);
+	fs->block_cursor = fs->first_data_block;
+	fs->inode_cursor = EXT2_FIRST_ALLOC_INO;
+	fs->free_blocks.base = fs->first_data_block;
+	fs->free_blocks.span = fs->blocks_per_group;
+	fs->free_inodes.base = 1;
+	fs->free_inodes.span = fs->inodes_per_group;
+
+	/* metadata is read eagerly, data is left to fault in on demand */
+	prefetch_blocks(fs, fs->first_data_block + 1, 
+		align_to_nearest(fs->block_size, fs->groups_count * sizeof(struct ext2_group_desc)) / fs->block_size);
+	for (g = 0; g < fs->groups_count; g++) {
+		prefetch_blocks(fs, fs->block_group[g].bg_block_bitmap, 1);
+		prefetch_blocks(fs, fs->block_group[g].bg_inode_bitmap, 1);
+	}
+
+	/* a failed build is retried by the first allocation */
+	if (!(flags & EXT2_FS_RDONLY)) free_index_build(fs);
+
+	*fsp = fs;
+	return 0;
+}
+
+
+int ext2_close(struct ext2_fs *fs) {
+	int err = 0;
+
+	if (fs->counters_deferred) sync_counters(fs);
+	if (fs->flags & EXT2_FS_JOURNAL) err = ext2_commit(fs);
+	if (fs->journal_fd >= 0) {
+		// Case: everything is in place, the (empty) journal can go
+		close(fs->journal_fd);
+		if (!err && !unlink(fs->journal_path)) sync_parent(fs->journal_path);
+	}
+	if (fs->fd >= 0) close(fs->fd);
+
+	dentry_cache_clear(fs);
+	extent_tree_clear(&fs->free_blocks);
+	extent_tree_clear(&fs->free_inodes);
+	free(fs->dentries.buckets);
+	free(fs->paths.buckets);
+	free(fs->links.buckets);
+	free(fs->journal_path);
+	munmap(fs->disk, fs->disk_size);
+	free(fs);
+	return err;
+}
+
+
+/*
+ * Returns 0 if fs may be modified, or EROFS if it was opened read only.
+ */
+static int fs_writable(struct ext2_fs *fs) {
+	return (fs->flags & EXT2_FS_RDONLY) ? EROFS : 0;
+}
+
+
+struct ext2_block *get_block(struct ext2_fs *fs, unsigned int block_index) {
+	return (struct ext2_block *) (fs->disk + (size_t) block_index * fs->block_size);
+}
+
+
+struct ext2_inode *get_inode(struct ext2_fs *fs, unsigned int inode_index) {
+	unsigned int group = (inode_index - 1) / fs->inodes_per_group;
+	unsigned int offset = (inode_index - 1) % fs->inodes_per_group;
+	return (struct ext2_inode *) (fs->disk + (size_t) fs->block_group[group].bg_inode_table * fs->block_size + (size_t) offset * fs->inode_size);
+}
+
+
+unsigned int inode_group(struct ext2_fs *fs, unsigned int inode_index) {
+	return (inode_index - 1) / fs->inodes_per_group;
+}
+
+
+unsigned int block_group_of(struct ext2_fs *fs, unsigned int block_index) {
+	return (block_index - fs->first_data_block) / fs->blocks_per_group;
+}
+
+
+unsigned int group_blocks_count(struct ext2_fs *fs, unsigned int group) {
+	if (group == fs->groups_count - 1) 
+		return fs->blocks_count - fs->first_data_block - group * fs->blocks_per_group;
+	return fs->blocks_per_group;
+}
+
+
+unsigned int group_inodes_count(struct ext2_fs *fs, unsigned int group) {
+	return fs->inodes_per_group;
+}
+
+
+unsigned char *group_block_bitmap(struct ext2_fs *fs, unsigned int group) {
+	return fs->disk + (size_t) fs->block_group[group].bg_block_bitmap * fs->block_size;
+}
+
+
+unsigned char *group_inode_bitmap(struct ext2_fs *fs, unsigned int group) {
+	return fs->disk + (size_t) fs->block_group[group].bg_inode_bitmap * fs->block_size;
+}
+
+
+
+
+/* JOURNAL */
+
+/*
+ * Stretch of blocks, as collected for writing back.
+ */
+struct journal_run {
+	unsigned int first, count;
+};
+
+struct journal_list {
+	struct journal_run *runs;
+	unsigned int count, capacity;
+	unsigned int blocks; /* total over the runs */
+};
+
+
+/*
+ * Appends count blocks at first to list, extending its last run when they follow
+ * on. Returns 0 or ENOMEM.
+ */
+static int journal_list_add(struct journal_list *list, unsigned int first, unsigned int count) {
+	list->blocks += count;
+	if (list->count && list->runs[list->count - 1].first + list->runs[list->count - 1].count == first) {
+		list->runs[list->count - 1].count += count;
+		return 0;
+	}
+	if (list->count == list->capacity) {
+		unsigned int capacity = list->capacity ? list->capacity * 2 : 64;
+		struct journal_run *runs = realloc(list->runs, capacity * sizeof(struct journal_run));
+		if (runs == NULL) return ENOMEM;
+		list->runs = runs;
+		list->capacity = capacity;
+	}
+	list->runs[list->count].first = first;
+	list->runs[list->count].count = count;
+	list->count ++;
+	return 0;
+}
+
+
+/*
+ * Returns sum continued over len bytes at data, len a multiple of 8.
+ */
+static unsigned long long journal_checksum(unsigned long long sum, const void *data, size_t len) {
+	const uint64_t *word = data;
+	size_t i;
+
+	for (i = 0; i < len / 8; i++) {
+		sum = (sum ^ word[i]) * 0x100000001B3ULL;
+		sum ^= sum >> 29;
+	}
+	return sum;
+}
+
+
+/*
+ * Blocks of block_size bytes taken by the block numbers of a journal logging 
+ * count blocks.
+ */
+static unsigned int journal_tag_blocks(unsigned int count, unsigned int block_size) {
+	return (count * sizeof(unsigned int) + block_size - 1) / block_size;
+}
+
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+	while (len > 0) {
+		ssize_t written = pwrite(fd, buf, len, offset);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return errno;
+		}
+		buf = (const unsigned char *) buf + written;
+		len -= written;
+		offset += written;
+	}
+	return 0;
+}
+
+
+static int pread_all(int fd, void *buf, size_t len, off_t offset) {
+	while (len > 0) {
+		ssize_t got = pread(fd, buf, len, offset);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) return got < 0 ? errno : EIO;
+		buf = (unsigned char *) buf + got;
+		len -= got;
+		offset += got;
+	}
+	return 0;
+}
+
+
+/*
+ * Checks the transaction in open journal jfd, of size bytes, and copies its 
+ * blocks to their place in image fd, whose blocks are block_size bytes. Returns
+ * 0, EAGAIN if the journal holds no complete transaction, or an errno value.
+ */
+static int journal_replay(int jfd, off_t size, int fd, unsigned int block_size) {
+	struct ext2_journal_header header;
+	unsigned char *buf;
+	unsigned int *tags;
+	unsigned int i;
+	int err;
+
+	if (pread_all(jfd, &header, sizeof(header), 0) || header.magic != EXT2_JOURNAL_MAGIC
+		|| size != (off_t) (1 + journal_tag_blocks(header.count, block_size) + header.count) * block_size) {
+		return EAGAIN;
+	}
+
+	size_t tag_bytes = (size_t) journal_tag_blocks(header.count, block_size) * block_size;
+	tags = malloc(tag_bytes);
+	buf = malloc(block_size);
+	if (tags == NULL || buf == NULL) {
+		free(tags);
+		free(buf);
+		return ENOMEM;
+	}
+
+	/* nothing is copied unless the whole transaction made it out */
+	unsigned long long sum = journal_checksum(EXT2_JOURNAL_MAGIC ^ header.count, NULL, 0);
+	err = pread_all(jfd, tags, tag_bytes, block_size);
+	if (!err) sum = journal_checksum(sum, tags, tag_bytes);
+	off_t data = block_size + tag_bytes;
+	for (i = 0; i < header.count && !err; i++) {
+		err = pread_all(jfd, buf, block_size, data + (off_t) i * block_size);
+		if (!err) sum = journal_checksum(sum, buf, block_size);
+	}
+	if (!err && sum != header.checksum) err = EAGAIN;
+
+	for (i = 0; i < header.count && !err; i++) {
+		err = pread_all(jfd, buf, block_size, data + (off_t) i * block_size);
+		if (!err) err = pwrite_all(fd, buf, block_size, (off_t) tags[i] * block_size);
+	}
+	if (!err && fdatasync(fd)) err = errno;
+
+	free(tags);
+	free(buf);
+	return err;
+}
+
+
+int journal_recover(char *filename) {
+	struct stat st;
+	int err = 0;
+
+	char *path = malloc(strlen(filename) + sizeof(".journal"));
+	if (path == NULL) return ENOMEM;
+	sprintf(path, "%s.journal", filename);
+
+	int jfd = open(path, O_RDONLY);
+	if (jfd < 0) {
+		err = (errno == ENOENT) ? 0 : errno;
+		free(path);
+		return err;
+	}
+
+	if (fstat(jfd, &st)) {
+		err = errno;
+	}
+	else if (st.st_size > 0) {
+		struct ext2_super_block sb;
+		int fd = open(filename, O_RDWR);
+		if (fd < 0) {
+			err = errno;
+		}
+		else if (pread(fd, &sb, sizeof(sb), 1024) != sizeof(sb) || sb.s_magic != EXT2_SUPER_MAGIC
+			|| sb.s_log_block_size > EXT2_MAX_BLOCK_LOG_SIZE - EXT2_MIN_BLOCK_LOG_SIZE) {
+			// Case: not an image the journal could belong to
+			close(fd);
+			err = EINVAL;
+		}
+		else {
+			/* no transaction changes the block size, so the superblock on disk gives it */
+			err = journal_replay(jfd, st.st_size, fd, EXT2_MIN_BLOCK_SIZE << sb.s_log_block_size);
+			close(fd);
+		}
+		// Case: a transaction that never finished its commit is dropped
+		if (err == EAGAIN) err = 0;
+	}
+	close(jfd);
+
+	/* the journal must not outlive the blocks it described once they are in place */
+	if (!err && !unlink(path)) err = sync_parent(path);
+	free(path);
+	return err;
+}
+
+
+/*
+ * Returns 1 if block was free in the committed image, so no metadata on disk
+ * refers to it, 0 if it was not, or -1 with errno set if the bitmap could not 
+ * be read. The bitmap of the last group asked about is kept in bitmap.
+ */
+static int journal_block_new(struct ext2_fs *fs, unsigned int block, unsigned char *bitmap, unsigned int *loaded) {
+	if (block < fs->first_data_block) return 0;
+
+	unsigned int group = block_group_of(fs, block);
+	if (*loaded != group) {
+		int err = pread_all(fs->fd, bitmap, fs->block_size, (off_t) fs->block_group[group].bg_block_bitmap * fs->block_size);
+		if (err) {
+			errno = err;
+			return -1;
+		}
+		*loaded = group;
+	}
+	return !check_bit(bitmap, fs->first_data_block + group * fs->blocks_per_group, block);
+}
+
+
+/*
+ * Sorts the blocks of the pages of fs changed since they were last written back
+ * into fresh (free in the committed image) and logged (all others). Pages are 
+ * added to release once all of their blocks are sorted; without commit, pages 
+ * holding a logged block are left out altogether. Returns 0 or an errno value.
+ */
+static int journal_sort(struct ext2_fs *fs, int commit, struct journal_list *fresh, struct journal_list *logged, struct journal_list *release) {
+	uint64_t entries[JOURNAL_PAGEMAP_BATCH];
+	unsigned char bitmap[EXT2_MAX_BLOCK_SIZE];
+	unsigned int loaded = fs->groups_count;
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned int per_page = page / fs->block_size;
+	size_t pages = (fs->disk_size + page - 1) / page;
+	size_t p, i;
+	int err = 0;
+
+	int pagemap = open("/proc/self/pagemap", O_RDONLY);
+	if (pagemap < 0) return errno;
+
+	off_t base = (off_t) ((uintptr_t) fs->disk / page) * sizeof(uint64_t);
+	for (p = 0; p < pages && !err; p += i) {
+		size_t batch = pages - p < JOURNAL_PAGEMAP_BATCH ? pages - p : JOURNAL_PAGEMAP_BATCH;
+		if ((err = pread_all(pagemap, entries, batch * sizeof(uint64_t), base + p * sizeof(uint64_t)))) break;
+
+		for (i = 0; i < batch && !err; i++) {
+			/* a changed page is a private copy (bit 61 clear), in memory (63) or swap (62) */
+			if (!(entries[i] >> 62) || (entries[i] >> 61 & 1)) continue;
+
+			unsigned int first = (p + i) * per_page;
+			unsigned int count = first + per_page > fs->blocks_count ? fs->blocks_count - first : per_page;
+			unsigned int b, old = 0;
+			int state[per_page];
+			for (b = 0; b < count; b++) {
+				if ((state[b] = journal_block_new(fs, first + b, bitmap, &loaded)) < 0) break;
+				old += !state[b];
+			}
+			if (b < count) {
+				err = errno;
+				break;
+			}
+			if (old && !commit) continue;
+
+			for (b = 0; b < count && !err; b++) {
+				err = journal_list_add(state[b] ? fresh : logged, first + b, 1);
+			}
+			if (!err) err = journal_list_add(release, first, count);
+		}
+	}
+	close(pagemap);
+	return err;
+}
+
+
+/*
+ * Writes the blocks in list from the mapping to their place in the image.
+ */
+static int journal_write_in_place(struct ext2_fs *fs, struct journal_list *list) {
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; i < list->count && !err; i++) {
+		struct journal_run *run = &list->runs[i];
+		err = pwrite_all(fs->fd, get_block(fs, run->first), (size_t) run->count * fs->block_size, (off_t) run->first * fs->block_size);
+	}
+	return err;
+}
+
+
+/*
+ * Writes the blocks in logged to the journal as one transaction and syncs it.
+ */
+static int journal_log(struct ext2_fs *fs, struct journal_list *logged) {
+	struct ext2_journal_header *header;
+	unsigned int i, b, n = 0;
+	int err = 0;
+
+	if (fs->journal_fd < 0) {
+		fs->journal_fd = open(fs->journal_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (fs->journal_fd < 0) return errno;
+		if ((err = sync_parent(fs->journal_path))) return err;
+	}
+
+	unsigned int tag_blocks = journal_tag_blocks(logged->blocks, fs->block_size);
+	unsigned char *head = calloc(1 + tag_blocks, fs->block_size);
+	if (head == NULL) return ENOMEM;
+	header = (struct ext2_journal_header *) head;
+	unsigned int *tags = (unsigned int *) (head + fs->block_size);
+
+	for (i = 0; i < logged->count; i++) {
+		for (b = 0; b < logged->runs[i].count; b++) tags[n++] = logged->runs[i].first + b;
+	}
+	header->magic = EXT2_JOURNAL_MAGIC;
+	header->count = logged->blocks;
+	header->checksum = journal_checksum(EXT2_JOURNAL_MAGIC ^ logged->blocks, tags, (size_t) tag_blocks * fs->block_size);
+	for (i = 0; i < logged->count; i++) {
+		header->checksum = journal_checksum(header->checksum, get_block(fs, logged->runs[i].first), (size_t) logged->runs[i].count * fs->block_size);
+	}
+
+	off_t offset = (off_t) (1 + tag_blocks) * fs->block_size;
+	err = pwrite_all(fs->journal_fd, head, offset, 0);
+	for (i = 0; i < logged->count && !err; i++) {
+		size_t len = (size_t) logged->runs[i].count * fs->block_size;
+		err = pwrite_all(fs->journal_fd, get_block(fs, logged->runs[i].first), len, offset);
+		offset += len;
+	}
+	if (!err && fdatasync(fs->journal_fd)) err = errno;
+
+	free(head);
+	return err;
+}
 
-	if(disk == MAP_FAILED) {
-		perror("mmap");
-		exit(1);
+
+/*
+ * Writes back the changed pages of a journaled fs, logging the blocks that need
+ * it if commit is set, and leaving those pages for a later commit otherwise.
+ */
+static int journal_flush(struct ext2_fs *fs, int commit) {
+	struct journal_list fresh = {NULL, 0, 0, 0}, logged = {NULL, 0, 0, 0}, release = {NULL, 0, 0, 0};
+	unsigned int i;
+	int err;
+
+	err = journal_sort(fs, commit, &fresh, &logged, &release);
+
+	/* fresh blocks are invisible until the metadata naming them commits */
+	if (!err) err = journal_write_in_place(fs, &fresh);
+
+	if (!err && commit && (fresh.blocks || logged.blocks)) {
+		if (fdatasync(fs->fd)) err = errno;
+		if (!err && logged.blocks) {
+			if (!(err = journal_log(fs, &logged)) && !(err = journal_write_in_place(fs, &logged))) {
+				if (fdatasync(fs->fd)) err = errno;
+				else if (ftruncate(fs->journal_fd, 0)) err = errno;
+			}
+		}
 	}
 
-	super_block = (struct ext2_super_block *)(disk + 1024);
-	block_group = (struct ext2_group_desc *) (disk + 2*1024);
+	/* the private copies are dropped, the pages fault back in from the file */
+	for (i = 0; i < release.count && !err; i++) {
+		madvise(get_block(fs, release.runs[i].first), (size_t) release.runs[i].count * fs->block_size, MADV_DONTNEED);
+	}
 
-	BLOCK_BITMAP_START = disk + block_group->bg_block_bitmap * EXT2_BLOCK_SIZE;
-	INODE_BITMAP_START = disk + block_group->bg_inode_bitmap * EXT2_BLOCK_SIZE;
+	free(fresh.runs);
+	free(logged.runs);
+	free(release.runs);
+	return err;
+}
 
-	inode = (struct ext2_inode *) ((unsigned char *)disk + block_group->bg_inode_table * EXT2_BLOCK_SIZE);
-	inode --;
-	block = (struct ext2_block *) disk;
 
-	inodes_count = super_block->s_inodes_count;
-	blocks_count = super_block->s_blocks_count;
+int journal_writeback(struct ext2_fs *fs) {
+	if (!(fs->flags & EXT2_FS_JOURNAL)) return 0;
+	return journal_flush(fs, 0);
 }
 
 
+int ext2_commit(struct ext2_fs *fs) {
+	int err;
+
+	if ((err = fs_writable(fs))) return err;
+	if (!(fs->flags & EXT2_FS_JOURNAL)) return msync(fs->disk, fs->disk_size, MS_SYNC) ? errno : 0;
+
+	if (fs->counters_deferred) sync_counters(fs);
+	return journal_flush(fs, 1);
+}
+
 
 
 
@@ -62,629 +623,5463 @@ int check_bit(unsigned char *first, int start_index, int target_index) {
 }
 
 
+void set_bit_range(unsigned char *first, int start_index, int target_index, int count) {
+	unsigned int bit = target_index - start_index;
+	for (; count > 0 && bit % 8; count--, bit++) 
+		first[bit >> 3] |= 1 << (bit % 8);
+	memset(first + (bit >> 3), 0xff, count >> 3);
+	bit += count & ~7;
+	for (count %= 8; count > 0; count--, bit++) 
+		first[bit >> 3] |= 1 << (bit % 8);
+}
 
 
-/* BITMAP INODE OPERATIONS */
+void unset_bit_range(unsigned char *first, int start_index, int target_index, int count) {
+	unsigned int bit = target_index - start_index;
+	for (; count > 0 && bit % 8; count--, bit++) 
+		first[bit >> 3] &= ~(1 << (bit % 8));
+	memset(first + (bit >> 3), 0, count >> 3);
+	bit += count & ~7;
+	for (count %= 8; count > 0; count--, bit++) 
+		first[bit >> 3] &= ~(1 << (bit % 8));
+}
 
-void inode_bitmap_set(int target_index) {
-	set_bit(INODE_BITMAP_START, 1, target_index);
+
+/*
+ * Returns how many of lo..hi-1 are base plus a multiple of step (just base when
+ * step is 0).
+ */
+static unsigned int count_boundaries(unsigned long long lo, unsigned long long hi, unsigned long long base, unsigned long long step) {
+	if (hi <= base) return 0;
+	if (lo < base) lo = base;
+	if (lo >= hi) return 0;
+	if (step == 0) return lo == base;
+	return (hi - base + step - 1) / step - (lo - base + step - 1) / step;
+}
+
+
+/*
+ * Loads 64 bit word of bitmap, with bits at or beyond nbits reading as set.
+ * Bitmaps are little endian bit strings, so bit n of the word is bit n of the run.
+ */
+static uint64_t bitmap_word(unsigned char *first, unsigned int word, unsigned int nbits) {
+	uint64_t w = 0;
+	unsigned int bit = word * 64;
+	unsigned int bytes = (nbits - bit + 7) / 8;
+
+	if (bytes >= 8) {
+		memcpy(&w, first + word * 8, 8);
+	}
+	else {
+		memcpy(&w, first + word * 8, bytes);
+	}
+	if (nbits - bit < 64) {
+		w |= ~(uint64_t) 0 << (nbits - bit);
+	}
+	return w;
 }
 
 
-void inode_bitmap_unset(int target_index) {
-	unset_bit(INODE_BITMAP_START, 1, target_index);
+int find_zero_bit(unsigned char *first, unsigned int nbits, unsigned int start) {
+	unsigned int word;
+	uint64_t w;
+
+	if (start >= nbits) return -1;
+
+	/* mask off the bits before start in the first word */
+	word = start / 64;
+	w = bitmap_word(first, word, nbits) | ((((uint64_t) 1) << (start % 64)) - 1);
+
+	while (1) {
+		if (~w) 
+			return word * 64 + __builtin_ctzll(~w);
+		if (++word * 64 >= nbits) 
+			return -1;
+		w = bitmap_word(first, word, nbits);
+	}
 }
 
 
-int inode_available(int target_index) {
-	return !check_bit(INODE_BITMAP_START, 1, target_index);
+unsigned int count_zero_bits(unsigned char *first, unsigned int nbits) {
+	unsigned int word, count = 0;
+
+	for (word = 0; word * 64 < nbits; word++) {
+		count += 64 - __builtin_popcountll(bitmap_word(first, word, nbits));
+	}
+	return count;
 }
 
 
+unsigned int find_set_bit(unsigned char *first, unsigned int nbits, unsigned int start) {
+	unsigned int word;
+	uint64_t w;
 
+	if (start >= nbits) return nbits;
 
-/* BITMAP BLOCK OPERATIONS */
+	word = start / 64;
+	w = bitmap_word(first, word, nbits) & ~((((uint64_t) 1) << (start % 64)) - 1);
 
-void block_bitmap_set(int target_index) {
-	set_bit(BLOCK_BITMAP_START, 1, target_index);
+	while (!w) {
+		if (++word * 64 >= nbits) 
+			return nbits;
+		w = bitmap_word(first, word, nbits);
+	}
+	return word * 64 + __builtin_ctzll(w);
 }
 
 
-void block_bitmap_unset(int target_index) {
-	unset_bit(BLOCK_BITMAP_START, 1, target_index);
+unsigned int find_diff_bit(unsigned char *a, unsigned char *b, unsigned int nbits, unsigned int start) {
+	unsigned int word;
+	uint64_t w;
+
+	if (start >= nbits) return nbits;
+
+	word = start / 64;
+	w = (bitmap_word(a, word, nbits) ^ bitmap_word(b, word, nbits)) & ~((((uint64_t) 1) << (start % 64)) - 1);
+
+	while (!w) {
+		if (++word * 64 >= nbits) 
+			return nbits;
+		w = bitmap_word(a, word, nbits) ^ bitmap_word(b, word, nbits);
+	}
+	return word * 64 + __builtin_ctzll(w);
 }
 
 
-int block_available(int target_index) {
-	return !check_bit(BLOCK_BITMAP_START, 1, target_index);
+
+
+/* FREE SPACE INDEX */
+
+struct extent_node {
+	unsigned int start, len;
+	unsigned int longest;  /* longest len in the subtree */
+	unsigned int priority; /* heap order, higher nearer the root */
+	struct extent_node *left, *right;
+};
+
+
+static void extent_update(struct extent_node *node) {
+	node->longest = node->len;
+	if (node->left && node->left->longest > node->longest) node->longest = node->left->longest;
+	if (node->right && node->right->longest > node->longest) node->longest = node->right->longest;
 }
 
 
+static struct extent_node *extent_node_new(struct extent_tree *tree, unsigned int start, unsigned int len) {
+	struct extent_node *node = tree->spare;
 
+	if (node) tree->spare = node->right;
+	else if ((node = malloc(sizeof(struct extent_node))) == NULL) {
+		tree->stale = 1;
+		return NULL;
+	}
 
-/* ALLOCATION / DEALLOCATION */
+	/* xorshift, seeded from the tree's address */
+	if (tree->seed == 0) tree->seed = (unsigned int) (uintptr_t) tree | 1;
+	tree->seed ^= tree->seed << 13;
+	tree->seed ^= tree->seed >> 17;
+	tree->seed ^= tree->seed << 5;
+
+	node->start = start;
+	node->len = node->longest = len;
+	node->priority = tree->seed;
+	node->left = node->right = NULL;
+	return node;
+}
 
-unsigned int allocate_block() {
-	unsigned int i;
-	for (i = 1; i <= blocks_count; i++) {
-		if (block_available(i)) {
-			// Case: block[i] available
-			block_bitmap_set(i);
-			super_block->s_free_blocks_count --;
-			block_group->bg_free_blocks_count --;
-			clear_block(&block[i]);
-			return i;
-		}
-	}  
-	// Case: no blocks available
-	fprintf(stderr, "failed to allocate block");
-	exit(ENOMEM);
+
+static void extent_node_free(struct extent_tree *tree, struct extent_node *node) {
+	node->right = tree->spare;
+	tree->spare = node;
 }
 
 
-unsigned int allocate_inode() {
-	unsigned int i;
-	for (i = 12; i <= inodes_count; i++) {
-		if (inode_available(i)) {
-			// Case: inode[i] available
-			inode_bitmap_set(i);
-			super_block->s_free_inodes_count --;
-			block_group->bg_free_inodes_count --;
-			inode[i].i_size = 0;
-			inode[i].i_mode = (inode[i].i_mode << 4) >> 4;
-			inode[i].i_links_count = 0;
-			inode[i].i_blocks = 0;
-			return i;
-		}
+/*
+ * Splits treap at node into extents starting before key (left) and the rest (right).
+ */
+static void extent_split(struct extent_node *node, unsigned int key, struct extent_node **left, struct extent_node **right) {
+	if (node == NULL) {
+		*left = *right = NULL;
+	}
+	else if (node->start < key) {
+		extent_split(node->right, key, &node->right, right);
+		*left = node;
+		extent_update(node);
+	}
+	else {
+		extent_split(node->left, key, left, &node->left);
+		*right = node;
+		extent_update(node);
 	}
-	// Case: no inodes available
-	fprintf(stderr, "failed to allocate inode");
-	exit(ENOMEM);
 }
 
 
-void free_block(int block_index) {
-	block_bitmap_unset(block_index);
-	super_block->s_free_blocks_count ++;
-	block_group->bg_free_blocks_count ++;
+/*
+ * Joins treaps left and right, every extent of left starting before those of right.
+ */
+static struct extent_node *extent_join(struct extent_node *left, struct extent_node *right) {
+	if (left == NULL) return right;
+	if (right == NULL) return left;
+	if (left->priority > right->priority) {
+		left->right = extent_join(left->right, right);
+		extent_update(left);
+		return left;
+	}
+	right->left = extent_join(left, right->left);
+	extent_update(right);
+	return right;
 }
 
 
-void free_inode(int inode_index) {
-  struct ptr_with_err result;
-	struct next_slot_state state;
-	initialize_state(&state, inode_index);
+/*
+ * Detaches and returns the last / first extent of treap at root, or NULL if empty.
+ */
+static struct extent_node *extent_pop_last(struct extent_node **root) {
+	struct extent_node *node = *root;
+	if (node == NULL) return NULL;
+	if (node->right == NULL) {
+		*root = node->left;
+		node->left = NULL;
+		extent_update(node);
+		return node;
+	}
+	struct extent_node *last = extent_pop_last(&node->right);
+	extent_update(node);
+	return last;
+}
 
-	/* free all associated blocks */
-	while (1) {
-		result = next_slot(&state);
-		if (result.ptr != NULL && result.err == NO_ERR) {
-			free_block(*((unsigned int *) result.ptr));
-			*((unsigned int *) result.ptr) = 0;
+
+static struct extent_node *extent_pop_first(struct extent_node **root) {
+	struct extent_node *node = *root;
+	if (node == NULL) return NULL;
+	if (node->left == NULL) {
+		*root = node->right;
+		node->right = NULL;
+		extent_update(node);
+		return node;
+	}
+	struct extent_node *first = extent_pop_first(&node->left);
+	extent_update(node);
+	return first;
+}
+
+
+static void extent_free_all(struct extent_tree *tree, struct extent_node *node) {
+	if (node == NULL) return;
+	extent_free_all(tree, node->left);
+	extent_free_all(tree, node->right);
+	extent_node_free(tree, node);
+}
+
+
+void extent_remove(struct extent_tree *tree, unsigned int start, unsigned int len) {
+	struct extent_node *left, *middle, *right, *last, *tail = NULL;
+	unsigned int end = start + len;
+
+	extent_split(tree->root, start, &left, &right);
+
+	/* an extent starting before the range may reach into or across it */
+	if ((last = extent_pop_last(&left))) {
+		unsigned int last_end = last->start + last->len;
+		if (last_end > end) tail = extent_node_new(tree, end, last_end - end);
+		if (last_end > start) last->len = start - last->start;
+		extent_update(last);
+		left = extent_join(left, last);
+	}
+
+	/* extents starting within the range go, the last keeping what lies past it */
+	extent_split(right, end, &middle, &right);
+	if ((last = extent_pop_last(&middle))) {
+		if (last->start + last->len > end) tail = extent_node_new(tree, end, last->start + last->len - end);
+		extent_node_free(tree, last);
+		extent_free_all(tree, middle);
+	}
+
+	if (tail) right = extent_join(tail, right);
+	tree->root = extent_join(left, right);
+}
+
+
+void extent_insert(struct extent_tree *tree, unsigned int start, unsigned int len) {
+	struct extent_node *left, *right, *node;
+	unsigned int end = start + len;
+
+	if (len == 0) return;
+
+	/* whatever of the range is free already is taken out first, so extents stay disjoint */
+	extent_remove(tree, start, len);
+	extent_split(tree->root, start, &left, &right);
+
+	/* join the neighbours it touches, unless a span boundary lies between */
+	if ((start - tree->base) % tree->span && (node = extent_pop_last(&left))) {
+		if (node->start + node->len == start) {
+			start = node->start;
+			extent_node_free(tree, node);
 		}
 		else {
-			break;
+			left = extent_join(left, node);
+		}
+	}
+	if ((end - tree->base) % tree->span && (node = extent_pop_first(&right))) {
+		if (node->start == end) {
+			end += node->len;
+			extent_node_free(tree, node);
+		}
+		else {
+			right = extent_join(node, right);
 		}
 	}
 
-	/* free inode */
-	inode_bitmap_unset(inode_index);
-	super_block->s_free_inodes_count ++;
-	block_group->bg_free_inodes_count ++;
-	inode[inode_index].i_links_count = 0;
+	node = extent_node_new(tree, start, end - start);
+	tree->root = extent_join(extent_join(left, node), right);
 }
 
 
-void clear_block(struct ext2_block *b) {
-	unsigned int i;
-	for (i = 0; i < EXT2_ADDR_PER_BLOCK; i++) {
-		b->addr[i] = 0; 
+/*
+ * Returns the first extent under node holding min units at or after goal.
+ */
+static struct extent_node *extent_search(struct extent_node *node, unsigned int goal, unsigned int min) {
+	while (node && node->longest >= min) {
+		if (node->start + node->len <= goal) {
+			// Case: node ends before goal, as does everything to its left
+			node = node->right;
+			continue;
+		}
+		struct extent_node *found = extent_search(node->left, goal, min);
+		if (found) return found;
+		if (node->start + node->len - (node->start > goal ? node->start : goal) >= min) return node;
+		node = node->right;
 	}
+	return NULL;
 }
 
 
+int extent_find(struct extent_tree *tree, unsigned int goal, unsigned int min, unsigned int *start, unsigned int *len) {
+	struct extent_node *node = extent_search(tree->root, goal, min ? min : 1);
+	if (node == NULL) return 0;
 
-/* COPY OPERATIONS */
+	*start = node->start > goal ? node->start : goal;
+	*len = node->start + node->len - *start;
+	return 1;
+}
 
-char *copy_str(char *str) {
-	char *copy = malloc(strlen(str) + 1);
-	strcpy(copy, str);
-	return copy;
+
+unsigned int extent_longest(struct extent_tree *tree) {
+	return tree->root ? tree->root->longest : 0;
 }
 
 
-void copy_block(struct ext2_block *blk_src, struct ext2_block *blk_dest) {
-	unsigned int i;
-	for (i = 0; i < EXT2_ADDR_PER_BLOCK; i++) {
-		blk_dest->addr[i] = blk_src->addr[i]; 
+void extent_tree_clear(struct extent_tree *tree) {
+	struct extent_node *node;
+
+	extent_free_all(tree, tree->root);
+	tree->root = NULL;
+	while ((node = tree->spare)) {
+		tree->spare = node->right;
+		free(node);
 	}
+	tree->stale = 0;
 }
 
 
-void copy_inode(unsigned int inode_src, unsigned int inode_dest) {
-	struct ptr_with_err result;
-	struct next_slot_state state;
+/*
+ * Fills tree with the runs of clear bits of nbits bit bitmap, whose bit 0 stands
+ * for unit first.
+ */
+static void extent_tree_add_bitmap(struct extent_tree *tree, unsigned char *bitmap, unsigned int nbits, unsigned int first) {
+	int bit = 0;
+
+	while ((bit = find_zero_bit(bitmap, nbits, bit)) >= 0) {
+		unsigned int end = find_set_bit(bitmap, nbits, bit);
+		struct extent_node *node = extent_node_new(tree, first + bit, end - bit);
+		if (node == NULL) return;
+		/* bitmaps are read in order, so each run goes last */
+		tree->root = extent_join(tree->root, node);
+		bit = end;
+	}
+}
 
-	initialize_state(&state, inode_src);
-	while (1) {
-		result = next_slot(&state);
-		if (result.ptr != NULL && result.err == NO_ERR) {
-			unsigned int new_block = allocate_block();
-			inode_add_block(inode_dest, new_block);
-			copy_block(&block[*((unsigned int *) result.ptr)], &block[new_block]);
-		}
-		else {
-			break;
+
+int free_index_build(struct ext2_fs *fs) {
+	unsigned int g;
+
+	extent_tree_clear(&fs->free_blocks);
+	extent_tree_clear(&fs->free_inodes);
+	fs->free_blocks.base = fs->first_data_block;
+	fs->free_blocks.span = fs->blocks_per_group;
+	fs->free_inodes.base = 1;
+	fs->free_inodes.span = fs->inodes_per_group;
+
+	for (g = 0; g < fs->groups_count; g++) {
+		extent_tree_add_bitmap(&fs->free_blocks, group_block_bitmap(fs, g), group_blocks_count(fs, g), fs->first_data_block + g * fs->blocks_per_group);
+		extent_tree_add_bitmap(&fs->free_inodes, group_inode_bitmap(fs, g), group_inodes_count(fs, g), 1 + g * fs->inodes_per_group);
+	}
+	return (fs->free_blocks.stale || fs->free_inodes.stale) ? ENOMEM : 0;
+}
+
+
+/*
+ * Rebuilds the indices of fs if an update of either was lost. Returns 0 or ENOMEM.
+ */
+static int free_index_check(struct ext2_fs *fs) {
+	if (!fs->free_blocks.stale && !fs->free_inodes.stale) return 0;
+	return free_index_build(fs);
+}
+
+
+unsigned int longest_free_run(struct ext2_fs *fs) {
+	return extent_longest(&fs->free_blocks);
+}
+
+
+
+
+/* BITMAP INODE OPERATIONS */
+
+void inode_bitmap_set(struct ext2_fs *fs, int target_index) {
+	unsigned int group = inode_group(fs, target_index);
+	if (!inode_available(fs, target_index)) return;
+	set_bit(group_inode_bitmap(fs, group), 1 + group * fs->inodes_per_group, target_index);
+	extent_remove(&fs->free_inodes, target_index, 1);
+}
+
+
+void inode_bitmap_unset(struct ext2_fs *fs, int target_index) {
+	unsigned int group = inode_group(fs, target_index);
+	if (inode_available(fs, target_index)) return;
+	unset_bit(group_inode_bitmap(fs, group), 1 + group * fs->inodes_per_group, target_index);
+	extent_insert(&fs->free_inodes, target_index, 1);
+}
+
+
+int inode_available(struct ext2_fs *fs, int target_index) {
+	unsigned int group = inode_group(fs, target_index);
+	return !check_bit(group_inode_bitmap(fs, group), 1 + group * fs->inodes_per_group, target_index);
+}
+
+
+
+
+/* BITMAP BLOCK OPERATIONS */
+
+void block_bitmap_set(struct ext2_fs *fs, int target_index) {
+	unsigned int group = block_group_of(fs, target_index);
+	if (!block_available(fs, target_index)) return;
+	set_bit(group_block_bitmap(fs, group), fs->first_data_block + group * fs->blocks_per_group, target_index);
+	extent_remove(&fs->free_blocks, target_index, 1);
+}
+
+
+void block_bitmap_unset(struct ext2_fs *fs, int target_index) {
+	unsigned int group = block_group_of(fs, target_index);
+	if (block_available(fs, target_index)) return;
+	unset_bit(group_block_bitmap(fs, group), fs->first_data_block + group * fs->blocks_per_group, target_index);
+	extent_insert(&fs->free_blocks, target_index, 1);
+}
+
+
+int block_available(struct ext2_fs *fs, int target_index) {
+	unsigned int group = block_group_of(fs, target_index);
+	return !check_bit(group_block_bitmap(fs, group), fs->first_data_block + group * fs->blocks_per_group, target_index);
+}
+
+
+
+
+/* ALLOCATION / DEALLOCATION */
+
+/*
+ * Adjusts the free block counts of group and superblock, unless counters are deferred.
+ */
+static void count_free_blocks(struct ext2_fs *fs, unsigned int group, int delta) {
+	if (fs->counters_deferred) return;
+	fs->super_block->s_free_blocks_count += delta;
+	fs->block_group[group].bg_free_blocks_count += delta;
+}
+
+
+static void count_free_inodes(struct ext2_fs *fs, unsigned int group, int delta) {
+	if (fs->counters_deferred) return;
+	fs->super_block->s_free_inodes_count += delta;
+	fs->block_group[group].bg_free_inodes_count += delta;
+}
+
+
+void defer_counters(struct ext2_fs *fs) {
+	fs->counters_deferred = 1;
+}
+
+
+void sync_counters(struct ext2_fs *fs) {
+	unsigned int g, free_blocks = 0, free_inodes = 0;
+
+	for (g = 0; g < fs->groups_count; g++) {
+		fs->block_group[g].bg_free_blocks_count = count_zero_bits(group_block_bitmap(fs, g), group_blocks_count(fs, g));
+		fs->block_group[g].bg_free_inodes_count = count_zero_bits(group_inode_bitmap(fs, g), group_inodes_count(fs, g));
+		free_blocks += fs->block_group[g].bg_free_blocks_count;
+		free_inodes += fs->block_group[g].bg_free_inodes_count;
+	}
+	fs->super_block->s_free_blocks_count = free_blocks;
+	fs->super_block->s_free_inodes_count = free_inodes;
+	fs->counters_deferred = 0;
+}
+
+
+unsigned int allocate_block(struct ext2_fs *fs) {
+	unsigned int i, len;
+
+	/* first free block from the cursor, wrapping around to the start */
+	if (free_index_check(fs) || (!extent_find(&fs->free_blocks, fs->block_cursor, 1, &i, &len) 
+		&& !extent_find(&fs->free_blocks, 0, 1, &i, &len))) {
+		// Case: no blocks available
+		return 0;
+	}
+
+	block_bitmap_set(fs, i);
+	count_free_blocks(fs, block_group_of(fs, i), -1);
+	clear_block(fs, get_block(fs, i));
+	fs->block_cursor = i + 1;
+	return i;
+}
+
+
+unsigned int allocate_block_run(struct ext2_fs *fs, unsigned int goal, unsigned int min, unsigned int max, unsigned int *count) {
+	unsigned int run_start, len;
+
+	/* nothing below the cursor is free, so never search there */
+	if (goal < fs->block_cursor || goal >= fs->blocks_count) goal = fs->block_cursor;
+
+	/* first fit from goal, wrapping around to the start */
+	if (free_index_check(fs) || (!extent_find(&fs->free_blocks, goal, min, &run_start, &len) 
+		&& !extent_find(&fs->free_blocks, 0, min, &run_start, &len))) {
+		// Case: no run of min blocks available
+		*count = 0;
+		return 0;
+	}
+
+	unsigned int g = block_group_of(fs, run_start);
+	unsigned int first = fs->first_data_block + g * fs->blocks_per_group;
+	if (len > max) len = max;
+	set_bit_range(group_block_bitmap(fs, g), first, run_start, len);
+	extent_remove(&fs->free_blocks, run_start, len);
+	count_free_blocks(fs, g, -(int) len);
+	if (run_start <= fs->block_cursor) fs->block_cursor = run_start + len;
+	*count = len;
+	return run_start;
+}
+
+
+/*
+ * Clears the fields of a newly allocated inode that are read before being set.
+ */
+static void inode_reset(struct ext2_inode *in) {
+	in->i_size = 0;
+	in->i_mode &= 07777;
+	in->i_links_count = 0;
+	in->i_blocks = 0;
+	in->i_dtime = 0;
+}
+
+
+/*
+ * Finds the first free inode from low, wrapping around to the first one handed
+ * out, setting start and len to the extent of free inodes there. Returns 1, or
+ * 0 if there is none.
+ */
+static int find_free_inodes(struct ext2_fs *fs, unsigned int low, unsigned int *start, unsigned int *len) {
+	if (low < EXT2_FIRST_ALLOC_INO) low = EXT2_FIRST_ALLOC_INO;
+	if (free_index_check(fs)) return 0;
+	return extent_find(&fs->free_inodes, low, 1, start, len) || extent_find(&fs->free_inodes, EXT2_FIRST_ALLOC_INO, 1, start, len);
+}
+
+
+unsigned int allocate_inode(struct ext2_fs *fs) {
+	unsigned int i, len;
+
+	if (!find_free_inodes(fs, fs->inode_cursor, &i, &len)) {
+		// Case: no inodes available
+		return 0;
+	}
+
+	inode_bitmap_set(fs, i);
+	count_free_inodes(fs, inode_group(fs, i), -1);
+	inode_reset(get_inode(fs, i));
+	fs->inode_cursor = i + 1;
+	return i;
+}
+
+
+unsigned int allocate_inodes(struct ext2_fs *fs, unsigned int group, unsigned int count, unsigned int *inodes) {
+	unsigned int start, len, i, done = 0;
+	unsigned int low = 1 + group * fs->inodes_per_group;
+
+	/* take whole extents, each within one group and counted once for it */
+	while (done < count && find_free_inodes(fs, low, &start, &len)) {
+		unsigned int g = inode_group(fs, start);
+		if (len > count - done) len = count - done;
+
+		set_bit_range(group_inode_bitmap(fs, g), 1 + g * fs->inodes_per_group, start, len);
+		extent_remove(&fs->free_inodes, start, len);
+		count_free_inodes(fs, g, -(int) len);
+		for (i = 0; i < len; i++) {
+			inode_reset(get_inode(fs, start + i));
+			inodes[done++] = start + i;
+		}
+		low = start + len;
+	}
+	return done;
+}
+
+
+unsigned int find_group_dir(struct ext2_fs *fs, unsigned int parent_inode) {
+	unsigned int groups = fs->groups_count, parent_group = inode_group(fs, parent_inode);
+	unsigned int free_inodes = 0, free_blocks = 0, dirs = 0;
+	unsigned int g, n;
+
+	for (g = 0; g < groups; g++) {
+		free_inodes += fs->block_group[g].bg_free_inodes_count;
+		free_blocks += fs->block_group[g].bg_free_blocks_count;
+		dirs += fs->block_group[g].bg_used_dirs_count;
+	}
+	unsigned int avg_inodes = free_inodes / groups, avg_blocks = free_blocks / groups;
+
+	if (parent_inode == EXT2_ROOT_INO) {
+		// Case: top level directory, likely to head an unrelated tree
+		unsigned int best = groups;
+		for (n = 0, g = parent_group; n < groups; n++, g = (g + 1) % groups) {
+			struct ext2_group_desc *desc = &fs->block_group[g];
+			if (desc->bg_free_inodes_count == 0 || desc->bg_free_inodes_count < avg_inodes || desc->bg_free_blocks_count < avg_blocks) continue;
+			if (best == groups || desc->bg_used_dirs_count < fs->block_group[best].bg_used_dirs_count 
+				|| (desc->bg_used_dirs_count == fs->block_group[best].bg_used_dirs_count && desc->bg_free_blocks_count > fs->block_group[best].bg_free_blocks_count)) {
+				best = g;
+			}
+		}
+		if (best < groups) return best;
+	}
+	else {
+		/* stay near the parent, unless its group is filling up or holds too many directories */
+		unsigned int max_dirs = dirs / groups + fs->inodes_per_group / 16;
+		unsigned int min_inodes = avg_inodes > fs->inodes_per_group / 4 ? avg_inodes - fs->inodes_per_group / 4 : 1;
+		unsigned int min_blocks = avg_blocks > fs->blocks_per_group / 4 ? avg_blocks - fs->blocks_per_group / 4 : 0;
+		if (min_inodes == 0) min_inodes = 1;
+		for (n = 0, g = parent_group; n < groups; n++, g = (g + 1) % groups) {
+			struct ext2_group_desc *desc = &fs->block_group[g];
+			if (desc->bg_used_dirs_count < max_dirs && desc->bg_free_inodes_count >= min_inodes && desc->bg_free_blocks_count >= min_blocks) return g;
+		}
+	}
+
+	// Case: space is short everywhere, take the first group with a free inode
+	for (n = 0, g = parent_group; n < groups; n++, g = (g + 1) % groups) {
+		if (fs->block_group[g].bg_free_inodes_count) return g;
+	}
+	return parent_group;
+}
+
+
+unsigned int find_group_file(struct ext2_fs *fs, unsigned int parent_inode) {
+	unsigned int groups = fs->groups_count, parent_group = inode_group(fs, parent_inode);
+	unsigned int g, n;
+
+	for (n = 0, g = parent_group; n < groups; n++, g = (g + 1) % groups) {
+		if (fs->block_group[g].bg_free_inodes_count && fs->block_group[g].bg_free_blocks_count) return g;
+	}
+	for (n = 0, g = parent_group; n < groups; n++, g = (g + 1) % groups) {
+		if (fs->block_group[g].bg_free_inodes_count) return g;
+	}
+	return parent_group;
+}
+
+
+unsigned int allocate_inode_near(struct ext2_fs *fs, unsigned int parent_inode, int dir) {
+	unsigned int i, len;
+	unsigned int group = dir ? find_group_dir(fs, parent_inode) : find_group_file(fs, parent_inode);
+
+	if (!find_free_inodes(fs, 1 + group * fs->inodes_per_group, &i, &len)) {
+		// Case: no inodes available
+		return 0;
+	}
+
+	inode_bitmap_set(fs, i);
+	count_free_inodes(fs, inode_group(fs, i), -1);
+	inode_reset(get_inode(fs, i));
+	return i;
+}
+
+
+unsigned int inode_goal(struct ext2_fs *fs, unsigned int inode_index) {
+	return fs->first_data_block + inode_group(fs, inode_index) * fs->blocks_per_group;
+}
+
+
+unsigned int allocate_block_near(struct ext2_fs *fs, unsigned int goal) {
+	unsigned int i, len;
+
+	if (free_index_check(fs) || (!extent_find(&fs->free_blocks, goal, 1, &i, &len) 
+		&& !extent_find(&fs->free_blocks, 0, 1, &i, &len))) {
+		// Case: no blocks available
+		return 0;
+	}
+
+	block_bitmap_set(fs, i);
+	count_free_blocks(fs, block_group_of(fs, i), -1);
+	clear_block(fs, get_block(fs, i));
+	if (i == fs->block_cursor) fs->block_cursor = i + 1;
+	return i;
+}
+
+
+void free_block(struct ext2_fs *fs, int block_index) {
+	/* shared blocks only lose an owner */
+	if (block_unref(fs, block_index)) return;
+	block_bitmap_unset(fs, block_index);
+	count_free_blocks(fs, block_group_of(fs, block_index), 1);
+	if (block_index < fs->block_cursor) fs->block_cursor = block_index;
+}
+
+
+void free_block_run(struct ext2_fs *fs, unsigned int block_index, unsigned int count) {
+	while (count > 0) {
+		unsigned int g = block_group_of(fs, block_index);
+		unsigned int first = fs->first_data_block + g * fs->blocks_per_group;
+		unsigned int n = first + group_blocks_count(fs, g) - block_index;
+		if (n > count) n = count;
+
+		unset_bit_range(group_block_bitmap(fs, g), first, block_index, n);
+		extent_insert(&fs->free_blocks, block_index, n);
+		count_free_blocks(fs, g, n);
+		if (block_index < fs->block_cursor) fs->block_cursor = block_index;
+
+		block_index += n;
+		count -= n;
+	}
+}
+
+
+unsigned int block_run_next(struct ext2_fs *fs, struct block_run *run) {
+	if (run->count == 0) {
+		unsigned int goal = run->next;
+		unsigned int wanted = run->wanted;
+		if (wanted == 0) wanted = BLOCK_RUN_UNKNOWN;
+		if (wanted > BLOCK_RUN_MAX) wanted = BLOCK_RUN_MAX;
+		run->next = allocate_block_run(fs, goal, 1, wanted, &run->count);
+		if (run->count == 0) {
+			run->next = goal;
+			return 0;
+		}
+	}
+	run->count --;
+	if (run->wanted) run->wanted --;
+	return run->next ++;
+}
+
+
+void block_run_release(struct ext2_fs *fs, struct block_run *run) {
+	if (run->count) free_block_run(fs, run->next, run->count);
+	run->count = 0;
+}
+
+
+void free_inode(struct ext2_fs *fs, int inode_index) {
+	struct ext2_inode *in = get_inode(fs, inode_index);
+
+	/* target text of a fast symlink would read as block indices once the inode is reused */
+	if (inode_fast_symlink(fs, inode_index)) memset(in->i_block, 0, sizeof(in->i_block));
+
+	/* free all associated blocks, the indirect blocks mapping them included */
+	inode_truncate(fs, inode_index, 0);
+
+	/* free inode */
+	inode_bitmap_unset(fs, inode_index);
+	count_free_inodes(fs, inode_group(fs, inode_index), 1);
+	in->i_links_count = 0;
+	in->i_dtime = time(NULL);
+	if (inode_index < fs->inode_cursor) fs->inode_cursor = inode_index;
+}
+
+
+void clear_block(struct ext2_fs *fs, struct ext2_block *b) {
+	unsigned int i;
+	for (i = 0; i < fs->addr_per_block; i++) {
+		b->addr[i] = 0; 
+	}
+}
+
+
+
+/* COPY OPERATIONS */
+
+char *copy_str(char *str) {
+	char *copy = malloc(strlen(str) + 1);
+	strcpy(copy, str);
+	return copy;
+}
+
+
+void copy_block(struct ext2_fs *fs, struct ext2_block *blk_src, struct ext2_block *blk_dest) {
+	memcpy(blk_dest, blk_src, fs->block_size);
+}
+
+
+/*
+ * Stretch of blocks contiguous in both source and destination of a copy.
+ */
+struct copy_extent {
+	unsigned int src, dest, count;
+};
+
+struct copy_share {
+	struct ext2_fs *fs;
+	struct copy_extent *extents;
+	unsigned int first, last; /* extents [first, last) */
+};
+
+
+static void *copy_extents(void *arg) {
+	struct copy_share *share = arg;
+	unsigned int i;
+
+	for (i = share->first; i < share->last; i++) {
+		struct copy_extent *e = &share->extents[i];
+		memcpy(get_block(share->fs, e->dest), get_block(share->fs, e->src), (size_t) e->count * share->fs->block_size);
+	}
+	return NULL;
+}
+
+
+/*
+ * Copies every extent, splitting them in shares of about equal size over 
+ * threads when there is enough data to be worth it.
+ */
+static void copy_extents_parallel(struct ext2_fs *fs, struct copy_extent *extents, unsigned int count, unsigned long long blocks) {
+	struct copy_share shares[COPY_MAX_THREADS];
+	pthread_t tids[COPY_MAX_THREADS];
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int i, t, started = 0;
+
+	if (threads > COPY_MAX_THREADS) threads = COPY_MAX_THREADS;
+	if (threads > (long) (blocks / COPY_THREAD_BLOCKS)) threads = blocks / COPY_THREAD_BLOCKS;
+	if (threads > (long) count) threads = count;
+	if (threads < 2) {
+		struct copy_share all = {fs, extents, 0, count};
+		copy_extents(&all);
+		return;
+	}
+
+	/* cut the extent list where the running total passes each share's end */
+	unsigned long long done = 0;
+	for (i = 0, t = 0; t < threads; t++) {
+		shares[t].fs = fs;
+		shares[t].extents = extents;
+		shares[t].first = i;
+		while (i < count && (t == threads - 1 || done < blocks * (t + 1) / threads)) {
+			done += extents[i++].count;
+		}
+		shares[t].last = i;
+	}
+
+	/* the calling thread takes the first share */
+	for (t = 1; t < threads; t++) {
+		if (pthread_create(&tids[t], NULL, copy_extents, &shares[t])) break;
+	}
+	started = t;
+	for (; t < threads; t++) copy_extents(&shares[t]);
+	copy_extents(&shares[0]);
+	for (t = 1; t < started; t++) pthread_join(tids[t], NULL);
+}
+
+
+int copy_inode(struct ext2_fs *fs, unsigned int inode_src, unsigned int inode_dest) {
+	struct ptr_with_err result;
+	struct next_slot_state state;
+	struct block_map_cursor cursor;
+	struct copy_extent *extents = NULL;
+	unsigned int count = 0, capacity = 0;
+	unsigned long long blocks = 0;
+	unsigned int new_block;
+	int err = fs_writable(fs);
+	if (err) return err;
+
+	unsigned int data_blocks = inode_data_blocks(fs, inode_src);
+	struct block_run run = {0, 0, data_blocks + indirect_blocks_needed(fs, 0, data_blocks)};
+
+	/* build the whole destination map first, noting which blocks go where */
+	block_map_init(fs, &cursor, inode_dest, 0, &run);
+	initialize_state(fs, &state, inode_src);
+	while ((result = next_slot(&state)).ptr != NULL && result.err == NO_ERR) {
+		unsigned int src = *((unsigned int *) result.ptr);
+		block_map_seek(&cursor, state.logical);
+		if ((err = block_map_append_run(&cursor, &new_block))) break;
+		blocks ++;
+
+		if (count && extents[count - 1].src + extents[count - 1].count == src && extents[count - 1].dest + extents[count - 1].count == new_block) {
+			// Case: continues the last extent on both sides
+			extents[count - 1].count ++;
+			continue;
+		}
+		if (count == capacity) {
+			unsigned int grown = capacity ? capacity * 2 : 64;
+			struct copy_extent *more = realloc(extents, grown * sizeof(struct copy_extent));
+			if (more == NULL) {
+				err = ENOMEM;
+				break;
+			}
+			extents = more;
+			capacity = grown;
+		}
+		extents[count].src = src;
+		extents[count].dest = new_block;
+		extents[count].count = 1;
+		count ++;
+	}
+	block_run_release(fs, &run);
+	block_map_finish(&cursor);
+
+	/* then move the data, one memcpy per extent */
+	if (!err) copy_extents_parallel(fs, extents, count, blocks);
+	free(extents);
+	if (err) return err;
+
+	get_inode(fs, inode_dest)->i_mode = get_inode(fs, inode_src)->i_mode;
+	get_inode(fs, inode_dest)->i_size = get_inode(fs, inode_src)->i_size;
+	return 0;
+}
+
+
+
+
+/* DIRECTORY OPERATIONS */
+
+unsigned int align_to_nearest(unsigned int alignment, unsigned int value){
+	return (value % alignment) ? (value + alignment - (value % alignment)): value;
+}
+
+unsigned int dir_entry_size(unsigned int name_len){
+	return align_to_nearest(4, sizeof(struct ext2_dir_entry_2) + name_len);
+}
+
+
+int dir_entry_full(struct ext2_dir_entry_2 *de, int required_space){
+	return (de->rec_len - dir_entry_size(de->name_len) < required_space)? 1 : 0;
+}
+
+
+int dir_entry_next(struct ext2_dir_entry_2 **cur, int *remaining) {
+	if (*remaining - (*cur)->rec_len > 0) {
+		*remaining = *remaining - (*cur)->rec_len;
+		*cur = (struct ext2_dir_entry_2 *) (((unsigned char *)(*cur)) + (*cur)->rec_len);
+		return 1; 
+	} 
+	else 
+		return 0;
+}
+
+
+struct ext2_dir_entry_2 *dir_block_find(struct ext2_fs *fs, unsigned int block_index, char *filename, int name_len) {
+	struct ext2_dir_entry_2 *cur = (struct ext2_dir_entry_2 *) get_block(fs, block_index);
+	int remaining = fs->block_size;
+
+	/* cycle through all directory entries in block */
+	do {
+		if (cur->inode && name_len == cur->name_len && !memcmp(filename, cur->name, name_len)) {
+			return cur;
+		}
+	}
+	while (dir_entry_next(&cur, &remaining));
+
+	return NULL;
+}
+
+
+struct ext2_dir_entry_2 *dir_block_insert(struct ext2_fs *fs, unsigned int block_index, unsigned int new_inode, int name_len, int file_type, char *filename) {
+	struct ext2_dir_entry_2 *cur = (struct ext2_dir_entry_2 *) get_block(fs, block_index);
+	struct ext2_dir_entry_2 *new = NULL;
+	int remaining = fs->block_size;
+	int required_space = dir_entry_size(name_len);
+
+	/* cycle through all directory entries in block */
+	do {
+		if (cur->inode == 0 && cur->rec_len >= required_space) {
+			// Case: unused entry large enough to take over
+			new = cur;
+			break;
+		}
+		if (!dir_entry_full(cur, required_space)) {
+			// Case: enough slack after entry to split it
+			new = (struct ext2_dir_entry_2 *)(((unsigned char *) cur) + dir_entry_size(cur->name_len));
+			new->rec_len = cur->rec_len - dir_entry_size(cur->name_len);
+			cur->rec_len = dir_entry_size(cur->name_len);
+			break;
+		}
+	}
+	while (dir_entry_next(&cur, &remaining));
+
+	if (new) {
+		new->inode = new_inode;
+		new->name_len = name_len;
+		new->file_type = file_type;
+		memcpy(new->name, filename, name_len);
+	}
+	return new;
+}
+
+
+int dir_append_block(struct ext2_fs *fs, unsigned int dir_inode, unsigned int *logical, unsigned int *block_index) {
+	struct ext2_inode *in = get_inode(fs, dir_inode);
+	struct block_map_cursor cursor;
+	unsigned int next = in->i_size / fs->block_size;
+	unsigned int last = next ? inode_block(fs, dir_inode, next - 1) : 0;
+	int err;
+
+	/* keep directory blocks together, and near the directory's inode */
+	unsigned int new_block = allocate_block_near(fs, last ? last + 1 : inode_goal(fs, dir_inode));
+	if (!new_block) return ENOSPC;
+
+	block_map_init(fs, &cursor, dir_inode, next, NULL);
+	err = block_map_append(&cursor, new_block);
+	block_map_finish(&cursor);
+	if (err) {
+		free_block(fs, new_block);
+		return err;
+	}
+	in->i_size += fs->block_size;
+
+	if (logical) *logical = next;
+	*block_index = new_block;
+	return 0;
+}
+
+
+struct ext2_dir_entry_2 *dir_find(struct ext2_fs *fs, unsigned int dir_inode, char *filename) {
+	struct next_slot_state state;
+	struct ptr_with_err result;
+	struct ext2_dir_entry_2 *de;
+	int name_len = strlen(filename);
+
+	if (dir_indexed(fs, dir_inode)) {
+		return dx_find(fs, dir_inode, filename, name_len);
+	}
+
+	initialize_state(fs, &state, dir_inode);
+
+	/* cycle through all blocks */
+	while (1) {
+		result = next_slot(&state);
+
+		if (result.ptr != NULL && result.err == NO_ERR) {
+			if ((de = dir_block_find(fs, *((unsigned int *) result.ptr), filename, name_len))) {
+				return de;
+			}
+		} 
+		else break;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Places entry in directory without touching link counts or the dentry cache.
+ */
+static int insert_entry(struct ext2_fs *fs, unsigned int dir_inode, unsigned int new_inode, int name_len, int file_type, char *filename) {
+	struct next_slot_state state;
+	struct ptr_with_err result;
+	int err;
+
+	if (dir_indexed(fs, dir_inode)) {
+		return dx_add_entry(fs, dir_inode, new_inode, name_len, file_type, filename);
+	}
+
+	/* an index left behind on a directory updated as linear is stale */
+	get_inode(fs, dir_inode)->i_flags &= ~EXT2_INDEX_FL;
+
+	initialize_state(fs, &state, dir_inode);
+
+	/* cycle through all blocks */
+	while (1) {
+		result = next_slot(&state);
+		if (result.ptr != NULL && result.err == NO_ERR) {
+			if (dir_block_insert(fs, *((unsigned int *) result.ptr), new_inode, name_len, file_type, filename)) {
+				return 0;
+			}
+		} 
+		else break;
+	}
+
+	// Case: no associated block can accomodate new entry
+	if (get_inode(fs, dir_inode)->i_size) {
+		err = dx_build(fs, dir_inode);
+		if (!err) {
+			// Case: directory outgrew one block and is now indexed
+			return dx_add_entry(fs, dir_inode, new_inode, name_len, file_type, filename);
+		}
+		if (err != EOPNOTSUPP && err != EFBIG) return err;
+	}
+
+	unsigned int new_block;
+	if ((err = dir_append_block(fs, dir_inode, NULL, &new_block))) return err;
+	struct ext2_dir_entry_2 *new = (struct ext2_dir_entry_2 *) (get_block(fs, new_block));
+	new->rec_len = fs->block_size;
+	new->inode = new_inode;
+	new->name_len = name_len;
+	new->file_type = file_type;
+	memcpy(new->name, filename, name_len);
+	return 0;
+}
+
+
+int add_entry(struct ext2_fs *fs, unsigned int dir_inode, unsigned int new_inode, int name_len, int file_type, char *filename){ 
+	int err = fs_writable(fs);
+	if (!err) err = insert_entry(fs, dir_inode, new_inode, name_len, file_type, filename);
+	if (err) return err;
+
+	get_inode(fs, new_inode)->i_links_count ++;
+	dentry_insert(fs, dir_inode, filename, name_len, new_inode);
+	return 0;
+}
+
+
+int delete_entry(struct ext2_fs *fs, unsigned int dir_inode, char *filename){
+	int err = fs_writable(fs);
+	if (err) return err;
+
+	struct ext2_dir_entry_2 *dbe = dir_find(fs, dir_inode, filename);
+	if (dbe == NULL) return ENOENT;
+	{
+		unsigned int dbe_inode = dbe->inode;
+		dentry_forget(fs, dir_inode, filename, strlen(filename));
+		unsigned int dir_block = (((unsigned char *) dbe) - fs->disk) / fs->block_size;
+		struct ext2_dir_entry_2 *cur = (struct ext2_dir_entry_2 *) get_block(fs, dir_block);
+		struct ext2_dir_entry_2 *last_dbe = NULL;
+		int remaining = fs->block_size;
+		int rest;
+		do {
+			if (cur == dbe) {
+				rest = remaining;
+			}
+			else {
+				last_dbe = cur;
+			}
+		}
+		while (dir_entry_next(&cur, &remaining));
+
+		if (last_dbe){
+			last_dbe->rec_len += dbe->rec_len;
+			/* move the rest of the directory entries back */
+			memmove((void *)dbe, (void *) (((unsigned char *) dbe) + dbe->rec_len), rest - dbe->rec_len);
+		} 
+		else if (dir_indexed(fs, dir_inode)) {
+			// Case: last entry of an index leaf, the block stays referenced by the index
+			dbe->inode = 0;
+		}
+		else {
+			inode_remove_block(fs, dir_inode, dir_block);
+			get_inode(fs, dir_inode)->i_size -= fs->block_size;
+			free_block(fs, dir_block);
+		}
+
+		get_inode(fs, dbe_inode)->i_links_count --;
+		if (get_inode(fs, dbe_inode)->i_links_count == 0) {
+			/* names cached under a removed directory would outlive it */
+			if (has_file_type(fs, EXT2_INODE_FT_DIR, dbe_inode)) dentry_cache_clear(fs);
+			free_inode(fs, dbe_inode);
+		}
+	}
+	return 0;
+}
+
+
+int init_dir_inode(struct ext2_fs *fs, unsigned int new_dir_inode, unsigned int parent_dir_inode, char *dir_filename){
+	int err;
+
+	/* add . and .. directory entries for new directory */
+	if ((err = add_entry(fs, new_dir_inode, new_dir_inode, strlen("."), EXT2_FT_DIR, "."))) {
+		free_inode(fs, new_dir_inode);
+		return err;
+	}
+	if ((err = add_entry(fs, new_dir_inode, parent_dir_inode, strlen(".."), EXT2_FT_DIR, ".."))) {
+		free_inode(fs, new_dir_inode);
+		return err;
+	}
+
+	/* update metadata */
+	get_inode(fs, new_dir_inode)->i_mode = get_inode(fs, parent_dir_inode)->i_mode;
+	fs->block_group[inode_group(fs, new_dir_inode)].bg_used_dirs_count ++;
+
+	/* add directory entry for new directory in parent directory */
+	if ((err = add_entry(fs, parent_dir_inode, new_dir_inode, strlen(dir_filename), EXT2_FT_DIR, dir_filename))) {
+		// Case: the new directory is unreachable, so .. no longer links the parent
+		get_inode(fs, parent_dir_inode)->i_links_count --;
+		fs->block_group[inode_group(fs, new_dir_inode)].bg_used_dirs_count --;
+		free_inode(fs, new_dir_inode);
+	}
+	return err;
+}
+
+
+int dir_compact(struct ext2_fs *fs, unsigned int dir_inode, unsigned int *freed) {
+	struct ext2_inode *in = get_inode(fs, dir_inode);
+	struct next_slot_state state;
+	struct ptr_with_err result;
+	unsigned char *packed = NULL;
+	unsigned int blocks = 0, used = 0, last = 0, k;
+	int err = fs_writable(fs);
+	if (err) return err;
+	if (!has_file_type(fs, EXT2_INODE_FT_DIR, dir_inode)) return ENOTDIR;
+
+	unsigned int before = in->i_blocks;
+	unsigned int size_blocks = in->i_size / fs->block_size;
+	int indexed = dir_indexed(fs, dir_inode);
+
+	/* blocks mapped past i_size are packed too, so they count as well */
+	unsigned int mapped = inode_data_blocks(fs, dir_inode);
+	if (size_blocks < mapped) size_blocks = mapped;
+	for (k = 0; k < size_blocks; k++) {
+		// Case: hole in the directory, the packed blocks would have nowhere to go
+		if (inode_block(fs, dir_inode, k) == 0) return EIO;
+	}
+
+	/* lay the live entries out afresh, index blocks holding none of their own */
+	initialize_state(fs, &state, dir_inode);
+	while ((result = next_slot(&state)).ptr != NULL && result.err == NO_ERR) {
+		struct ext2_dir_entry_2 *cur = (struct ext2_dir_entry_2 *) get_block(fs, *((unsigned int *) result.ptr));
+		int remaining = fs->block_size;
+		do {
+			if (!cur->inode) continue;
+			unsigned int entry_size = dir_entry_size(cur->name_len);
+
+			if (blocks == 0 || used + entry_size > fs->block_size) {
+				// Case: entry starts the next block, the last one of this block takes the rest
+				unsigned char *grown = realloc(packed, (size_t) (blocks + 1) * fs->block_size);
+				if (grown == NULL) {
+					free(packed);
+					return ENOMEM;
+				}
+				packed = grown;
+				if (blocks) ((struct ext2_dir_entry_2 *) (packed + last))->rec_len = (size_t) blocks * fs->block_size - last;
+				memset(packed + (size_t) blocks * fs->block_size, 0, fs->block_size);
+				blocks ++;
+				used = 0;
+			}
+
+			last = (blocks - 1) * fs->block_size + used;
+			struct ext2_dir_entry_2 *new = (struct ext2_dir_entry_2 *) (packed + last);
+			new->inode = cur->inode;
+			new->rec_len = entry_size;
+			new->name_len = cur->name_len;
+			new->file_type = cur->file_type;
+			memcpy(new->name, cur->name, cur->name_len);
+			used += entry_size;
+		}
+		while (dir_entry_next(&cur, &remaining));
+	}
+	if (blocks == 0) {
+		// Case: not even "." is left, nothing to pack
+		return 0;
+	}
+	((struct ext2_dir_entry_2 *) (packed + last))->rec_len = (size_t) blocks * fs->block_size - last;
+
+	/* the first blocks take the packed entries, the rest are given back from the end */
+	for (k = 0; k < blocks; k++) {
+		memcpy(get_block(fs, inode_block(fs, dir_inode, k)), packed + (size_t) k * fs->block_size, fs->block_size);
+	}
+	free(packed);
+	for (k = size_blocks; k > blocks; k--) {
+		unsigned int block_index = inode_block(fs, dir_inode, k - 1);
+		inode_remove_block(fs, dir_inode, block_index);
+		free_block(fs, block_index);
+	}
+	in->i_size = blocks * fs->block_size;
+	in->i_flags &= ~EXT2_INDEX_FL;
+
+	if (indexed && blocks > 1) {
+		err = dx_build(fs, dir_inode);
+		// Case: index could not be rebuilt, the directory stays linear and valid
+		if (err == EFBIG || err == ENOSPC) err = 0;
+	}
+
+	if (freed && in->i_blocks < before) *freed += (before - in->i_blocks) / (fs->block_size / 512);
+	return err;
+}
+
+
+void print_dir(struct ext2_fs *fs, unsigned int dir_inode) {
+	struct next_slot_state state;
+	struct ptr_with_err result;
+	initialize_state(fs, &state, dir_inode);
+
+	/* cycle through all blocks */
+	while (1) {
+		result = next_slot(&state);
+		if (result.ptr != NULL && result.err == NO_ERR) {
+			struct ext2_dir_entry_2 *cur = (struct ext2_dir_entry_2 *) get_block(fs, *((unsigned int *) result.ptr));
+			int remaining = fs->block_size;
+
+			/* cycle through all directory entries in block, skipping unused ones */
+			do {
+				if (cur->inode) printf("%.*s\n", cur->name_len, cur->name);
+			}
+			while (dir_entry_next(&cur, &remaining));
+
+		} 
+		else break;
+	}
+}
+
+
+
+
+/* DIRECTORY INDEX OPERATIONS */
+
+#define DX_ROOT_LIMIT(fs) (((fs)->block_size - 32) / sizeof(struct dx_entry))
+#define DX_NODE_LIMIT(fs) (((fs)->block_size - 8) / sizeof(struct dx_entry))
+#define DX_BUILD_FILL(fs) ((fs)->block_size * 3 / 4) /* leaf fill when building, leaving room to grow */
+
+/*
+ * Leaf entry paired with its hash, for sorting leaves by hash.
+ */
+struct dx_map_entry {
+	unsigned int hash;
+	struct ext2_dir_entry_2 *de;
+};
+
+
+/*
+ * Position in one level of the index: entry array of the node and the entry followed.
+ */
+struct dx_frame {
+	struct dx_entry *entries;
+	struct dx_entry *at;
+};
+
+
+static struct dx_countlimit *dx_countlimit(struct dx_entry *entries) {
+	return (struct dx_countlimit *) entries;
+}
+
+
+static struct dx_root_info *dx_info(struct ext2_fs *fs, unsigned int dir_inode) {
+	return (struct dx_root_info *) (((unsigned char *) get_block(fs, inode_block(fs, dir_inode, 0))) + 24);
+}
+
+
+static struct dx_entry *dx_root_entries(struct dx_root_info *info) {
+	return (struct dx_entry *) (((unsigned char *) info) + info->info_length);
+}
+
+
+/*
+ * Returns entry array of node at given logical block of directory, or NULL if missing.
+ */
+static struct dx_entry *dx_node_entries(struct ext2_fs *fs, unsigned int dir_inode, unsigned int logical) {
+	unsigned int block_index = inode_block(fs, dir_inode, logical);
+	return block_index ? (struct dx_entry *) (((unsigned char *) get_block(fs, block_index)) + 8) : NULL;
+}
+
+
+/*
+ * Turns block into an empty interior node and returns its entry array.
+ */
+static struct dx_entry *dx_init_node(struct ext2_fs *fs, unsigned int block_index) {
+	struct ext2_dir_entry_2 *fake = (struct ext2_dir_entry_2 *) get_block(fs, block_index);
+	fake->inode = 0;
+	fake->rec_len = fs->block_size;
+	fake->name_len = 0;
+	fake->file_type = 0;
+
+	struct dx_entry *entries = (struct dx_entry *) (((unsigned char *) fake) + 8);
+	dx_countlimit(entries)->limit = DX_NODE_LIMIT(fs);
+	dx_countlimit(entries)->count = 0;
+	return entries;
+}
+
+
+static unsigned int rol32(unsigned int word, unsigned int shift) {
+	return (word << shift) | (word >> (32 - shift));
+}
+
+
+/*
+ * Packs up to num words of name into buf, padding with the length as ext2 does.
+ */
+static void dx_str2hashbuf(const char *msg, int len, unsigned int *buf, int num, int unsigned_chars) {
+	unsigned int pad, val;
+	int i;
+
+	pad = (unsigned int) len | ((unsigned int) len << 8);
+	pad |= pad << 16;
+
+	val = pad;
+	if (len > num * 4) len = num * 4;
+	for (i = 0; i < len; i++) {
+		int c = unsigned_chars ? (int) ((const unsigned char *) msg)[i] : (int) ((const signed char *) msg)[i];
+		val = c + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num --;
+		}
+	}
+	if (--num >= 0) *buf++ = val;
+	while (--num >= 0) *buf++ = pad;
+}
+
+
+#define DX_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z) ((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + x, a = rol32(a, s))
+#define DX_K2 013240474631U
+#define DX_K3 015666365641U
+
+static void dx_half_md4_transform(unsigned int buf[4], const unsigned int in[8]) {
+	unsigned int a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	/* Round 1 */
+	DX_ROUND(DX_F, a, b, c, d, in[0],  3);
+	DX_ROUND(DX_F, d, a, b, c, in[1],  7);
+	DX_ROUND(DX_F, c, d, a, b, in[2], 11);
+	DX_ROUND(DX_F, b, c, d, a, in[3], 19);
+	DX_ROUND(DX_F, a, b, c, d, in[4],  3);
+	DX_ROUND(DX_F, d, a, b, c, in[5],  7);
+	DX_ROUND(DX_F, c, d, a, b, in[6], 11);
+	DX_ROUND(DX_F, b, c, d, a, in[7], 19);
+
+	/* Round 2 */
+	DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2,  3);
+	DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2,  5);
+	DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2,  9);
+	DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+	DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2,  3);
+	DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2,  5);
+	DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2,  9);
+	DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+	/* Round 3 */
+	DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3,  3);
+	DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3,  9);
+	DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+	DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3,  3);
+	DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3,  9);
+	DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+
+static void dx_tea_transform(unsigned int buf[4], const unsigned int in[4]) {
+	unsigned int sum = 0;
+	unsigned int b0 = buf[0], b1 = buf[1];
+	unsigned int a = in[0], b = in[1], c = in[2], d = in[3];
+	int n = 16;
+
+	do {
+		sum += 0x9E3779B9;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	} while (--n);
+
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+
+static unsigned int dx_legacy_hash(const char *name, int len, int unsigned_chars) {
+	unsigned int hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		int c = unsigned_chars ? (int) ((const unsigned char *) name)[i] : (int) ((const signed char *) name)[i];
+		hash = hash1 + (hash0 ^ ((unsigned int) c * 7152373));
+		if (hash & 0x80000000) hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+
+unsigned int dx_hash(struct ext2_fs *fs, const char *name, int len, int hash_version) {
+	unsigned int buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+	unsigned int in[8];
+	unsigned int hash;
+	int unsigned_chars = hash_version >= DX_HASH_LEGACY_UNSIGNED;
+	int i;
+
+	/* a nonzero seed in the superblock replaces the default initial state */
+	for (i = 0; i < 4; i++) {
+		if (fs->super_block->s_hash_seed[i]) {
+			memcpy(buf, fs->super_block->s_hash_seed, sizeof(buf));
+			break;
+		}
+	}
+
+	switch (hash_version) {
+		case DX_HASH_HALF_MD4:
+		case DX_HASH_HALF_MD4_UNSIGNED:
+			for (; len > 0; len -= 32, name += 32) {
+				dx_str2hashbuf(name, len, in, 8, unsigned_chars);
+				dx_half_md4_transform(buf, in);
+			}
+			hash = buf[1];
+			break;
+		case DX_HASH_TEA:
+		case DX_HASH_TEA_UNSIGNED:
+			for (; len > 0; len -= 16, name += 16) {
+				dx_str2hashbuf(name, len, in, 4, unsigned_chars);
+				dx_tea_transform(buf, in);
+			}
+			hash = buf[0];
+			break;
+		default:
+			hash = dx_legacy_hash(name, len, unsigned_chars);
+			break;
+	}
+
+	/* the low bit is reserved to flag hash collisions across leaves */
+	hash &= ~1;
+	if (hash == (0x7fffffffU << 1)) hash = (0x7fffffffU - 1) << 1;
+	return hash;
+}
+
+
+/*
+ * Returns hash of name under the hash version of indexed directory.
+ */
+static unsigned int dx_dir_hash(struct ext2_fs *fs, unsigned int dir_inode, const char *name, int len) {
+	int hash_version = dx_info(fs, dir_inode)->hash_version;
+	if (hash_version <= DX_HASH_TEA && (fs->super_block->s_flags & EXT2_FLAGS_UNSIGNED_HASH)) {
+		hash_version += DX_HASH_LEGACY_UNSIGNED;
+	}
+	return dx_hash(fs, name, len, hash_version);
+}
+
+
+int dir_indexed(struct ext2_fs *fs, unsigned int dir_inode) {
+	struct ext2_inode *in = get_inode(fs, dir_inode);
+	if (!(fs->super_block->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) || !(in->i_flags & EXT2_INDEX_FL)) {
+		return 0;
+	}
+
+	/* only trust roots this implementation can follow */
+	struct dx_root_info *info = dx_info(fs, dir_inode);
+	return info->reserved_zero == 0 && info->info_length == 8 && info->indirect_levels <= 1 
+		&& info->hash_version <= DX_HASH_TEA && dx_countlimit(dx_root_entries(info))->limit == DX_ROOT_LIMIT(fs);
+}
+
+
+/*
+ * Follows the index down to the leaf that would hold hash, filling one frame per
+ * level. Returns the number of frames, or 0 if the index is damaged.
+ */
+static int dx_probe(struct ext2_fs *fs, unsigned int dir_inode, unsigned int hash, struct dx_frame *frames) {
+	struct dx_root_info *info = dx_info(fs, dir_inode);
+	struct dx_entry *entries = dx_root_entries(info);
+	int level;
+
+	for (level = 0; ; level++) {
+		unsigned int count = dx_countlimit(entries)->count;
+		struct dx_entry *p = entries + 1, *q = entries + count - 1, *m;
+		if (count == 0) return 0;
+
+		/* find the last entry whose hash is at most the one looked for */
+		while (p <= q) {
+			m = p + (q - p) / 2;
+			if (m->hash > hash) q = m - 1;
+			else p = m + 1;
+		}
+		frames[level].entries = entries;
+		frames[level].at = p - 1;
+
+		if (level == info->indirect_levels) return level + 1;
+		if (!(entries = dx_node_entries(fs, dir_inode, frames[level].at->block))) return 0;
+	}
+}
+
+
+/*
+ * Moves frames to the next leaf if names with given hash may continue in it, 
+ * returning 1 if so, or 0 otherwise.
+ */
+static int dx_next_leaf(struct ext2_fs *fs, unsigned int dir_inode, struct dx_frame *frames, int nframes, unsigned int hash) {
+	int level = nframes - 1;
+
+	while (frames[level].at + 1 >= frames[level].entries + dx_countlimit(frames[level].entries)->count) {
+		if (level == 0) return 0;
+		level --;
+	}
+	frames[level].at ++;
+	if ((frames[level].at->hash & ~1) != hash) return 0;
+
+	/* descend to the first entry of each lower level */
+	for (level++; level < nframes; level++) {
+		if (!(frames[level].entries = dx_node_entries(fs, dir_inode, frames[level - 1].at->block))) return 0;
+		frames[level].at = frames[level].entries;
+	}
+	return 1;
+}
+
+
+struct ext2_dir_entry_2 *dx_find(struct ext2_fs *fs, unsigned int dir_inode, char *filename, int name_len) {
+	struct dx_frame frames[2];
+	struct ext2_dir_entry_2 *de;
+
+	if ((name_len == 1 && filename[0] == '.') || (name_len == 2 && !strncmp(filename, "..", 2))) {
+		// Case: "." and ".." live in the root block, outside the index
+		return dir_block_find(fs, inode_block(fs, dir_inode, 0), filename, name_len);
+	}
+
+	unsigned int hash = dx_dir_hash(fs, dir_inode, filename, name_len);
+	int nframes = dx_probe(fs, dir_inode, hash, frames);
+	if (!nframes) return NULL;
+
+	do {
+		unsigned int leaf = inode_block(fs, dir_inode, frames[nframes - 1].at->block);
+		if (leaf && (de = dir_block_find(fs, leaf, filename, name_len))) {
+			return de;
+		}
+	}
+	while (dx_next_leaf(fs, dir_inode, frames, nframes, hash));
+
+	return NULL;
+}
+
+
+/*
+ * Inserts index entry for given hash and logical block after the followed entry of frame.
+ */
+static void dx_insert(struct dx_frame *frame, unsigned int hash, unsigned int logical) {
+	struct dx_entry *end = frame->entries + dx_countlimit(frame->entries)->count;
+	memmove(frame->at + 2, frame->at + 1, (end - (frame->at + 1)) * sizeof(struct dx_entry));
+	frame->at[1].hash = hash;
+	frame->at[1].block = logical;
+	dx_countlimit(frame->entries)->count ++;
+}
+
+
+/*
+ * Moves the full root index into a new interior node, adding a level to the tree.
+ */
+static int dx_grow_root(struct ext2_fs *fs, unsigned int dir_inode, struct dx_frame *frames) {
+	struct dx_entry *root = frames[0].entries;
+	unsigned int count = dx_countlimit(root)->count;
+	unsigned int node_block, node_logical;
+	int err = dir_append_block(fs, dir_inode, &node_logical, &node_block);
+	if (err) return err;
+	struct dx_entry *node = dx_init_node(fs, node_block);
+
+	memcpy(node + 1, root + 1, (count - 1) * sizeof(struct dx_entry));
+	node[0].block = root[0].block;
+	dx_countlimit(node)->count = count;
+
+	frames[1].entries = node;
+	frames[1].at = node + (frames[0].at - root);
+
+	dx_countlimit(root)->count = 1;
+	root[0].block = node_logical;
+	frames[0].at = root;
+	dx_info(fs, dir_inode)->indirect_levels = 1;
+	return 0;
+}
+
+
+/*
+ * Splits the full interior node of frames[1] in two, indexing the new half in the root.
+ */
+static int dx_split_node(struct ext2_fs *fs, unsigned int dir_inode, struct dx_frame *frames) {
+	struct dx_entry *entries = frames[1].entries;
+	unsigned int count = dx_countlimit(entries)->count;
+	unsigned int half = count / 2;
+	unsigned int split_hash = entries[half].hash;
+	unsigned int node_block, node_logical;
+	int err = dir_append_block(fs, dir_inode, &node_logical, &node_block);
+	if (err) return err;
+	struct dx_entry *node = dx_init_node(fs, node_block);
+
+	memcpy(node + 1, entries + half + 1, (count - half - 1) * sizeof(struct dx_entry));
+	node[0].block = entries[half].block;
+	dx_countlimit(node)->count = count - half;
+	dx_countlimit(entries)->count = half;
+
+	dx_insert(&frames[0], split_hash, node_logical);
+	if (frames[1].at >= entries + half) {
+		frames[1].at = node + (frames[1].at - (entries + half));
+		frames[1].entries = node;
+		frames[0].at ++;
+	}
+	return 0;
+}
+
+
+static int dx_map_compare(const void *a, const void *b) {
+	const struct dx_map_entry *x = a, *y = b;
+	if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+	return 0;
+}
+
+
+/*
+ * Writes the entries of map, in order, into the block at dst, the last entry 
+ * spanning the rest of the block.
+ */
+static void dx_pack_leaf(struct ext2_fs *fs, unsigned char *dst, struct dx_map_entry *map, int count) {
+	struct ext2_dir_entry_2 *de = NULL;
+	unsigned int offset = 0;
+	int i;
+
+	memset(dst, 0, fs->block_size);
+	for (i = 0; i < count; i++) {
+		unsigned int size = dir_entry_size(map[i].de->name_len);
+		de = (struct ext2_dir_entry_2 *) (dst + offset);
+		memcpy(de, map[i].de, sizeof(struct ext2_dir_entry_2) + map[i].de->name_len);
+		de->rec_len = size;
+		offset += size;
+	}
+
+	if (de) {
+		de->rec_len += fs->block_size - offset;
+	}
+	else {
+		de = (struct ext2_dir_entry_2 *) dst;
+		de->rec_len = fs->block_size;
+	}
+}
+
+
+/*
+ * Splits full leaf in two by hash, indexing the upper half in frame. Sets split_hash
+ * to the lowest hash moved to the new leaf and new_leaf to its block index.
+ */
+static int dx_split_leaf(struct ext2_fs *fs, unsigned int dir_inode, struct dx_frame *frame, unsigned int leaf, unsigned int *split_hash, unsigned int *new_leaf) {
+	struct dx_map_entry map[EXT2_MAX_BLOCK_SIZE / 8];
+	unsigned char lower[EXT2_MAX_BLOCK_SIZE], upper[EXT2_MAX_BLOCK_SIZE];
+	struct ext2_dir_entry_2 *cur = (struct ext2_dir_entry_2 *) get_block(fs, leaf);
+	int remaining = fs->block_size;
+	int count = 0, split;
+	unsigned int total = 0, size = 0;
+
+	do {
+		if (cur->inode) {
+			map[count].hash = dx_dir_hash(fs, dir_inode, cur->name, cur->name_len);
+			map[count].de = cur;
+			total += dir_entry_size(cur->name_len);
+			count ++;
+		}
+	}
+	while (dir_entry_next(&cur, &remaining));
+	qsort(map, count, sizeof(struct dx_map_entry), dx_map_compare);
+
+	/* the lower half keeps about half of the bytes in use */
+	for (split = 0; split < count - 1 && size < total / 2; split++) {
+		size += dir_entry_size(map[split].de->name_len);
+	}
+	if (split == 0) split = 1;
+
+	unsigned int continued = (map[split].hash == map[split - 1].hash) ? 1 : 0;
+	*split_hash = map[split].hash;
+
+	dx_pack_leaf(fs, lower, map, split);
+	dx_pack_leaf(fs, upper, map + split, count - split);
+
+	unsigned int logical;
+	int err = dir_append_block(fs, dir_inode, &logical, new_leaf);
+	if (err) return err;
+	memcpy(get_block(fs, leaf), lower, fs->block_size);
+	memcpy(get_block(fs, *new_leaf), upper, fs->block_size);
+
+	dx_insert(frame, *split_hash | continued, logical);
+	return 0;
+}
+
+
+int dx_add_entry(struct ext2_fs *fs, unsigned int dir_inode, unsigned int new_inode, int name_len, int file_type, char *filename) {
+	struct dx_frame frames[2];
+	unsigned int hash = dx_dir_hash(fs, dir_inode, filename, name_len);
+	int nframes = dx_probe(fs, dir_inode, hash, frames);
+	int err;
+
+	// Case: index is unreadable
+	if (!nframes) return EIO;
+
+	struct dx_frame *frame = &frames[nframes - 1];
+	unsigned int leaf = inode_block(fs, dir_inode, frame->at->block);
+	if (leaf == 0) {
+		// Case: index leads to a leaf that is not there
+		return EIO;
+	}
+	if (dir_block_insert(fs, leaf, new_inode, name_len, file_type, filename)) return 0;
+
+	// Case: leaf full, make room in the index for the entry of a new leaf
+	if (dx_countlimit(frame->entries)->count == dx_countlimit(frame->entries)->limit) {
+		if (nframes == 1) {
+			err = dx_grow_root(fs, dir_inode, frames);
+			nframes = 2;
+		}
+		else if (dx_countlimit(frames[0].entries)->count == DX_ROOT_LIMIT(fs)) {
+			// Case: directory index full
+			err = ENOSPC;
+		}
+		else {
+			err = dx_split_node(fs, dir_inode, frames);
+		}
+		if (err) return err;
+		frame = &frames[nframes - 1];
+	}
+
+	unsigned int split_hash, new_leaf;
+	if ((err = dx_split_leaf(fs, dir_inode, frame, leaf, &split_hash, &new_leaf))) return err;
+	if (!dir_block_insert(fs, hash >= split_hash ? new_leaf : leaf, new_inode, name_len, file_type, filename)) {
+		// Case: entry does not fit even in half a block
+		return ENOSPC;
+	}
+	return 0;
+}
+
+
+int dx_build(struct ext2_fs *fs, unsigned int dir_inode) {
+	struct ext2_inode *in = get_inode(fs, dir_inode);
+	struct next_slot_state state;
+	struct ptr_with_err result;
+	struct dx_map_entry *map = NULL;
+	unsigned int count = 0, capacity = 0, parent = 0;
+	unsigned int i, j;
+	int err = 0;
+
+	if (!(fs->super_block->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)) return EOPNOTSUPP;
+
+	int hash_version = fs->super_block->s_def_hash_version <= DX_HASH_TEA ? fs->super_block->s_def_hash_version : DX_HASH_HALF_MD4;
+	int dir_hash_version = hash_version;
+	if (fs->super_block->s_flags & EXT2_FLAGS_UNSIGNED_HASH) dir_hash_version += DX_HASH_LEGACY_UNSIGNED;
+
+	/* gather and hash every live entry other than "." and ".." */
+	initialize_state(fs, &state, dir_inode);
+	while ((result = next_slot(&state)).ptr != NULL && result.err == NO_ERR) {
+		struct ext2_dir_entry_2 *cur = (struct ext2_dir_entry_2 *) get_block(fs, *((unsigned int *) result.ptr));
+		int remaining = fs->block_size;
+		do {
+			if (!cur->inode) continue;
+			if (cur->name_len == 1 && cur->name[0] == '.') continue;
+			if (cur->name_len == 2 && !strncmp(cur->name, "..", 2)) {
+				parent = cur->inode;
+				continue;
+			}
+			if (count == capacity) {
+				struct dx_map_entry *grown = realloc(map, (capacity ? capacity * 2 : 64) * sizeof(struct dx_map_entry));
+				if (grown == NULL) {
+					free(map);
+					return ENOMEM;
+				}
+				capacity = capacity ? capacity * 2 : 64;
+				map = grown;
+			}
+			map[count].hash = dx_hash(fs, cur->name, cur->name_len, dir_hash_version);
+			map[count].de = cur;
+			count ++;
+		}
+		while (dir_entry_next(&cur, &remaining));
+	}
+	qsort(map, count, sizeof(struct dx_map_entry), dx_map_compare);
+
+	/* cut the sorted entries into leaves */
+	unsigned int *leaf_start = malloc((count + 1) * sizeof(unsigned int));
+	unsigned int *leaf_hash = malloc((count + 1) * sizeof(unsigned int));
+	unsigned int leaves = 0, size = 0;
+	if (leaf_start == NULL || leaf_hash == NULL) {
+		free(map);
+		free(leaf_start);
+		free(leaf_hash);
+		return ENOMEM;
+	}
+	leaf_start[leaves++] = 0;
+	for (i = 0; i < count; i++) {
+		unsigned int entry_size = dir_entry_size(map[i].de->name_len);
+		if (size && size + entry_size > DX_BUILD_FILL(fs)) {
+			leaf_start[leaves++] = i;
+			size = 0;
+		}
+		size += entry_size;
+	}
+	leaf_start[leaves] = count;
+
+	unsigned int nodes = leaves <= DX_ROOT_LIMIT(fs) ? 0 : (leaves + DX_NODE_LIMIT(fs) - 1) / DX_NODE_LIMIT(fs);
+	unsigned int total = 1 + nodes + leaves;
+	unsigned char *buf = (nodes > DX_ROOT_LIMIT(fs)) ? NULL : calloc(total, fs->block_size);
+	if (buf == NULL) {
+		// Case: too large for a two level index (stays linear), or out of memory
+		free(map);
+		free(leaf_start);
+		free(leaf_hash);
+		return (nodes > DX_ROOT_LIMIT(fs)) ? EFBIG : ENOMEM;
+	}
+
+	/* root block: ".", ".." spanning the block, then the root info and entries */
+	struct ext2_dir_entry_2 *dot = (struct ext2_dir_entry_2 *) buf;
+	dot->inode = dir_inode;
+	dot->rec_len = 12;
+	dot->name_len = 1;
+	dot->file_type = EXT2_FT_DIR;
+	dot->name[0] = '.';
+	struct ext2_dir_entry_2 *dotdot = (struct ext2_dir_entry_2 *) (buf + 12);
+	dotdot->inode = parent;
+	dotdot->rec_len = fs->block_size - 12;
+	dotdot->name_len = 2;
+	dotdot->file_type = EXT2_FT_DIR;
+	memcpy(dotdot->name, "..", 2);
+	struct dx_root_info *info = (struct dx_root_info *) (buf + 24);
+	info->hash_version = hash_version;
+	info->info_length = 8;
+	info->indirect_levels = nodes ? 1 : 0;
+	struct dx_entry *root = dx_root_entries(info);
+	dx_countlimit(root)->limit = DX_ROOT_LIMIT(fs);
+
+	/* leaves follow the root and interior nodes */
+	for (i = 0; i < leaves; i++) {
+		dx_pack_leaf(fs, buf + (1 + nodes + i) * fs->block_size, map + leaf_start[i], leaf_start[i + 1] - leaf_start[i]);
+		leaf_hash[i] = 0;
+		if (i > 0) {
+			unsigned int first = leaf_start[i];
+			leaf_hash[i] = map[first].hash | (map[first].hash == map[first - 1].hash ? 1 : 0);
+		}
+	}
+
+	if (!nodes) {
+		for (i = 0; i < leaves; i++) {
+			root[i].hash = leaf_hash[i];
+			root[i].block = 1 + i;
+		}
+		dx_countlimit(root)->count = leaves;
+	}
+	else {
+		unsigned int per_node = (leaves + nodes - 1) / nodes;
+		for (j = 0; j < nodes; j++) {
+			struct ext2_dir_entry_2 *fake = (struct ext2_dir_entry_2 *) (buf + (1 + j) * fs->block_size);
+			struct dx_entry *node = (struct dx_entry *) (((unsigned char *) fake) + 8);
+			unsigned int first = j * per_node;
+			unsigned int last = first + per_node < leaves ? first + per_node : leaves;
+
+			fake->rec_len = fs->block_size;
+			for (i = first; i < last; i++) {
+				node[i - first].hash = leaf_hash[i];
+				node[i - first].block = 1 + nodes + i;
+			}
+			dx_countlimit(node)->limit = DX_NODE_LIMIT(fs);
+			dx_countlimit(node)->count = last - first;
+
+			root[j].hash = leaf_hash[first];
+			root[j].block = 1 + j;
+		}
+		dx_countlimit(root)->count = nodes;
+	}
+	dx_countlimit(root)->limit = DX_ROOT_LIMIT(fs);
+
+	/* write the new layout over the directory, resizing it to fit */
+	unsigned int existing = in->i_size / fs->block_size;
+	unsigned int new_block;
+	for (i = existing; i < total && !err; i++) {
+		err = dir_append_block(fs, dir_inode, NULL, &new_block);
+	}
+	if (err) {
+		// Case: out of blocks, give back the ones added and leave the directory as it was
+		inode_truncate(fs, dir_inode, existing);
+		in->i_size = existing * fs->block_size;
+	}
+	else {
+		for (i = 0; i < total; i++) {
+			memcpy(get_block(fs, inode_block(fs, dir_inode, i)), buf + i * fs->block_size, fs->block_size);
+		}
+		if (existing > total) {
+			inode_truncate(fs, dir_inode, total);
+			in->i_size = total * fs->block_size;
+		}
+		in->i_flags |= EXT2_INDEX_FL;
+	}
+
+	free(map);
+	free(leaf_start);
+	free(leaf_hash);
+	free(buf);
+	return err;
+}
+
+
+
+
+/* INODE OPERATIONS */
+
+void initialize_state_i(struct ext2_fs *fs, struct next_slot_state_i *state, unsigned int *start_slot_ptr, unsigned int indirection) {
+	int i;
+	for (i = 0; i < 4; i++) 
+		state->index[i] = 0;
+	state->fs = fs;
+	state->start_slot_ptr = start_slot_ptr;
+	state->indirection = indirection;
+	state->offset = 0;
+}
+
+
+void initialize_state(struct ext2_fs *fs, struct next_slot_state *state, unsigned int inode_index) {
+	state->fs = fs;
+	state->in = get_inode(fs, inode_index);
+	state->logical = 0;
+	initialize_state_i(fs, &(state->indirection_state), state->in->i_block, 0);
+
+	/* i_block of a fast symlink holds its target, not block indices */
+	state->block_index = inode_fast_symlink(fs, inode_index) ? EXT2_N_BLOCKS : 0;
+}
+
+
+/*
+ * Moves indices of state past the slot at level, and so past everything mapped under it.
+ */
+static void next_slot_advance(struct next_slot_state_i *state, unsigned int level) {
+	unsigned int per = state->fs->addr_per_block;
+	unsigned int *index = state->index;
+	int i;
+
+	for (i = state->indirection; i > (int) level; i--) {
+		index[i] = 0;
+	}
+	for (i = level; i >= 0; i--) {
+		if (index[i] + 1 < per) {
+			index[i] ++;
+			return;
+		}
+		index[i] = 0;
+	}
+}
+
+
+struct ptr_with_err next_slot_i(struct next_slot_state_i *state) {
+	struct ext2_fs *fs = state->fs;
+	unsigned int *index = state->index;
+	unsigned int indirection = state->indirection;
+	struct ptr_with_err result;
+	unsigned int level;
+
+	while (!index[0]) {
+		unsigned int *slot = state->start_slot_ptr;
+		for (level = 1; level <= indirection && *slot; level++) {
+			/* move down one level of indirection */
+			slot = get_block(fs, *slot)->addr + index[level];
+		}
+
+		if (level <= indirection) {
+			// Case: hole. Indirection block missing, skip all it would map.
+			next_slot_advance(state, level - 1);
+			continue;
+		}
+		if (*slot == 0) {
+			// Case: hole. Data block missing.
+			next_slot_advance(state, indirection);
+			continue;
+		}
+
+		// Case: Data block found. Advance for next time.
+		state->offset = 0;
+		for (level = 1; level <= indirection; level++) {
+			state->offset = state->offset * fs->addr_per_block + index[level];
+		}
+		result.ptr = slot;
+		result.err = NO_ERR;
+		next_slot_advance(state, indirection);
+		return result;
+	}
+
+	// Case: No error. Data blocks at indirection level exhausted.
+	result.ptr = NULL;
+	result.err = NO_ERR;
+	return result;
+}
+
+
+struct ptr_with_err next_slot(struct next_slot_state *state) {
+	struct ext2_fs *fs = state->fs;
+	struct ptr_with_err result = {NULL, NO_ERR};
+	unsigned int per = fs->addr_per_block;
+
+	int indirection = state->block_index >= 11 ? (state->block_index - 11) : 0;
+
+	/* cycle through the i_block pointers */
+	while (state->block_index < 15) {
+		result = next_slot_i(&(state->indirection_state));
+
+		if (result.ptr == NULL) {
+			state->block_index ++;
+			indirection = state->block_index > 11 ? (state->block_index - 11) : 0;
+			initialize_state_i(fs, &(state->indirection_state), state->in->i_block + state->block_index, indirection);
+		} 
+		else {
+			/* logical index is where the tree of this i_block pointer starts, plus the offset in it */
+			unsigned long long base = indirection ? EXT2_NDIR_BLOCKS : state->block_index;
+			if (indirection >= 2) base += per;
+			if (indirection >= 3) base += per * per;
+			state->logical = base + state->indirection_state.offset;
+			return result;
+		}
+	}
+
+	return result;
+}
+
+
+unsigned int indirect_blocks_needed(struct ext2_fs *fs, unsigned int logical, unsigned int count) {
+	unsigned int per = fs->addr_per_block;
+	unsigned int dind = EXT2_NDIR_BLOCKS + per;
+	unsigned int tind = dind + per * per;
+	unsigned long long lo = logical, hi = (unsigned long long) logical + count;
+	unsigned int needed = 0;
+
+	/* a table is created when the logical index it starts with is appended */
+	needed += count_boundaries(lo, hi, EXT2_NDIR_BLOCKS, per);
+	needed += count_boundaries(lo, hi, dind, 0);
+	needed += count_boundaries(lo, hi, tind, per * per);
+	needed += count_boundaries(lo, hi, tind, 0);
+	return needed;
+}
+
+
+void block_map_init(struct ext2_fs *fs, struct block_map_cursor *cursor, unsigned int inode_index, unsigned int logical, struct block_run *run) {
+	cursor->fs = fs;
+	cursor->in = get_inode(fs, inode_index);
+	cursor->logical = logical;
+	cursor->leaf = NULL;
+	cursor->leaf_slot = 0;
+	cursor->leaf_slots = 0;
+	cursor->blocks = 0;
+	cursor->run = run;
+	cursor->goal = inode_goal(fs, inode_index);
+
+	/* a run not yet drawn from starts near the inode */
+	if (run && run->count == 0 && run->next == 0) run->next = cursor->goal;
+}
+
+
+/*
+ * Allocates a zeroed indirect block for cursor, from its run if it has one. 
+ * Returns 0 if no block is available.
+ */
+static unsigned int block_map_new_indirect(struct block_map_cursor *cursor) {
+	struct ext2_fs *fs = cursor->fs;
+	unsigned int block_index = cursor->run ? block_run_next(fs, cursor->run) : allocate_block_near(fs, cursor->goal);
+	if (block_index == 0) return 0;
+	clear_block(fs, get_block(fs, block_index));
+	cursor->blocks ++;
+	return block_index;
+}
+
+
+/*
+ * Splits logical index into the slot index at each level of the block map, 
+ * returning the number of indirect levels, or -1 if past the largest file.
+ */
+static int block_map_path(struct ext2_fs *fs, unsigned int n, unsigned int *index) {
+	unsigned int per = fs->addr_per_block;
+	int depth, i;
+
+	if (n < EXT2_NDIR_BLOCKS) {
+		index[0] = n;
+		return 0;
+	}
+
+	n -= EXT2_NDIR_BLOCKS;
+	if (n < per) {
+		depth = 1;
+	}
+	else if ((n -= per) < per * per) {
+		depth = 2;
+	}
+	else if ((n -= per * per) < per * per * per) {
+		depth = 3;
+	}
+	else {
+		return -1;
+	}
+
+	for (i = depth; i > 0; i--) {
+		index[i] = n % per;
+		n /= per;
+	}
+	return depth;
+}
+
+
+/*
+ * Points cursor at the table holding the slot of its logical index, creating any
+ * missing indirect blocks on the way down. Returns 0, EFBIG past the largest 
+ * file, or ENOSPC when out of blocks.
+ */
+static int block_map_descend(struct block_map_cursor *cursor) {
+	struct ext2_fs *fs = cursor->fs;
+	unsigned int per = fs->addr_per_block;
+	unsigned int index[4];
+	unsigned int *slot;
+	int depth, i;
+
+	depth = block_map_path(fs, cursor->logical, index);
+	if (depth < 0) return EFBIG;
+	if (depth == 0) {
+		cursor->leaf = cursor->in->i_block;
+		cursor->leaf_slot = index[0];
+		cursor->leaf_slots = EXT2_NDIR_BLOCKS;
+		return 0;
+	}
+
+	slot = &cursor->in->i_block[EXT2_NDIR_BLOCKS - 1 + depth];
+	for (i = 1; i <= depth; i++) {
+		if (*slot == 0 && (*slot = block_map_new_indirect(cursor)) == 0) return ENOSPC;
+		slot = get_block(fs, *slot)->addr + index[i];
+	}
+
+	cursor->leaf = slot - index[depth];
+	cursor->leaf_slot = index[depth];
+	cursor->leaf_slots = per;
+	return 0;
+}
+
+
+int block_map_append(struct block_map_cursor *cursor, unsigned int block_index) {
+	int err;
+	if (cursor->leaf == NULL || cursor->leaf_slot == cursor->leaf_slots) {
+		if ((err = block_map_descend(cursor))) {
+			cursor->leaf = NULL;
+			return err;
+		}
+	}
+	cursor->leaf[cursor->leaf_slot ++] = block_index;
+	cursor->logical ++;
+	cursor->blocks ++;
+	return 0;
+}
+
+
+int block_map_append_run(struct block_map_cursor *cursor, unsigned int *block_index) {
+	struct ext2_fs *fs = cursor->fs;
+	int err;
+
+	/* create indirect blocks first so they land ahead of the data they map */
+	if (cursor->leaf == NULL || cursor->leaf_slot == cursor->leaf_slots) {
+		if ((err = block_map_descend(cursor))) {
+			cursor->leaf = NULL;
+			return err;
+		}
+	}
+	if ((*block_index = block_run_next(fs, cursor->run)) == 0) return ENOSPC;
+	return block_map_append(cursor, *block_index);
+}
+
+
+void block_map_seek(struct block_map_cursor *cursor, unsigned int logical) {
+	unsigned int skip = logical - cursor->logical;
+	if (logical <= cursor->logical) return;
+
+	/* the leaf stays valid while the new slot is still in it */
+	if (cursor->leaf && skip < cursor->leaf_slots - cursor->leaf_slot) {
+		cursor->leaf_slot += skip;
+	}
+	else {
+		cursor->leaf = NULL;
+	}
+	cursor->logical = logical;
+}
+
+
+void block_map_finish(struct block_map_cursor *cursor) {
+	cursor->in->i_blocks += cursor->blocks * (cursor->fs->block_size / 512);
+	cursor->blocks = 0;
+}
+
+
+/*
+ * Returns the slot holding the block mapped at logical index of inode, or NULL
+ * if an indirect block on the way is missing.
+ */
+static unsigned int *inode_block_slot(struct ext2_fs *fs, unsigned int inode_index, unsigned int logical) {
+	struct ext2_inode *in = get_inode(fs, inode_index);
+	unsigned int index[4];
+	int depth = block_map_path(fs, logical, index);
+	int i;
+
+	if (depth < 0) return NULL;
+	if (depth == 0) return &in->i_block[index[0]];
+
+	unsigned int *slot = &in->i_block[EXT2_NDIR_BLOCKS - 1 + depth];
+	for (i = 1; i <= depth; i++) {
+		if (*slot == 0) return NULL;
+		slot = get_block(fs, *slot)->addr + index[i];
+	}
+	return slot;
+}
+
+
+unsigned int inode_block(struct ext2_fs *fs, unsigned int inode_index, unsigned int logical) {
+	unsigned int *slot = inode_block_slot(fs, inode_index, logical);
+	return slot ? *slot : 0;
+}
+
+
+/*
+ * Frees the blocks under slot mapping logical indices [first, first + span) that
+ * are at or past keep, and the indirect block itself once nothing under it is kept.
+ */
+static void truncate_tree(struct ext2_fs *fs, struct ext2_inode *in, unsigned int *slot, unsigned int depth, unsigned long long first, unsigned long long span, unsigned int keep) {
+	unsigned int per = fs->addr_per_block;
+	unsigned int i;
+
+	if (*slot == 0 || first + span <= keep) return;
+
+	if (depth) {
+		for (i = 0; i < per; i++) {
+			truncate_tree(fs, in, get_block(fs, *slot)->addr + i, depth - 1, first + i * (span / per), span / per, keep);
+		}
+	}
+	if (depth == 0 || first >= keep) {
+		free_block(fs, *slot);
+		*slot = 0;
+		in->i_blocks -= fs->block_size / 512;
+	}
+}
+
+
+void inode_truncate(struct ext2_fs *fs, unsigned int inode_index, unsigned int keep) {
+	struct ext2_inode *in = get_inode(fs, inode_index);
+	unsigned long long per = fs->addr_per_block;
+	unsigned long long first = EXT2_NDIR_BLOCKS;
+	unsigned int i;
+
+	for (i = 0; i < EXT2_NDIR_BLOCKS; i++) {
+		truncate_tree(fs, in, &in->i_block[i], 0, i, 1, keep);
+	}
+	truncate_tree(fs, in, &in->i_block[EXT2_IND_BLOCK], 1, first, per, keep);
+	first += per;
+	truncate_tree(fs, in, &in->i_block[EXT2_DIND_BLOCK], 2, first, per * per, keep);
+	first += per * per;
+	truncate_tree(fs, in, &in->i_block[EXT2_TIND_BLOCK], 3, first, per * per * per, keep);
+}
+
+
+unsigned int inode_data_blocks(struct ext2_fs *fs, unsigned int inode_index) {
+	struct ptr_with_err result;
+	struct next_slot_state state;
+	unsigned int count = 0;
+	initialize_state(fs, &state, inode_index);
+
+	while ((result = next_slot(&state)).ptr != NULL && result.err == NO_ERR) {
+		count ++;
+	}
+	return count;
+}
+
+
+int inode_add_block(struct ext2_fs *fs, int inode_index, int block_index) {
+	struct block_map_cursor cursor;
+	int err;
+	block_map_init(fs, &cursor, inode_index, inode_data_blocks(fs, inode_index), NULL);
+	err = block_map_append(&cursor, block_index);
+	block_map_finish(&cursor);
+	return err;
+}
+
+
+void inode_remove_block(struct ext2_fs *fs, int inode_index, int block_index) {
+	struct ptr_with_err result;
+	struct next_slot_state state;
+	unsigned int *target_slot = NULL, *last_slot = NULL;
+	unsigned int last_logical = 0;
+
+	initialize_state(fs, &state, inode_index); 
+	while ((result = next_slot(&state)).ptr != NULL && result.err == NO_ERR) {
+		if (*((unsigned int *) result.ptr) == (unsigned int) block_index) target_slot = (unsigned int *) result.ptr;
+		last_slot = (unsigned int *) result.ptr;
+		last_logical = state.logical;
+	}
+	if (target_slot == NULL) return;
+
+	/* the last block fills the gap, so no hole is left below the end */
+	get_inode(fs, inode_index)->i_blocks -= fs->block_size / 512;
+	*target_slot = *last_slot;
+	*last_slot = 0;
+
+	/* indirect blocks past the new end map nothing now */
+	inode_truncate(fs, inode_index, last_logical);
+}
+
+/*
+ * Copies bytes from src into the count contiguous blocks starting at first,
+ * zeroing whatever part of the last block is past the data.
+ */
+static void fill_blocks(struct ext2_fs *fs, unsigned int first, unsigned int count, const unsigned char *src, size_t bytes) {
+	memcpy(get_block(fs, first), src, bytes);
+	memset(((unsigned char *) get_block(fs, first)) + bytes, 0, (size_t) count * fs->block_size - bytes);
+}
+
+
+int block_is_zero(struct ext2_fs *fs, const void *data) {
+	const uint64_t *word = data;
+	uint64_t bits = 0;
+	unsigned int i;
+
+	/* no early exit, so the loop vectorizes */
+	for (i = 0; i < fs->block_size / sizeof(uint64_t); i++) {
+		bits |= word[i];
+	}
+	return bits == 0;
+}
+
+
+/*
+ * Maps len bytes at src at the logical position of cursor, with one memcpy per
+ * physically contiguous stretch of destination blocks. Blocks of zeros are 
+ * skipped, leaving holes.
+ */
+static int populate_from_memory(struct block_map_cursor *cursor, const unsigned char *src, size_t len) {
+	struct ext2_fs *fs = cursor->fs;
+	size_t offset, start = 0;
+	unsigned int first = 0, count = 0;
+	unsigned int block_index;
+	int err;
+
+	for (offset = 0; offset < len; offset += fs->block_size) {
+		if (len - offset >= fs->block_size && block_is_zero(fs, src + offset)) {
+			// Case: block of zeros, left as a hole
+			if (count) fill_blocks(fs, first, count, src + start, (size_t) count * fs->block_size);
+			count = 0;
+			block_map_seek(cursor, cursor->logical + 1);
+			continue;
+		}
+		if ((err = block_map_append_run(cursor, &block_index))) return err;
+		if (count && block_index != first + count) {
+			// Case: stretch broken by an indirect block or the end of a run
+			fill_blocks(fs, first, count, src + start, (size_t) count * fs->block_size);
+			count = 0;
+		}
+		if (!count) {
+			first = block_index;
+			start = offset;
+		}
+		count ++;
+	}
+	if (count) fill_blocks(fs, first, count, src + start, len - start);
+	return 0;
+}
+
+
+int stage_open(struct ext2_fs *fs, unsigned int inode_index, struct staged_file *file) {
+	int err = fs_writable(fs);
+	if (err) return err;
+
+	memset(file, 0, sizeof(struct staged_file));
+	file->fs = fs;
+	file->inode_index = inode_index;
+	block_map_init(fs, &file->cursor, inode_index, 0, &file->run);
+	return 0;
+}
+
+
+int stage_write(struct staged_file *file, const void *data, size_t len) {
+	if (file->size + len > 0xFFFFFFFFULL) return EFBIG;
+
+	if (file->spill == NULL && file->len + len > STAGE_MEMORY_MAX) {
+		// Case: too much to hold, the staged bytes move to a temporary file
+		if ((file->spill = tmpfile()) == NULL) return errno;
+		if (fwrite(file->buf, 1, file->len, file->spill) != file->len) return errno ? errno : EIO;
+	}
+
+	if (file->spill) {
+		if (fwrite(data, 1, len, file->spill) != len) return errno ? errno : EIO;
+	}
+	else {
+		if (file->len + len > file->capacity) {
+			size_t capacity = file->capacity ? file->capacity : STAGE_READ_BYTES;
+			while (capacity < file->len + len) capacity *= 2;
+			unsigned char *buf = realloc(file->buf, capacity);
+			if (buf == NULL) return ENOMEM;
+			file->buf = buf;
+			file->capacity = capacity;
+		}
+		memcpy(file->buf + file->len, data, len);
+	}
+	file->len += len;
+	file->size += len;
+	return 0;
+}
+
+
+/*
+ * Places the first bytes of the staged data of file, keeping the rest staged.
+ */
+static int stage_place(struct staged_file *file, size_t bytes) {
+	struct ext2_fs *fs = file->fs;
+	const unsigned char *src = file->buf;
+	unsigned char *map = NULL;
+	size_t mapped = file->len;
+	int err;
+
+	if (file->spill) {
+		if (fflush(file->spill)) return errno;
+		map = mmap(NULL, mapped, PROT_READ, MAP_PRIVATE, fileno(file->spill), 0);
+		if (map == MAP_FAILED) return errno;
+		src = map;
+	}
+
+	/* the length is known now, so the run is sized to fit it exactly */
+	unsigned int blocks = align_to_nearest(fs->block_size, bytes) / fs->block_size;
+	file->run.wanted = blocks + indirect_blocks_needed(fs, file->cursor.logical, blocks);
+	err = populate_from_memory(&file->cursor, src, bytes);
+	block_run_release(fs, &file->run);
+	block_map_finish(&file->cursor);
+
+	/* what is left is less than a block, and goes back to memory */
+	size_t left = file->len - bytes;
+	if (!err && file->spill) {
+		if (left > file->capacity) {
+			unsigned char *buf = realloc(file->buf, fs->block_size);
+			if (buf == NULL) err = ENOMEM;
+			else {
+				file->buf = buf;
+				file->capacity = fs->block_size;
+			}
+		}
+		if (!err) {
+			memcpy(file->buf, src + bytes, left);
+			fclose(file->spill);
+			file->spill = NULL;
+		}
+	}
+	else if (!err) {
+		memmove(file->buf, file->buf + bytes, left);
+	}
+	if (!err) file->len = left;
+
+	if (map) munmap(map, mapped);
+	return err;
+}
+
+
+int stage_flush(struct staged_file *file) {
+	size_t bytes = file->len - file->len % file->fs->block_size;
+	return bytes ? stage_place(file, bytes) : 0;
+}
+
+
+int stage_close(struct staged_file *file) {
+	int err = file->len ? stage_place(file, file->len) : 0;
+
+	if (!err) get_inode(file->fs, file->inode_index)->i_size = file->size;
+	if (file->spill) fclose(file->spill);
+	free(file->buf);
+	file->spill = NULL;
+	file->buf = NULL;
+	return err;
+}
+
+
+int populate_inode(struct ext2_fs *fs, unsigned int inode_index, FILE *stream) {
+	struct block_run run = {0, 0, 0};
+	struct block_map_cursor cursor;
+	struct stat st;
+	size_t total_bytes = 0;
+	int fd = fileno(stream);
+	int err = fs_writable(fs);
+	if (err) return err;
+
+	block_map_init(fs, &cursor, inode_index, 0, &run);
+
+	if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > ftello(stream)) {
+		// Case: regular file, copied straight from a mapping of the source
+		off_t offset = ftello(stream);
+		if (st.st_size > 0xFFFFFFFFLL) return EFBIG;
+
+		unsigned char *src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (src != MAP_FAILED) {
+			total_bytes = st.st_size - offset;
+			unsigned int data_blocks = align_to_nearest(fs->block_size, st.st_blocks * 512 < total_bytes ? st.st_blocks * 512 : total_bytes) / fs->block_size;
+			run.wanted = data_blocks + indirect_blocks_needed(fs, 0, data_blocks);
+			madvise(src, st.st_size, MADV_SEQUENTIAL);
+
+			/* only data ranges are read; holes in the source stay holes */
+			off_t done = offset;
+			while (!err && done < st.st_size) {
+				off_t data = lseek(fd, done, SEEK_DATA);
+				off_t hole = data < 0 ? -1 : lseek(fd, data, SEEK_HOLE);
+				if (data < 0 && errno == ENXIO) break;
+				if (data < 0 || hole < 0) {
+					// Case: no SEEK_DATA support, take the rest as data
+					data = done;
+					hole = st.st_size;
+				}
+
+				/* widen the range to whole blocks of the destination */
+				data -= (data - offset) % fs->block_size;
+				if (data < done) data = done;
+				hole += (fs->block_size - (hole - offset) % fs->block_size) % fs->block_size;
+				if (hole > st.st_size) hole = st.st_size;
+
+				block_map_seek(&cursor, (data - offset) / fs->block_size);
+				err = populate_from_memory(&cursor, src + data, hole - data);
+				done = hole;
+			}
+			munmap(src, st.st_size);
+			lseek(fd, offset, SEEK_SET);
+		}
+	}
+
+	if (total_bytes == 0) {
+		// Case: stream of unknown length, staged to its end so it is placed in one go
+		struct staged_file staged;
+		unsigned char buf[STAGE_READ_BYTES];
+		size_t bytes;
+		stage_open(fs, inode_index, &staged);
+		while (!err && (bytes = fread(buf, 1, STAGE_READ_BYTES, stream)) > 0) {
+			err = stage_write(&staged, buf, bytes);
+		}
+		if (!err && ferror(stream)) err = EIO;
+		int close_err = stage_close(&staged);
+		if (!err) err = close_err;
+		total_bytes = staged.size;
+	}
+	block_run_release(fs, &run);
+
+	/* update fields for new inode once all data is in place */
+	block_map_finish(&cursor);
+	if (err) return err;
+	get_inode(fs, inode_index)->i_size = total_bytes;
+	return 0;
+}
+
+
+/*
+ * Writes out all iovecs, resuming after partial writes. Returns 0 on success, or the
+ * errno value of the failed write.
+ */
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t written = writev(fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return errno;
+		}
+		while (iovcnt > 0 && (size_t) written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov ++;
+			iovcnt --;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (unsigned char *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Queues extent of len bytes at first block for writing, flushing the queue when full.
+ */
+static int queue_extent(struct ext2_fs *fs, int fd, struct iovec *iov, int *iovcnt, unsigned int first, size_t len) {
+	unsigned char *start = (unsigned char *) get_block(fs, first);
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned char *aligned = start - ((size_t) start % page);
+
+	/* start reading the whole extent in before writev faults on it */
+	madvise(aligned, len + (start - aligned), MADV_WILLNEED);
+
+	iov[*iovcnt].iov_base = start;
+	iov[*iovcnt].iov_len = len;
+	if (++(*iovcnt) == WRITE_FILE_IOVECS) {
+		*iovcnt = 0;
+		return writev_all(fd, iov, WRITE_FILE_IOVECS);
+	}
+	return 0;
+}
+
+
+/*
+ * Queues len bytes of zeros for a hole, from a shared zero buffer rather than the image.
+ */
+static int queue_zeros(int fd, struct iovec *iov, int *iovcnt, size_t len) {
+	static const unsigned char zeros[WRITE_FILE_ZEROS];
+	int err;
+
+	while (len > 0) {
+		size_t chunk = len < WRITE_FILE_ZEROS ? len : WRITE_FILE_ZEROS;
+		iov[*iovcnt].iov_base = (void *) zeros;
+		iov[*iovcnt].iov_len = chunk;
+		if (++(*iovcnt) == WRITE_FILE_IOVECS) {
+			*iovcnt = 0;
+			if ((err = writev_all(fd, iov, WRITE_FILE_IOVECS))) return err;
+		}
+		len -= chunk;
+	}
+	return 0;
+}
+
+
+int write_file(struct ext2_fs *fs, unsigned int inode_index, int fd) {
+	struct iovec iov[WRITE_FILE_IOVECS];
+	int iovcnt = 0;
+	struct ptr_with_err result;
+	struct next_slot_state state;
+	size_t remaining = get_inode(fs, inode_index)->i_size;
+	unsigned int first = 0, count = 0;
+	unsigned long long next = 0; /* logical index following the current extent */
+	int err;
+
+	initialize_state(fs, &state, inode_index);
+	while (remaining > (size_t) count * fs->block_size) {
+		result = next_slot(&state);
+		if (result.ptr == NULL || result.err != NO_ERR) break;
+
+		unsigned int block_index = *(unsigned int *) result.ptr;
+		if (count && block_index == first + count && state.logical == next) {
+			// Case: block continues the current extent
+			count ++;
+			next ++;
+			continue;
+		}
+		if (count) {
+			if ((err = queue_extent(fs, fd, iov, &iovcnt, first, (size_t) count * fs->block_size))) return err;
+			remaining -= (size_t) count * fs->block_size;
+		}
+		if (state.logical > next) {
+			// Case: hole before this block, up to i_size at most
+			size_t hole = (size_t) (state.logical - next) * fs->block_size;
+			if (hole > remaining) hole = remaining;
+			if ((err = queue_zeros(fd, iov, &iovcnt, hole))) return err;
+			remaining -= hole;
+		}
+		first = block_index;
+		count = 1;
+		next = state.logical + 1;
+	}
+
+	/* the last extent stops at i_size, anything after it is a hole */
+	if (count) {
+		size_t len = remaining < (size_t) count * fs->block_size ? remaining : (size_t) count * fs->block_size;
+		if ((err = queue_extent(fs, fd, iov, &iovcnt, first, len))) return err;
+		remaining -= len;
+	}
+	if ((err = queue_zeros(fd, iov, &iovcnt, remaining))) return err;
+	return writev_all(fd, iov, iovcnt);
+}
+
+
+int has_file_type(struct ext2_fs *fs, int filetype, unsigned int inode_index){
+	return ((get_inode(fs, inode_index)->i_mode >> 12) == filetype)? 1 : 0;
+}
+
+
+
+
+/* BLOCK SHARING */
+
+#define REFCOUNTS_PER_BLOCK(fs) ((fs)->block_size / sizeof(unsigned short))
+
+/*
+ * Returns the count of other owners kept for block, creating the table first
+ * if create is set. Returns NULL if there is no table (or no room for one).
+ */
+static unsigned short *refcount_slot(struct ext2_fs *fs, unsigned int block_index, int create) {
+	struct ext2_inode *in = get_inode(fs, EXT2_REFCOUNT_INO);
+	unsigned int table_blocks = (fs->blocks_count + REFCOUNTS_PER_BLOCK(fs) - 1) / REFCOUNTS_PER_BLOCK(fs);
+
+	if (in->i_generation != EXT2_REFCOUNT_MAGIC) {
+		if (!create || in->i_size || in->i_blocks) return NULL;
+
+		// Case: first clone of the image, lay out a zeroed table
+		struct block_run run = {0, 0, table_blocks + indirect_blocks_needed(fs, 0, table_blocks)};
+		struct block_map_cursor cursor;
+		unsigned int i, new_block;
+		int err = 0;
+
+		block_map_init(fs, &cursor, EXT2_REFCOUNT_INO, 0, &run);
+		for (i = 0; i < table_blocks && !err; i++) {
+			if (!(err = block_map_append_run(&cursor, &new_block))) clear_block(fs, get_block(fs, new_block));
+		}
+		block_run_release(fs, &run);
+		block_map_finish(&cursor);
+		if (err) {
+			inode_truncate(fs, EXT2_REFCOUNT_INO, 0);
+			return NULL;
+		}
+		in->i_size = table_blocks * fs->block_size;
+		in->i_mode = EXT2_S_IFREG | 0600;
+		in->i_links_count = 1;
+		in->i_generation = EXT2_REFCOUNT_MAGIC;
+	}
+
+	unsigned int table_block = inode_block(fs, EXT2_REFCOUNT_INO, block_index / REFCOUNTS_PER_BLOCK(fs));
+	if (table_block == 0) return NULL;
+	return ((unsigned short *) get_block(fs, table_block)) + block_index % REFCOUNTS_PER_BLOCK(fs);
+}
+
+
+unsigned int block_refs(struct ext2_fs *fs, unsigned int block_index) {
+	unsigned short *refs = refcount_slot(fs, block_index, 0);
+	return refs ? *refs : 0;
+}
+
+
+int block_ref(struct ext2_fs *fs, unsigned int block_index) {
+	unsigned short *refs = refcount_slot(fs, block_index, 1);
+	if (refs == NULL) return ENOSPC;
+	if (*refs == 0xFFFF) return EMLINK;
+	(*refs) ++;
+	return 0;
+}
+
+
+int block_unref(struct ext2_fs *fs, unsigned int block_index) {
+	unsigned short *refs = refcount_slot(fs, block_index, 0);
+	if (refs == NULL || *refs == 0) return 0;
+	(*refs) --;
+	return 1;
+}
+
+
+int clone_inode(struct ext2_fs *fs, unsigned int inode_src, unsigned int inode_dest) {
+	struct ptr_with_err result;
+	struct next_slot_state state;
+	struct block_map_cursor cursor;
+	int err = fs_writable(fs);
+	if (err) return err;
+
+	unsigned int data_blocks = align_to_nearest(fs->block_size, get_inode(fs, inode_src)->i_size) / fs->block_size;
+	struct block_run run = {0, 0, indirect_blocks_needed(fs, 0, data_blocks)};
+
+	/* the copy gets indirect blocks of its own, pointing at the same data blocks */
+	block_map_init(fs, &cursor, inode_dest, 0, &run);
+	initialize_state(fs, &state, inode_src);
+	while ((result = next_slot(&state)).ptr != NULL && result.err == NO_ERR) {
+		unsigned int block_index = *((unsigned int *) result.ptr);
+		block_map_seek(&cursor, state.logical);
+
+		err = block_ref(fs, block_index);
+		if (err == EMLINK) {
+			// Case: block shared as often as the table can count, copy it instead
+			unsigned int new_block = allocate_block_near(fs, cursor.goal);
+			if (new_block == 0) {
+				err = ENOSPC;
+				break;
+			}
+			copy_block(fs, get_block(fs, block_index), get_block(fs, new_block));
+			if ((err = block_map_append(&cursor, new_block))) {
+				free_block(fs, new_block);
+				break;
+			}
+			continue;
+		}
+		if (err) break;
+		if ((err = block_map_append(&cursor, block_index))) {
+			block_unref(fs, block_index);
+			break;
+		}
+	}
+	block_run_release(fs, &run);
+	block_map_finish(&cursor);
+	if (err) return err;
+
+	get_inode(fs, inode_dest)->i_mode = get_inode(fs, inode_src)->i_mode;
+	get_inode(fs, inode_dest)->i_size = get_inode(fs, inode_src)->i_size;
+	return 0;
+}
+
+
+
+
+/* DEFRAGMENTATION */
+
+/*
+ * Counts the indirect blocks of the tree under slot, depth levels deep, and frees 
+ * them as well if release is set. The data blocks they map are left as they are.
+ */
+static unsigned int indirect_tree(struct ext2_fs *fs, unsigned int *slot, unsigned int depth, int release) {
+	unsigned int count = 1, i;
+	if (depth == 0 || *slot == 0) return 0;
+
+	if (depth > 1) {
+		for (i = 0; i < fs->addr_per_block; i++) {
+			count += indirect_tree(fs, get_block(fs, *slot)->addr + i, depth - 1, release);
+		}
+	}
+	if (release) {
+		free_block(fs, *slot);
+		*slot = 0;
+	}
+	return count;
+}
+
+
+static unsigned int indirect_blocks(struct ext2_fs *fs, unsigned int *i_block, int release) {
+	return indirect_tree(fs, &i_block[EXT2_IND_BLOCK], 1, release) 
+		+ indirect_tree(fs, &i_block[EXT2_DIND_BLOCK], 2, release) 
+		+ indirect_tree(fs, &i_block[EXT2_TIND_BLOCK], 3, release);
+}
+
+
+unsigned int inode_fragmentation(struct ext2_fs *fs, unsigned int inode_index, struct inode_frag *frag) {
+	struct next_slot_state state;
+	struct ptr_with_err result;
+	unsigned int prev = 0, logical = 0, index[4];
+
+	frag->inode_index = inode_index;
+	frag->blocks = 0;
+	frag->extents = 0;
+	frag->shared = 0;
+
+	initialize_state(fs, &state, inode_index);
+	while ((result = next_slot(&state)).ptr != NULL && result.err == NO_ERR) {
+		unsigned int block_index = *((unsigned int *) result.ptr);
+
+		/* past a hole, any table on the way down may have been created for this block */
+		unsigned int ahead = state.logical == logical + 1 ? indirect_blocks_needed(fs, state.logical, 1) : block_map_path(fs, state.logical, index);
+
+		// Case: block starts a new run, unless it follows the last one or the indirect blocks mapping it
+		if (frag->blocks == 0 || block_index <= prev || block_index > prev + 1 + ahead) frag->extents ++;
+		if (block_refs(fs, block_index)) frag->shared = 1;
+		frag->blocks ++;
+		prev = block_index;
+		logical = state.logical;
+	}
+	return frag->extents;
+}
+
+
+/*
+ * Copies count blocks from old to new and frees the old ones.
+ */
+static void defrag_move(struct ext2_fs *fs, unsigned int old, unsigned int new, unsigned int count) {
+	if (count == 0) return;
+	memcpy(get_block(fs, new), get_block(fs, old), (size_t) count * fs->block_size);
+	free_block_run(fs, old, count);
+}
+
+
+int defrag_inode(struct ext2_fs *fs, unsigned int inode_index) {
+	struct ext2_inode *in = get_inode(fs, inode_index);
+	struct ext2_inode old;
+	struct inode_frag frag;
+	struct next_slot_state state;
+	struct ptr_with_err result;
+	struct block_map_cursor cursor;
+	struct block_run run, *runs;
+	unsigned int from = 0, to = 0, len = 0, nruns = 0, next = 1, taken = 0;
+	int err = fs_writable(fs);
+	if (err) return err;
+
+	if (inode_fragmentation(fs, inode_index, &frag) <= 1) return 0;
+	// Case: the other owners would keep pointing at the old blocks
+	if (frag.shared) return EBUSY;
+	if ((runs = malloc((frag.extents - 1) * sizeof(struct block_run))) == NULL) return ENOMEM;
+
+	/* 
+	 * the data and as many indirect blocks as the old map has go into one run near 
+	 * the inode, or else the longest runs there are, as long as they are fewer pieces
+	 * than the file is in now
+	 */
+	unsigned int need = frag.blocks + indirect_blocks(fs, in->i_block, 0);
+	unsigned int goal = inode_goal(fs, inode_index);
+	while (taken < need && nruns < frag.extents - 1) {
+		unsigned int want = need - taken, longest = longest_free_run(fs);
+		if (want > longest) want = longest;
+		if (want == 0) break;
+		runs[nruns].next = allocate_block_run(fs, goal, want, want, &runs[nruns].count);
+		runs[nruns].wanted = 0;
+		if (runs[nruns].count == 0) break;
+		goal = runs[nruns].next + runs[nruns].count;
+		taken += runs[nruns++].count;
+	}
+	if (taken < need) {
+		while (nruns > 0) block_run_release(fs, &runs[--nruns]);
+		free(runs);
+		return ENOSPC;
+	}
+	run = runs[0];
+
+	/* the old map is read from a copy of the inode while the new one is built in it */
+	old = *in;
+	initialize_state(fs, &state, inode_index);
+	state.in = &old;
+	initialize_state_i(fs, &state.indirection_state, old.i_block, 0);
+	memset(in->i_block, 0, sizeof(in->i_block));
+	in->i_blocks -= need * (fs->block_size / 512);
+	block_map_init(fs, &cursor, inode_index, 0, &run);
+
+	/* data moves a run at a time, as long as both the old and the new blocks are consecutive */
+	while ((result = next_slot(&state)).ptr != NULL && result.err == NO_ERR) {
+		unsigned int block_index = *((unsigned int *) result.ptr), new_block;
+		block_map_seek(&cursor, state.logical);
+
+		// Case: run too short for the block and the indirect blocks in front of it, go on in the next
+		if (run.count < 1 + indirect_blocks_needed(fs, state.logical, 1) && next < nruns) {
+			block_run_release(fs, &run);
+			run = runs[next++];
+		}
+		if ((err = block_map_append_run(&cursor, &new_block))) break;
+
+		if (len && block_index == from + len && new_block == to + len) {
+			len ++;
+			continue;
+		}
+		defrag_move(fs, from, to, len);
+		from = block_index;
+		to = new_block;
+		len = 1;
+	}
+	defrag_move(fs, from, to, len);
+	block_run_release(fs, &run);
+	while (next < nruns) block_run_release(fs, &runs[next++]);
+	free(runs);
+	block_map_finish(&cursor);
+
+	/* the old indirect blocks go last, the old map was read through them */
+	indirect_blocks(fs, old.i_block, 1);
+	return err;
+}
+
+
+
+
+/* DENTRY CACHE */
+
+#define DENTRY_TABLE_MIN 256
+
+/*
+ * Cached name lookup. Full paths are kept in a table of their own under parent 0,
+ * which no directory has.
+ */
+struct dentry {
+	struct dentry *next;
+	unsigned int parent;
+	unsigned int child;
+	unsigned int name_len;
+	char name[];
+};
+
+
+
+static unsigned int dentry_hash(unsigned int parent, const char *name, unsigned int name_len) {
+	unsigned int hash = 2166136261U ^ parent;
+	unsigned int i;
+
+	/* FNV-1a */
+	for (i = 0; i < name_len; i++) {
+		hash = (hash ^ (unsigned char) name[i]) * 16777619U;
+	}
+	return hash;
+}
+
+
+/*
+ * Returns the link pointing at the entry for parent and name in table, or at the
+ * NULL ending its bucket if there is none. Returns NULL if table is empty.
+ */
+static struct dentry **dentry_link(struct dentry_table *table, unsigned int parent, const char *name, unsigned int name_len) {
+	if (!table->size) return NULL;
+
+	struct dentry **link = &table->buckets[dentry_hash(parent, name, name_len) & (table->size - 1)];
+	while (*link) {
+		struct dentry *d = *link;
+		if (d->parent == parent && d->name_len == name_len && !memcmp(d->name, name, name_len)) break;
+		link = &d->next;
+	}
+	return link;
+}
+
+
+static void dentry_table_grow(struct dentry_table *table) {
+	unsigned int size = table->size ? table->size * 2 : DENTRY_TABLE_MIN;
+	struct dentry **buckets = calloc(size, sizeof(struct dentry *));
+	unsigned int i;
+
+	/* a full table only gets slower, so running out of memory here is not fatal */
+	if (buckets == NULL) return;
+
+	for (i = 0; i < table->size; i++) {
+		struct dentry *d = table->buckets[i], *next;
+		for (; d; d = next) {
+			next = d->next;
+			unsigned int bucket = dentry_hash(d->parent, d->name, d->name_len) & (size - 1);
+			d->next = buckets[bucket];
+			buckets[bucket] = d;
+		}
+	}
+	free(table->buckets);
+	table->buckets = buckets;
+	table->size = size;
+}
+
+
+static unsigned int dentry_table_get(struct dentry_table *table, unsigned int parent, const char *name, unsigned int name_len) {
+	struct dentry **link = dentry_link(table, parent, name, name_len);
+	return (link && *link) ? (*link)->child : 0;
+}
+
+
+static void dentry_table_put(struct dentry_table *table, unsigned int parent, const char *name, unsigned int name_len, unsigned int child) {
+	struct dentry **link = dentry_link(table, parent, name, name_len);
+	if (link && *link) {
+		(*link)->child = child;
+		return;
+	}
+
+	if (table->count >= table->size) {
+		dentry_table_grow(table);
+		if (!table->size) return;
+		link = dentry_link(table, parent, name, name_len);
+	}
+
+	struct dentry *d = malloc(sizeof(struct dentry) + name_len);
+	if (d == NULL) return;
+	d->next = NULL;
+	d->parent = parent;
+	d->child = child;
+	d->name_len = name_len;
+	memcpy(d->name, name, name_len);
+	*link = d;
+	table->count ++;
+}
+
+
+static void dentry_table_remove(struct dentry_table *table, unsigned int parent, const char *name, unsigned int name_len) {
+	struct dentry **link = dentry_link(table, parent, name, name_len);
+	if (link && *link) {
+		struct dentry *d = *link;
+		*link = d->next;
+		free(d);
+		table->count --;
+	}
+}
+
+
+static void dentry_table_clear(struct dentry_table *table) {
+	unsigned int i;
+	for (i = 0; i < table->size; i++) {
+		struct dentry *d = table->buckets[i], *next;
+		for (; d; d = next) {
+			next = d->next;
+			free(d);
+		}
+		table->buckets[i] = NULL;
+	}
+	table->count = 0;
+}
+
+
+/*
+ * "." and ".." are left out, ".." can be rewritten in place when a directory moves.
+ */
+static int dentry_cacheable(const char *name, unsigned int name_len) {
+	return !((name_len == 1 && name[0] == '.') || (name_len == 2 && name[0] == '.' && name[1] == '.'));
+}
+
+
+unsigned int dentry_lookup(struct ext2_fs *fs, unsigned int parent, char *name) {
+	return dentry_table_get(&fs->dentries, parent, name, strlen(name));
+}
+
+
+void dentry_insert(struct ext2_fs *fs, unsigned int parent, char *name, int name_len, unsigned int child) {
+	if (dentry_cacheable(name, name_len)) {
+		dentry_table_put(&fs->dentries, parent, name, name_len, child);
+	}
+}
+
+
+void dentry_forget(struct ext2_fs *fs, unsigned int parent, char *name, int name_len) {
+	dentry_table_remove(&fs->dentries, parent, name, name_len);
+	dentry_table_clear(&fs->paths);
+	dentry_table_clear(&fs->links);
+}
+
+
+void dentry_cache_clear(struct ext2_fs *fs) {
+	dentry_table_clear(&fs->dentries);
+	dentry_table_clear(&fs->paths);
+	dentry_table_clear(&fs->links);
+}
+
+
+
+
+/* PATH OPERATIONS */
+
+char *extract_parent_path(char *path) {
+	char *copy;
+	copy = copy_str(path);
+	int index = extract_filename_unsafe(copy) - copy;
+	free(copy);
+	copy = copy_str(path);
+	copy[index] = '\0';
+	return copy;
+}
+
+
+char *extract_filename_unsafe(char *path) {
+	char *token, *token_new;
+	char *saveptr = NULL;
+	token = strtok_r(path, "/", &saveptr);
+	while ((token_new = strtok_r(NULL, "/", &saveptr))) {
+		token = token_new;
+	}
+	return token;
+}
+
+
+char *extract_filename(char *path) {
+	path = copy_str(path);
+	return extract_filename_unsafe(path);
+}
+
+
+char *path_split(char *path, char **name) {
+	size_t len = strlen(path);
+	char *buf = malloc(2 * len + 2);
+	if (buf == NULL) return NULL;
+
+	/* drop trailing slashes, then the last component starts after the slash before it */
+	size_t end = len, start;
+	while (end > 0 && path[end - 1] == '/') end--;
+	for (start = end; start > 0 && path[start - 1] != '/'; start--);
+
+	memcpy(buf, path, start);
+	buf[start] = '\0';
+	*name = buf + start + 1;
+	memcpy(*name, path + start, end - start);
+	(*name)[end - start] = '\0';
+	return buf;
+}
+
+
+/*
+ * Path, or symbolic link target, being walked by inode_from_path.
+ */
+struct path_frame {
+	char *buf;
+	char *saveptr;
+	unsigned int link; /* symbolic link whose target this is, 0 for the path itself */
+	unsigned int dir;  /* directory a relative target starts from, 0 for an absolute one */
+};
+
+
+/*
+ * Resolution of symbolic link cached for dir, the directory it was reached from. 
+ * Absolute targets resolve the same from anywhere, so they are cached for 0.
+ */
+static unsigned int link_cache_get(struct ext2_fs *fs, unsigned int link, unsigned int dir) {
+	unsigned int resolved = dentry_table_get(&fs->links, link, (char *) &dir, sizeof(dir));
+	return resolved ? resolved : dentry_table_get(&fs->links, link, "", 0);
+}
+
+
+static void link_cache_put(struct ext2_fs *fs, unsigned int link, unsigned int dir, unsigned int resolved) {
+	if (dir) dentry_table_put(&fs->links, link, (char *) &dir, sizeof(dir), resolved);
+	else dentry_table_put(&fs->links, link, "", 0, resolved);
+}
+
+
+int inode_from_path(struct ext2_fs *fs, char *path, unsigned int *inode_found){
+	struct path_frame frames[EXT2_SYMLOOP_MAX + 1];
+	unsigned int path_len = strlen(path);
+	unsigned int followed = 0;
+	int depth = 0;
+	int err = 0;
+	char *token;
+
+	/* whole path resolved before and nothing removed since */
+	unsigned int inode_index = dentry_table_get(&fs->paths, 0, path, path_len);
+	if (inode_index) {
+		*inode_found = inode_index;
+		return 0;
+	}
+
+	frames[0].buf = copy_str(path);
+	frames[0].saveptr = NULL;
+	frames[0].link = 0;
+	frames[0].dir = 0;
+	if (frames[0].buf == NULL) return ENOMEM;
+	token = strtok_r(frames[0].buf, "/", &frames[0].saveptr);
+	inode_index = EXT2_ROOT_INO;
+
+	/* links are followed by walking their target in a frame of its own, without recursion */
+	while (1) {
+		if (token == NULL) {
+			if (depth == 0) break;
+
+			// Case: target of a link fully walked, which now resolves to inode_index
+			link_cache_put(fs, frames[depth].link, frames[depth].dir, inode_index);
+			free(frames[depth].buf);
+			depth --;
+			token = strtok_r(NULL, "/", &frames[depth].saveptr);
+			continue;
+		}
+
+		if (!has_file_type(fs, EXT2_INODE_FT_DIR, inode_index)) {
+			err = ENOENT;
+			break;
+		}
+		unsigned int child = dentry_lookup(fs, inode_index, token);
+		if (child == 0) {
+			struct ext2_dir_entry_2 *de = dir_find(fs, inode_index, token);
+			if (de == NULL) {
+				err = ENOENT;
+				break;
+			} 
+			child = de->inode;
+			dentry_insert(fs, inode_index, token, strlen(token), child);
+		}
+
+		if (has_file_type(fs, EXT2_INODE_FT_SYMLINK, child)) {
+			if (++followed > EXT2_SYMLOOP_MAX) {
+				err = ELOOP;
+				break;
+			}
+			unsigned int resolved = link_cache_get(fs, child, inode_index);
+			if (resolved == 0) {
+				// Case: link not resolved before, walk its target from the directory holding it
+				char *target = symlink_target(fs, child);
+				if (target == NULL) {
+					err = ENOMEM;
+					break;
+				}
+				depth ++;
+				frames[depth].buf = target;
+				frames[depth].saveptr = NULL;
+				frames[depth].link = child;
+				frames[depth].dir = target[0] == '/' ? 0 : inode_index;
+				if (target[0] == '/') inode_index = EXT2_ROOT_INO;
+				token = strtok_r(target, "/", &frames[depth].saveptr);
+				continue;
+			}
+			child = resolved;
+		}
+
+		inode_index = child;
+		token = strtok_r(NULL, "/", &frames[depth].saveptr);
+	}
+
+	for (; depth >= 0; depth--) {
+		free(frames[depth].buf);
+	}
+	if (err) return err;
+
+	dentry_table_put(&fs->paths, 0, path, path_len, inode_index);
+	*inode_found = inode_index;
+	return 0;
+}
+
+
+int inode_fast_symlink(struct ext2_fs *fs, unsigned int inode_index) {
+	struct ext2_inode *in = get_inode(fs, inode_index);
+	return (in->i_mode >> 12) == EXT2_INODE_FT_SYMLINK && in->i_blocks == 0 && in->i_size < EXT2_FAST_SYMLINK_MAX;
+}
+
+
+int init_symlink_inode(struct ext2_fs *fs, unsigned int inode_index, char *target) {
+	struct ext2_inode *in = get_inode(fs, inode_index);
+	size_t len = strlen(target);
+	int err = fs_writable(fs);
+	if (err) return err;
+
+	if (len < EXT2_FAST_SYMLINK_MAX) {
+		// Case: short target, kept in i_block without a data block
+		memset(in->i_block, 0, sizeof(in->i_block));
+		memcpy(in->i_block, target, len);
+		in->i_size = len;
+	}
+	else {
+		/* store target path as the contents of the inode */
+		FILE *path_stream = fmemopen(target, len, "r");
+		if (path_stream == NULL) return ENOMEM;
+		err = populate_inode(fs, inode_index, path_stream);
+		fclose(path_stream);
+		if (err) return err;
+	}
+	in->i_mode = (EXT2_INODE_FT_SYMLINK << 12) | 0777;
+	return 0;
+}
+
+
+char *symlink_target(struct ext2_fs *fs, unsigned int sym_inode_index) {
+	unsigned int size = get_inode(fs, sym_inode_index)->i_size;
+	char *sym_path = malloc(size + 1);
+	char *read_ptr = sym_path;
+	if (sym_path == NULL) return NULL;
+
+	if (inode_fast_symlink(fs, sym_inode_index)) {
+		memcpy(sym_path, get_inode(fs, sym_inode_index)->i_block, size);
+		sym_path[size] = '\0';
+		return sym_path;
+	}
+
+	struct next_slot_state state;
+	struct ptr_with_err result;
+	initialize_state(fs, &state, sym_inode_index);
+
+	int remaining = size;
+
+	/* cycle through all blocks */
+	while (remaining > 0) {
+		result = next_slot(&state);
+		if (result.ptr != NULL && result.err == NO_ERR) {
+			int read_count = remaining < fs->block_size ? remaining : fs->block_size;
+			memcpy(read_ptr, get_block(fs, * (unsigned int *) result.ptr), read_count);
+			read_ptr += read_count;
+			remaining -= read_count;
+		} 
+		else break;
+	}
+	*read_ptr = '\0';
+	return sym_path;
+}
+
+
+int inode_from_symlink(struct ext2_fs *fs, unsigned int sym_inode_index, unsigned int *inode_found){
+	char *sym_path = symlink_target(fs, sym_inode_index);
+	if (sym_path == NULL) return ENOMEM;
+
+	int err = inode_from_path(fs, sym_path, inode_found);
+	free(sym_path);
+	return err;
+}
+
+
+
+
+/* TREE WALK */
+
+/*
+ * Directory waiting to be read by a walker thread.
+ */
+struct walk_job {
+	char *path;
+	unsigned int inode;
+	unsigned int depth;
+};
+
+/*
+ * Jobs of one walker thread. The owner pushes and pops at the tail, idle threads
+ * steal the oldest job (likely the largest subtree) from the head.
+ */
+struct walk_deque {
+	pthread_mutex_t lock;
+	struct walk_job *jobs;
+	size_t head, tail, capacity;
+};
+
+struct walk_state {
+	struct ext2_fs *fs;
+	walk_visit visit;
+	void *arg;
+	unsigned int threads;
+	struct walk_deque *deques;
+	unsigned long pending; /* jobs pushed and not yet finished */
+	int err;               /* first failure, stops every thread */
+};
+
+struct walk_worker {
+	struct walk_state *state;
+	unsigned int id;
+};
+
+
+static int walk_push(struct walk_deque *deque, struct walk_job *job) {
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail == deque->capacity) {
+		if (deque->head > deque->capacity / 2) {
+			// Case: mostly stolen from, reuse the front
+			memmove(deque->jobs, deque->jobs + deque->head, (deque->tail - deque->head) * sizeof(struct walk_job));
+			deque->tail -= deque->head;
+			deque->head = 0;
+		}
+		else {
+			size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+			struct walk_job *jobs = realloc(deque->jobs, capacity * sizeof(struct walk_job));
+			if (jobs == NULL) {
+				pthread_mutex_unlock(&deque->lock);
+				return ENOMEM;
+			}
+			deque->jobs = jobs;
+			deque->capacity = capacity;
+		}
+	}
+	deque->jobs[deque->tail++] = *job;
+	pthread_mutex_unlock(&deque->lock);
+	return 0;
+}
+
+
+/*
+ * Takes a job from the tail (own deque) or the head (stealing). Returns 1 if one was taken.
+ */
+static int walk_take(struct walk_deque *deque, struct walk_job *job, int steal) {
+	int taken = 0;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->head < deque->tail) {
+		*job = steal ? deque->jobs[deque->head++] : deque->jobs[--deque->tail];
+		if (deque->head == deque->tail) deque->head = deque->tail = 0;
+		taken = 1;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return taken;
+}
+
+
+static void walk_fail(struct walk_state *state, int err) {
+	int none = 0;
+	__atomic_compare_exchange_n(&state->err, &none, err, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Visits every entry of directory in job, queueing subdirectories on the deque of worker.
+ */
+static void walk_dir(struct walk_worker *worker, struct walk_job *job) {
+	struct walk_state *state = worker->state;
+	struct ext2_fs *fs = state->fs;
+	struct next_slot_state slots;
+	struct ptr_with_err result;
+	size_t path_len = strlen(job->path);
+	int slash = (path_len == 0 || job->path[path_len - 1] != '/');
+
+	initialize_state(fs, &slots, job->inode);
+	while ((result = next_slot(&slots)).ptr != NULL && result.err == NO_ERR) {
+		struct ext2_dir_entry_2 *cur = (struct ext2_dir_entry_2 *) get_block(fs, *((unsigned int *) result.ptr));
+		int remaining = fs->block_size;
+
+		if (__atomic_load_n(&state->err, __ATOMIC_RELAXED)) return;
+		do {
+			if (!cur->inode || cur->rec_len == 0) continue;
+			if (cur->name_len == 1 && cur->name[0] == '.') continue;
+			if (cur->name_len == 2 && cur->name[0] == '.' && cur->name[1] == '.') continue;
+
+			char *path = malloc(path_len + slash + cur->name_len + 1);
+			if (path == NULL) {
+				walk_fail(state, ENOMEM);
+				return;
+			}
+			memcpy(path, job->path, path_len);
+			if (slash) path[path_len] = '/';
+			memcpy(path + path_len + slash, cur->name, cur->name_len);
+			path[path_len + slash + cur->name_len] = '\0';
+
+			struct walk_entry entry = {path, cur->inode, get_inode(fs, cur->inode), job->depth + 1, worker->id};
+			int err = state->visit(fs, &entry, state->arg);
+			if (err) {
+				free(path);
+				walk_fail(state, err);
+				return;
+			}
+
+			if (has_file_type(fs, EXT2_INODE_FT_DIR, cur->inode)) {
+				// Case: subdirectory, left for this thread or a thief
+				struct walk_job child = {path, cur->inode, job->depth + 1};
+				__atomic_add_fetch(&state->pending, 1, __ATOMIC_SEQ_CST);
+				if ((err = walk_push(&state->deques[worker->id], &child))) {
+					__atomic_sub_fetch(&state->pending, 1, __ATOMIC_SEQ_CST);
+					free(path);
+					walk_fail(state, err);
+					return;
+				}
+			}
+			else {
+				free(path);
+			}
+		}
+		while (dir_entry_next(&cur, &remaining));
+	}
+}
+
+
+static void *walk_worker_run(void *arg) {
+	struct walk_worker *worker = arg;
+	struct walk_state *state = worker->state;
+	struct walk_job job;
+	unsigned int i;
+
+	while (!__atomic_load_n(&state->err, __ATOMIC_RELAXED)) {
+		int taken = walk_take(&state->deques[worker->id], &job, 0);
+
+		/* own deque empty: steal, starting with the next thread */
+		for (i = 1; !taken && i < state->threads; i++) {
+			taken = walk_take(&state->deques[(worker->id + i) % state->threads], &job, 1);
+		}
+
+		if (taken) {
+			walk_dir(worker, &job);
+			free(job.path);
+			__atomic_sub_fetch(&state->pending, 1, __ATOMIC_SEQ_CST);
+		}
+		else if (__atomic_load_n(&state->pending, __ATOMIC_SEQ_CST) == 0) {
+			// Case: nothing queued anywhere and nobody left to queue more
+			break;
+		}
+		else {
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+
+int walk_tree(struct ext2_fs *fs, char *path, unsigned int threads, walk_visit visit, void *arg) {
+	unsigned int inode_index, i;
+	int err;
+
+	if ((err = inode_from_path(fs, path, &inode_index))) return err;
+	if (threads == 0) threads = 1;
+
+	/* the starting point is visited first, like find does */
+	struct walk_entry entry = {path, inode_index, get_inode(fs, inode_index), 0, 0};
+	if ((err = visit(fs, &entry, arg))) return err;
+	if (!has_file_type(fs, EXT2_INODE_FT_DIR, inode_index)) return 0;
+
+	struct walk_state state = {fs, visit, arg, threads, calloc(threads, sizeof(struct walk_deque)), 1, 0};
+	struct walk_worker *workers = calloc(threads, sizeof(struct walk_worker));
+	pthread_t *tids = calloc(threads, sizeof(pthread_t));
+	struct walk_job root = {copy_str(path), inode_index, 0};
+	if (state.deques == NULL || workers == NULL || tids == NULL || root.path == NULL) {
+		free(state.deques);
+		free(workers);
+		free(tids);
+		free(root.path);
+		return ENOMEM;
+	}
+
+	for (i = 0; i < threads; i++) {
+		pthread_mutex_init(&state.deques[i].lock, NULL);
+		workers[i].state = &state;
+		workers[i].id = i;
+	}
+	if ((err = walk_push(&state.deques[0], &root))) {
+		free(root.path);
+		state.pending = 0;
+		state.err = err;
+	}
+
+	/* the calling thread is worker 0 */
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, walk_worker_run, &workers[i])) break;
+	}
+	unsigned int started = i;
+	walk_worker_run(&workers[0]);
+	for (i = 1; i < started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	/* jobs left behind after a failure */
+	for (i = 0; i < threads; i++) {
+		struct walk_job job;
+		while (walk_take(&state.deques[i], &job, 0)) free(job.path);
+		free(state.deques[i].jobs);
+		pthread_mutex_destroy(&state.deques[i].lock);
+	}
+	free(state.deques);
+	free(workers);
+	free(tids);
+	return state.err;
+}
+
+
+
+
+/* TREE IMPORT */
+
+/*
+ * Host file or directory to be copied in, listed parents first.
+ */
+struct import_node {
+	char *host_path;
+	char *name;        /* last component, within host_path except for the top node */
+	mode_t mode;
+	off_t size;
+	time_t mtime;
+	int parent;        /* index of parent node, -1 for the top node */
+	unsigned int inode;
+
+	/* directories only */
+	unsigned int dir_blocks;            /* blocks the entries are packed into */
+	unsigned int dir_used;              /* bytes of the last block taken while sizing */
+	unsigned int dir_logical;           /* block being filled */
+	struct ext2_dir_entry_2 *dir_last;  /* last entry written, NULL before "." */
+};
+
+struct import_tree {
+	struct ext2_fs *fs;
+	struct import_node *nodes;
+	unsigned int count, capacity;
+	unsigned long long blocks; /* data and indirect blocks needed */
+};
+
+/*
+ * Contents of one host file, read ahead by the reader thread. Files too large to
+ * be held in memory are passed on open instead.
+ */
+struct import_item {
+	unsigned char *data;
+	size_t len;
+	int fd;
+	int err;
+};
+
+/*
+ * Bounded queue between the reader thread and the thread writing the image, 
+ * holding the regular files of the tree in node order.
+ */
+struct import_pipe {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	struct import_tree *tree;
+	struct import_item items[IMPORT_PIPE_SLOTS];
+	unsigned int produced, consumed;
+	size_t bytes; /* bytes held by queued items */
+	int stop;
+};
+
+
+/*
+ * Blocks a file of size bytes takes, indirect blocks included.
+ */
+static unsigned long long import_blocks(struct ext2_fs *fs, unsigned long long size) {
+	unsigned int data_blocks = (size + fs->block_size - 1) / fs->block_size;
+	return data_blocks + indirect_blocks_needed(fs, 0, data_blocks);
+}
+
+
+static int import_add_node(struct import_tree *tree, char *host_path, char *name, struct stat *st, int parent) {
+	if (!S_ISDIR(st->st_mode) && !S_ISREG(st->st_mode) && !S_ISLNK(st->st_mode)) return EOPNOTSUPP;
+	if (strlen(name) > EXT2_NAME_LEN) return ENAMETOOLONG;
+	if (st->st_size > 0xFFFFFFFFLL) return EFBIG;
+
+	if (tree->count == tree->capacity) {
+		unsigned int capacity = tree->capacity ? tree->capacity * 2 : 256;
+		struct import_node *nodes = realloc(tree->nodes, capacity * sizeof(struct import_node));
+		if (nodes == NULL) return ENOMEM;
+		tree->nodes = nodes;
+		tree->capacity = capacity;
+	}
+
+	struct import_node *node = &tree->nodes[tree->count++];
+	memset(node, 0, sizeof(struct import_node));
+	node->host_path = host_path;
+	node->name = name;
+	node->mode = st->st_mode;
+	node->size = st->st_size;
+	node->mtime = st->st_mtime;
+	node->parent = parent;
+	if (S_ISDIR(st->st_mode)) {
+		/* "." and ".." */
+		node->dir_blocks = 1;
+		node->dir_used = 2 * dir_entry_size(2);
+	}
+	else {
+		tree->blocks += import_blocks(tree->fs, st->st_size);
+	}
+
+	if (parent >= 0) {
+		/* pack entry into parent the way import_dir_put will */
+		struct import_node *dir = &tree->nodes[parent];
+		unsigned int size = dir_entry_size(strlen(name));
+		if (dir->dir_used + size > tree->fs->block_size) {
+			dir->dir_blocks ++;
+			dir->dir_used = size;
+		}
+		else {
+			dir->dir_used += size;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Lists the entries of host directory of node dir, then descends into its 
+ * subdirectories, so every node comes after its parent.
+ */
+static int import_scan(struct import_tree *tree, unsigned int dir) {
+	DIR *d = opendir(tree->nodes[dir].host_path);
+	unsigned int first = tree->count, i;
+	struct dirent *ent;
+	struct stat st;
+	int err = 0;
+
+	if (d == NULL) return errno;
+	while (!err && (errno = 0, ent = readdir(d)) != NULL) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+
+		size_t dir_len = strlen(tree->nodes[dir].host_path);
+		char *host_path = malloc(dir_len + strlen(ent->d_name) + 2);
+		if (host_path == NULL) {
+			err = ENOMEM;
+			break;
+		}
+		sprintf(host_path, "%s/%s", tree->nodes[dir].host_path, ent->d_name);
+		if (lstat(host_path, &st)) err = errno;
+		if (err || (err = import_add_node(tree, host_path, host_path + dir_len + 1, &st, dir))) free(host_path);
+	}
+	if (!err && errno) err = errno;
+	closedir(d);
+
+	unsigned int last = tree->count;
+	for (i = first; !err && i < last; i++) {
+		if (S_ISDIR(tree->nodes[i].mode)) err = import_scan(tree, i);
+	}
+	if (!err) tree->blocks += tree->nodes[dir].dir_blocks + indirect_blocks_needed(tree->fs, 0, tree->nodes[dir].dir_blocks);
+	return err;
+}
+
+
+/*
+ * Reads the next regular file of the tree for the queue.
+ */
+static void import_read(struct import_node *node, struct import_item *item) {
+	struct stat st;
+	size_t done = 0;
+	ssize_t n;
+
+	memset(item, 0, sizeof(struct import_item));
+	item->fd = open(node->host_path, O_RDONLY);
+	if (item->fd < 0 || fstat(item->fd, &st)) {
+		item->err = errno;
+		if (item->fd >= 0) close(item->fd);
+		item->fd = -1;
+		return;
+	}
+
+	if (st.st_size > IMPORT_READ_MAX) {
+		// Case: left for the writer to map, only started reading here
+		posix_fadvise(item->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(item->fd, 0, 0, POSIX_FADV_WILLNEED);
+		return;
+	}
+
+	item->data = malloc(st.st_size ? st.st_size : 1);
+	if (item->data == NULL) item->err = ENOMEM;
+	while (item->data && done < (size_t) st.st_size && (n = read(item->fd, item->data + done, st.st_size - done)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			item->err = errno;
+			break;
+		}
+		done += n;
+	}
+	item->len = done;
+	close(item->fd);
+	item->fd = -1;
+}
+
+
+static void *import_reader(void *arg) {
+	struct import_pipe *pipe = arg;
+	struct import_item item;
+	unsigned int i;
+
+	for (i = 0; i < pipe->tree->count; i++) {
+		if (!S_ISREG(pipe->tree->nodes[i].mode)) continue;
+
+		pthread_mutex_lock(&pipe->lock);
+		while (!pipe->stop && (pipe->produced - pipe->consumed == IMPORT_PIPE_SLOTS || pipe->bytes >= IMPORT_PIPE_BYTES)) {
+			pthread_cond_wait(&pipe->changed, &pipe->lock);
+		}
+		int stop = pipe->stop;
+		pthread_mutex_unlock(&pipe->lock);
+		if (stop) break;
+
+		import_read(&pipe->tree->nodes[i], &item);
+
+		pthread_mutex_lock(&pipe->lock);
+		pipe->items[pipe->produced++ % IMPORT_PIPE_SLOTS] = item;
+		pipe->bytes += item.len;
+		pthread_cond_broadcast(&pipe->changed);
+		pthread_mutex_unlock(&pipe->lock);
+	}
+	return NULL;
+}
+
+
+static void import_take(struct import_pipe *pipe, struct import_item *item) {
+	pthread_mutex_lock(&pipe->lock);
+	while (pipe->consumed == pipe->produced) {
+		pthread_cond_wait(&pipe->changed, &pipe->lock);
+	}
+	*item = pipe->items[pipe->consumed++ % IMPORT_PIPE_SLOTS];
+	pipe->bytes -= item->len;
+	pthread_cond_broadcast(&pipe->changed);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+
+static void import_item_release(struct import_item *item) {
+	free(item->data);
+	if (item->fd >= 0) close(item->fd);
+}
+
+
+/*
+ * Writes entry for inode at the end of directory of node dir, into the blocks 
+ * reserved for it when the tree was sized, and counts the new link.
+ */
+static int import_dir_put(struct ext2_fs *fs, struct import_node *dir, unsigned int inode, char *name, int file_type) {
+	int name_len = strlen(name);
+	struct ext2_dir_entry_2 *last = dir->dir_last;
+	struct ext2_dir_entry_2 *new;
+
+	if (last && last->rec_len - dir_entry_size(last->name_len) >= dir_entry_size(name_len)) {
+		// Case: room after the last entry
+		new = (struct ext2_dir_entry_2 *) (((unsigned char *) last) + dir_entry_size(last->name_len));
+		new->rec_len = last->rec_len - dir_entry_size(last->name_len);
+		last->rec_len = dir_entry_size(last->name_len);
+	}
+	else {
+		if (last) dir->dir_logical ++;
+		if (dir->dir_logical >= dir->dir_blocks) {
+			// Case: host directory grew since it was listed
+			int err = insert_entry(fs, dir->inode, inode, name_len, file_type, name);
+			if (!err) get_inode(fs, inode)->i_links_count ++;
+			return err;
+		}
+		/* takes over the empty entry spanning the reserved block */
+		new = (struct ext2_dir_entry_2 *) get_block(fs, inode_block(fs, dir->inode, dir->dir_logical));
+	}
+
+	new->inode = inode;
+	new->name_len = name_len;
+	new->file_type = file_type;
+	memcpy(new->name, name, name_len);
+	dir->dir_last = new;
+	get_inode(fs, inode)->i_links_count ++;
+	return 0;
+}
+
+
+/*
+ * Creates directory of node, with its blocks reserved and "." and ".." in place.
+ */
+static int import_mkdir(struct ext2_fs *fs, struct import_node *node, unsigned int parent_inode, struct block_run *run) {
+	struct block_map_cursor cursor;
+	unsigned int i, block_index;
+	int err = 0;
+
+	block_map_init(fs, &cursor, node->inode, 0, run);
+	for (i = 0; i < node->dir_blocks && !err; i++) {
+		if ((err = block_map_append_run(&cursor, &block_index))) break;
+		clear_block(fs, get_block(fs, block_index));
+		((struct ext2_dir_entry_2 *) get_block(fs, block_index))->rec_len = fs->block_size;
+	}
+	block_map_finish(&cursor);
+	get_inode(fs, node->inode)->i_size = i * fs->block_size;
+	if (err) return err;
+
+	fs->block_group[inode_group(fs, node->inode)].bg_used_dirs_count ++;
+	if ((err = import_dir_put(fs, node, node->inode, ".", EXT2_FT_DIR))) return err;
+	return import_dir_put(fs, node, parent_inode, "..", EXT2_FT_DIR);
+}
+
+
+/*
+ * Fills inode of node with the contents of host file or symbolic link.
+ */
+static int import_data(struct ext2_fs *fs, struct import_node *node, struct import_pipe *pipe, struct block_run *run) {
+	struct block_map_cursor cursor;
+	struct import_item item;
+	char *target;
+	int err = 0;
+
+	if (S_ISLNK(node->mode)) {
+		target = malloc(node->size + 1);
+		if (target == NULL) return ENOMEM;
+		ssize_t len = readlink(node->host_path, target, node->size + 1);
+		if (len < 0 || len > node->size) {
+			err = len < 0 ? errno : EAGAIN;
+		}
+		else {
+			target[len] = '\0';
+			err = init_symlink_inode(fs, node->inode, target);
+		}
+		free(target);
+		return err;
+	}
+
+	import_take(pipe, &item);
+	if (item.err) {
+		err = item.err;
+	}
+	else if (item.fd >= 0) {
+		// Case: large file, streamed by populate_inode
+		FILE *stream = fdopen(item.fd, "r");
+		if (stream == NULL) {
+			err = errno;
+		}
+		else {
+			item.fd = -1;
+			err = populate_inode(fs, node->inode, stream);
+			fclose(stream);
+		}
+	}
+	else {
+		block_map_init(fs, &cursor, node->inode, 0, run);
+		err = populate_from_memory(&cursor, item.data, item.len);
+		block_map_finish(&cursor);
+		if (!err) get_inode(fs, node->inode)->i_size = item.len;
+	}
+
+	import_item_release(&item);
+	return err;
+}
+
+
+/*
+ * Copies the nodes of tree into the image, parents first, the top node going
+ * into directory dir_inode.
+ */
+static int import_write(struct ext2_fs *fs, struct import_tree *tree, struct import_pipe *pipe, unsigned int dir_inode, unsigned int *inodes) {
+	struct block_run run = {0, 0, 0};
+	unsigned long long unwritten = 0;
+	unsigned int i;
+	int err = 0;
+
+	run.wanted = tree->blocks > 0xFFFFFFFFULL ? 0xFFFFFFFF : tree->blocks;
+
+	for (i = 0; i < tree->count && !err; i++) {
+		struct import_node *node = &tree->nodes[i];
+		struct ext2_inode *in = get_inode(fs, inodes[i]);
+		unsigned int parent_inode = node->parent < 0 ? dir_inode : tree->nodes[node->parent].inode;
+		int file_type = S_ISDIR(node->mode) ? EXT2_FT_DIR : S_ISLNK(node->mode) ? EXT2_FT_SYMLINK : EXT2_FT_REG_FILE;
+
+		node->inode = inodes[i];
+		memset(in, 0, sizeof(struct ext2_inode));
+		in->i_mode = node->mode & 0xFFFF;
+		in->i_atime = in->i_ctime = in->i_mtime = node->mtime;
+
+		err = S_ISDIR(node->mode) ? import_mkdir(fs, node, parent_inode, &run) : import_data(fs, node, pipe, &run);
+
+		/* a journaled handle would otherwise hold the whole tree's data in memory */
+		if (!err && S_ISREG(node->mode) && (unwritten += node->size) >= IMPORT_WRITEBACK_BYTES) {
+			unwritten = 0;
+			err = journal_writeback(fs);
+		}
+
+		if (!err) {
+			/* the entry goes in last, so the image only ever names complete files */
+			if (node->parent < 0) {
+				err = add_entry(fs, dir_inode, node->inode, strlen(node->name), file_type, node->name);
+			}
+			else {
+				err = import_dir_put(fs, &tree->nodes[node->parent], node->inode, node->name, file_type);
+			}
+		}
+		if (err) {
+			if (S_ISDIR(node->mode) && node->dir_last) {
+				// Case: directory was counted, and linked from its parent if ".." is in
+				fs->block_group[inode_group(fs, node->inode)].bg_used_dirs_count --;
+				if (node->dir_last->name_len == 2) get_inode(fs, parent_inode)->i_links_count --;
+			}
+			free_inode(fs, node->inode);
+			node->inode = 0;
+			i++;
+		}
+	}
+	block_run_release(fs, &run);
+
+	/* inodes handed out for nodes never reached */
+	for (; i < tree->count; i++) {
+		inode_bitmap_unset(fs, inodes[i]);
+		if (inodes[i] < fs->inode_cursor) fs->inode_cursor = inodes[i];
+	}
+
+	/* directories that outgrew a block get an index, as add_entry would have given them */
+	for (i = 0; i < tree->count; i++) {
+		if (tree->nodes[i].inode && S_ISDIR(tree->nodes[i].mode) && get_inode(fs, tree->nodes[i].inode)->i_size > fs->block_size) {
+			dx_build(fs, tree->nodes[i].inode);
+		}
+	}
+	return err;
+}
+
+
+int import_tree(struct ext2_fs *fs, char *host_path, unsigned int dir_inode, char *name) {
+	struct import_tree tree = {fs, NULL, 0, 0, 0};
+	struct import_pipe pipe;
+	struct stat st;
+	unsigned int *inodes = NULL;
+	pthread_t reader;
+	int err = fs_writable(fs);
+	unsigned int i;
+
+	if (err) return err;
+	if (lstat(host_path, &st)) return errno;
+
+	/* list the whole tree first, so its size is known before anything is written */
+	char *top_path = copy_str(host_path);
+	if (top_path == NULL) return ENOMEM;
+	if ((err = import_add_node(&tree, top_path, name, &st, -1))) {
+		free(top_path);
+		return err;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		err = import_scan(&tree, 0);
+	}
+	else {
+		tree.blocks = import_blocks(fs, st.st_size);
+	}
+
+	if (!err && (tree.count > fs->super_block->s_free_inodes_count || tree.blocks > fs->super_block->s_free_blocks_count)) {
+		err = ENOSPC;
+	}
+	if (!err && (inodes = malloc(tree.count * sizeof(unsigned int))) == NULL) err = ENOMEM;
+
+	if (!err) {
+		int deferred = fs->counters_deferred;
+		defer_counters(fs);
+
+		/* the tree goes where a directory or file made under dir_inode would */
+		unsigned int group = S_ISDIR(tree.nodes[0].mode) ? find_group_dir(fs, dir_inode) : find_group_file(fs, dir_inode);
+		unsigned int allocated = allocate_inodes(fs, group, tree.count, inodes);
+		if (allocated < tree.count) {
+			// Case: counts were off, give back what was taken
+			for (i = 0; i < allocated; i++) inode_bitmap_unset(fs, inodes[i]);
+			if (allocated) fs->inode_cursor = inodes[0];
+			err = ENOSPC;
+		}
+		else {
+			memset(&pipe, 0, sizeof(pipe));
+			pthread_mutex_init(&pipe.lock, NULL);
+			pthread_cond_init(&pipe.changed, NULL);
+			pipe.tree = &tree;
+			int reading = (pthread_create(&reader, NULL, import_reader, &pipe) == 0);
+			if (!reading) {
+				for (i = 0; i < allocated; i++) inode_bitmap_unset(fs, inodes[i]);
+				fs->inode_cursor = inodes[0];
+				err = EAGAIN;
+			}
+			else {
+				err = import_write(fs, &tree, &pipe, dir_inode, inodes);
+
+				pthread_mutex_lock(&pipe.lock);
+				pipe.stop = 1;
+				pthread_cond_broadcast(&pipe.changed);
+				pthread_mutex_unlock(&pipe.lock);
+				pthread_join(reader, NULL);
+				for (; pipe.consumed < pipe.produced; pipe.consumed++) {
+					import_item_release(&pipe.items[pipe.consumed % IMPORT_PIPE_SLOTS]);
+				}
+			}
+			pthread_cond_destroy(&pipe.changed);
+			pthread_mutex_destroy(&pipe.lock);
+		}
+		if (!deferred) sync_counters(fs);
+	}
+
+	for (i = 0; i < tree.count; i++) free(tree.nodes[i].host_path);
+	free(tree.nodes);
+	free(inodes);
+	return err;
+}
+
+
+
+
+/* TREE EXPORT */
+
+struct export_state {
+	char *root;            /* image path being exported */
+	size_t root_len;
+	char *host_path;
+	pthread_mutex_t links_lock;
+	char **links;          /* host path already written for each inode, by inode index */
+};
+
+
+/*
+ * Copies data of inode into open host file, one pwrite per physically 
+ * contiguous run of blocks. Holes are left to the final ftruncate.
+ */
+static int export_data(struct ext2_fs *fs, unsigned int inode_index, int fd) {
+	struct next_slot_state state;
+	struct ptr_with_err result;
+	size_t size = get_inode(fs, inode_index)->i_size;
+	unsigned int first = 0, count = 0;
+	unsigned long long next = 0;
+	off_t offset = 0;
+	int more = 1;
+
+	initialize_state(fs, &state, inode_index);
+	while (more) {
+		unsigned int block_index = 0;
+		result = next_slot(&state);
+		more = (result.ptr != NULL && result.err == NO_ERR && (unsigned long long) state.logical * fs->block_size < size);
+		if (more) block_index = *(unsigned int *) result.ptr;
+		if (more && count && block_index == first + count && state.logical == next) {
+			// Case: block continues the current run
+			count ++;
+			next ++;
+			continue;
+		}
+
+		if (count) {
+			size_t len = (size_t) count * fs->block_size;
+			if ((size_t) offset + len > size) len = size - offset;
+			const unsigned char *src = (unsigned char *) get_block(fs, first);
+			while (len > 0) {
+				ssize_t written = pwrite(fd, src, len, offset);
+				if (written < 0) {
+					if (errno == EINTR) continue;
+					return errno;
+				}
+				src += written;
+				offset += written;
+				len -= written;
+			}
+		}
+
+		first = block_index;
+		count = 1;
+		offset = (off_t) state.logical * fs->block_size;
+		next = state.logical + 1;
+	}
+	return ftruncate(fd, size) ? errno : 0;
+}
+
+
+static int export_visit(struct ext2_fs *fs, struct walk_entry *entry, void *arg) {
+	struct export_state *state = arg;
+	struct ext2_inode *in = entry->in;
+	char *suffix = entry->path + state->root_len;
+	int slash = (suffix[0] != '\0' && suffix[0] != '/');
+	int err = 0, fd;
+
+	char *host = malloc(strlen(state->host_path) + slash + strlen(suffix) + 1);
+	if (host == NULL) return ENOMEM;
+	sprintf(host, "%s%s%s", state->host_path, slash ? "/" : "", suffix);
+
+	switch (in->i_mode >> 12) {
+		case EXT2_INODE_FT_DIR:
+			/* owner keeps write access so the walk can fill the directory */
+			if (mkdir(host, (in->i_mode & 07777) | S_IRWXU)) err = errno;
+			break;
+
+		case EXT2_INODE_FT_SYMLINK: {
+			char *target = symlink_target(fs, entry->inode_index);
+			if (target == NULL) err = ENOMEM;
+			else if (symlink(target, host)) err = errno;
+			free(target);
+			break;
+		}
+
+		case EXT2_INODE_FT_REG_FILE:
+			if (in->i_links_count > 1) {
+				pthread_mutex_lock(&state->links_lock);
+				char *first = state->links[entry->inode_index];
+				if (first) {
+					// Case: another name of an inode already written, link to it
+					err = link(first, host) ? errno : 0;
+					pthread_mutex_unlock(&state->links_lock);
+					free(host);
+					return err;
+				}
+				/* created under the lock so later names can link to it right away */
+				fd = open(host, O_WRONLY | O_CREAT | O_EXCL, in->i_mode & 07777);
+				if (fd >= 0) state->links[entry->inode_index] = copy_str(host);
+				pthread_mutex_unlock(&state->links_lock);
+			}
+			else {
+				fd = open(host, O_WRONLY | O_CREAT | O_EXCL, in->i_mode & 07777);
+			}
+
+			if (fd < 0) {
+				err = errno;
+				break;
+			}
+			err = export_data(fs, entry->inode_index, fd);
+			if (close(fd) && !err) err = errno;
+			break;
+
+		default:
+			err = EOPNOTSUPP;
+	}
+
+	if (!err && !S_ISDIR(in->i_mode)) {
+		struct timespec times[2] = {{in->i_atime, 0}, {in->i_mtime, 0}};
+		utimensat(AT_FDCWD, host, times, AT_SYMLINK_NOFOLLOW);
+	}
+	free(host);
+	return err;
+}
+
+
+int export_tree(struct ext2_fs *fs, char *path, char *host_path, unsigned int threads) {
+	struct export_state state;
+	unsigned int i;
+	int err;
+
+	state.root = path;
+	state.root_len = strlen(path);
+	state.host_path = host_path;
+	state.links = calloc(fs->inodes_count + 1, sizeof(char *));
+	if (state.links == NULL) return ENOMEM;
+	pthread_mutex_init(&state.links_lock, NULL);
+
+	err = walk_tree(fs, path, threads, export_visit, &state);
+
+	for (i = 0; i <= fs->inodes_count; i++) free(state.links[i]);
+	free(state.links);
+	pthread_mutex_destroy(&state.links_lock);
+	return err;
+}
+
+
+
+
+/* CONSISTENCY CHECK */
+
+#define FSCK_BAD_MAP 1  /* inode flag: block map points outside the image */
+#define FSCK_NO_DTIME 2 /* inode flag: unused inode with no deletion time */
+#define FSCK_NO_MODE 4  /* inode flag: inode marked in use, but cleared */
+#define FSCK_DTIME 8    /* inode flag: inode in use with a deletion time */
+
+/*
+ * Problem found in a directory block: an entry naming an inode that is not in 
+ * use, or (corrupt set) a record length breaking the chain of entries.
+ */
+struct fsck_entry {
+	unsigned int dir, block, offset;
+	unsigned int prev; /* offset of the entry before, fs->block_size if none */
+	int corrupt;
+};
+
+struct fsck_state {
+	struct ext2_fs *fs;
+	int repair;
+	unsigned int found, left;
+
+	unsigned int *claims;  /* owners found per block */
+	unsigned int *refs;    /* directory entries found per inode */
+	unsigned int *blocks;  /* blocks mapped per inode, indirect ones included */
+	unsigned char *flags;  /* FSCK_ flags per inode */
+
+	pthread_mutex_t lock;  /* guards the lists and err */
+	unsigned int *dirs;
+	unsigned int dirs_count, dirs_capacity;
+	struct fsck_entry *entries;
+	unsigned int entries_count, entries_capacity;
+	int err;
+
+	unsigned int next;     /* next group (inode scan) or directory (entry scan) to take */
+};
+
+
+/*
+ * Prints a problem, noting whether it was fixed, and counts it.
+ */
+static void fsck_report(struct fsck_state *state, int fixed, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	printf(fixed ? ", fixed\n" : "\n");
+	state->found ++;
+	if (!fixed) state->left ++;
+}
+
+
+static void fsck_claim(struct fsck_state *state, unsigned int block_index, unsigned int count) {
+	for (; count > 0; count--, block_index++) {
+		if (block_index < state->fs->blocks_count) state->claims[block_index] ++;
+	}
+}
+
+
+/*
+ * Returns 1 if group holds a copy of the superblock and group descriptors.
+ */
+static int fsck_group_has_super(struct ext2_fs *fs, unsigned int group) {
+	unsigned int base, power;
+	if (group <= 1 || !(fs->super_block->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)) return 1;
+
+	/* with sparse superblocks only powers of 3, 5 and 7 keep one */
+	for (base = 3; base <= 7; base += 2) {
+		for (power = base; power < group; power *= base);
+		if (power == group) return 1;
+	}
+	return 0;
+}
+
+
+static void fsck_claim_metadata(struct fsck_state *state) {
+	struct ext2_fs *fs = state->fs;
+	unsigned int gdt_blocks = align_to_nearest(fs->block_size, fs->groups_count * sizeof(struct ext2_group_desc)) / fs->block_size;
+	unsigned int table_blocks = align_to_nearest(fs->block_size, fs->inodes_per_group * fs->inode_size) / fs->block_size;
+	unsigned int g;
+
+	if (fs->super_block->s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INO) gdt_blocks += fs->super_block->s_reserved_gdt_blocks;
+	for (g = 0; g < fs->groups_count; g++) {
+		if (fsck_group_has_super(fs, g)) fsck_claim(state, fs->first_data_block + g * fs->blocks_per_group, 1 + gdt_blocks);
+		fsck_claim(state, fs->block_group[g].bg_block_bitmap, 1);
+		fsck_claim(state, fs->block_group[g].bg_inode_bitmap, 1);
+		fsck_claim(state, fs->block_group[g].bg_inode_table, table_blocks);
+	}
+}
+
+
+/*
+ * Walks the tree under slot, depth levels of indirection deep, returning the
+ * blocks in it. Scanning claims them and flags pointers outside the image;
+ * reporting prints those pointers instead, clearing them when repairing.
+ */
+static unsigned int fsck_tree(struct fsck_state *state, unsigned int inode_index, unsigned int *slot, unsigned int depth, int report) {
+	struct ext2_fs *fs = state->fs;
+	unsigned int count = 1, i;
+
+	if (*slot == 0) return 0;
+	if (*slot < fs->first_data_block || *slot >= fs->blocks_count) {
+		// Case: nothing under this pointer can be read
+		if (!report) state->flags[inode_index] |= FSCK_BAD_MAP;
+		else {
+			unsigned int block_index = *slot;
+			if (state->repair) *slot = 0;
+			fsck_report(state, state->repair, "inode %u: block %u is outside the image", inode_index, block_index);
+		}
+		return 0;
+	}
+
+	if (!report) __atomic_add_fetch(&state->claims[*slot], 1, __ATOMIC_RELAXED);
+	if (depth) {
+		for (i = 0; i < fs->addr_per_block; i++) {
+			count += fsck_tree(state, inode_index, get_block(fs, *slot)->addr + i, depth - 1, report);
+		}
+	}
+	return count;
+}
+
+
+static void fsck_inode(struct fsck_state *state, unsigned int inode_index, int report) {
+	struct ext2_fs *fs = state->fs;
+	struct ext2_inode *in = get_inode(fs, inode_index);
+	unsigned int i, count = 0;
+
+	if (inode_fast_symlink(fs, inode_index)) return;
+	if (inode_index == EXT2_RESIZE_INO) {
+		// Case: the blocks it maps are the reserved descriptors, claimed with the group metadata
+		fsck_tree(state, inode_index, &in->i_block[EXT2_DIND_BLOCK], 0, report);
+		return;
+	}
+
+	for (i = 0; i < EXT2_N_BLOCKS; i++) {
+		count += fsck_tree(state, inode_index, &in->i_block[i], i < EXT2_NDIR_BLOCKS ? 0 : i - EXT2_NDIR_BLOCKS + 1, report);
+	}
+	if (!report) state->blocks[inode_index] = count;
+}
+
+
+static int fsck_list_add(struct fsck_state *state, void **list, unsigned int *count, unsigned int *capacity, size_t size, void *item) {
+	int err = 0;
+
+	pthread_mutex_lock(&state->lock);
+	if (*count == *capacity) {
+		unsigned int grown = *capacity ? *capacity * 2 : 64;
+		void *items = realloc(*list, grown * size);
+		if (items == NULL) err = state->err = ENOMEM;
+		else {
+			*list = items;
+			*capacity = grown;
+		}
+	}
+	if (!err) memcpy((unsigned char *) *list + (size_t) (*count)++ * size, item, size);
+	pthread_mutex_unlock(&state->lock);
+	return err;
+}
+
+
+static void *fsck_scan_inodes(void *arg) {
+	struct fsck_state *state = arg;
+	struct ext2_fs *fs = state->fs;
+	unsigned int g, i;
+
+	/* groups are taken one at a time, so a thread done early takes more of them */
+	while ((g = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED)) < fs->groups_count && !state->err) {
+		unsigned char *bitmap = group_inode_bitmap(fs, g);
+
+		for (i = 0; i < fs->inodes_per_group; i++) {
+			unsigned int inode_index = g * fs->inodes_per_group + i + 1;
+			struct ext2_inode *in = get_inode(fs, inode_index);
+
+			if (!check_bit(bitmap, 0, i)) {
+				if (in->i_mode && !in->i_links_count && !in->i_dtime) state->flags[inode_index] |= FSCK_NO_DTIME;
+				continue;
+			}
+			if (!in->i_mode && (inode_index == EXT2_ROOT_INO || inode_index >= EXT2_GOOD_OLD_FIRST_INO)) {
+				state->flags[inode_index] |= FSCK_NO_MODE;
+				continue;
+			}
+			if (in->i_dtime) state->flags[inode_index] |= FSCK_DTIME;
+			fsck_inode(state, inode_index, 0);
+			if ((in->i_mode >> 12) == EXT2_INODE_FT_DIR) {
+				fsck_list_add(state, (void **) &state->dirs, &state->dirs_count, &state->dirs_capacity, sizeof(unsigned int), &inode_index);
+			}
+		}
+	}
+	return NULL;
+}
+
+
+static int fsck_inode_used(struct fsck_state *state, unsigned int inode_index) {
+	struct ext2_fs *fs = state->fs;
+	if (inode_index == 0 || inode_index > fs->inodes_count) return 0;
+	if (state->flags[inode_index] & FSCK_NO_MODE) return 0;
+	return check_bit(group_inode_bitmap(fs, inode_group(fs, inode_index)), 0, (inode_index - 1) % fs->inodes_per_group);
+}
+
+
+/*
+ * Returns 1 if the entry at offset fits the block and names an inode, whatever
+ * its record length says.
+ */
+static int fsck_entry_whole(struct ext2_fs *fs, unsigned int offset, struct ext2_dir_entry_2 *cur) {
+	if (offset + 8 > fs->block_size || !cur->inode || !cur->name_len) return 0;
+	return offset + dir_entry_size(cur->name_len) <= fs->block_size;
+}
+
+
+static void fsck_dir_block(struct fsck_state *state, unsigned int dir_inode, unsigned int block_index) {
+	struct ext2_fs *fs = state->fs;
+	unsigned char *data = (unsigned char *) get_block(fs, block_index);
+	unsigned int offset = 0, prev = fs->block_size;
+
+	while (offset < fs->block_size) {
+		struct ext2_dir_entry_2 *cur = (struct ext2_dir_entry_2 *) (data + offset);
+		struct fsck_entry entry = {dir_inode, block_index, offset, prev, 0};
+
+		if (offset + 8 > fs->block_size || cur->rec_len < 8 || cur->rec_len % 4 || offset + cur->rec_len > fs->block_size 
+			|| (cur->inode && dir_entry_size(cur->name_len) > cur->rec_len)) {
+			// Case: the rest of the block cannot be followed, an entry still whole is kept by the repair
+			entry.corrupt = 1;
+			if (fsck_entry_whole(fs, offset, cur) && fsck_inode_used(state, cur->inode)) {
+				__atomic_add_fetch(&state->refs[cur->inode], 1, __ATOMIC_RELAXED);
+			}
+			fsck_list_add(state, (void **) &state->entries, &state->entries_count, &state->entries_capacity, sizeof(struct fsck_entry), &entry);
+			return;
+		}
+		if (cur->inode && !fsck_inode_used(state, cur->inode)) {
+			fsck_list_add(state, (void **) &state->entries, &state->entries_count, &state->entries_capacity, sizeof(struct fsck_entry), &entry);
+		}
+		else if (cur->inode) {
+			__atomic_add_fetch(&state->refs[cur->inode], 1, __ATOMIC_RELAXED);
+		}
+		prev = offset;
+		offset += cur->rec_len;
+	}
+}
+
+
+static void *fsck_scan_dirs(void *arg) {
+	struct fsck_state *state = arg;
+	struct next_slot_state slots;
+	struct ptr_with_err result;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED)) < state->dirs_count && !state->err) {
+		unsigned int dir_inode = state->dirs[i];
+		// Case: block map left broken, its blocks cannot be read
+		if (state->flags[dir_inode] & FSCK_BAD_MAP) continue;
+
+		initialize_state(state->fs, &slots, dir_inode);
+		while ((result = next_slot(&slots)).ptr != NULL && result.err == NO_ERR) {
+			fsck_dir_block(state, dir_inode, *((unsigned int *) result.ptr));
+		}
+	}
+	return NULL;
+}
+
+
+static void fsck_run(struct fsck_state *state, void *(*scan)(void *), unsigned int threads) {
+	pthread_t tids[FSCK_MAX_THREADS];
+	unsigned int t, started;
+
+	if (threads > FSCK_MAX_THREADS) threads = FSCK_MAX_THREADS;
+	state->next = 0;
+
+	/* the calling thread scans too */
+	for (t = 1; t < threads; t++) {
+		if (pthread_create(&tids[t], NULL, scan, state)) break;
+	}
+	started = t;
+	scan(state);
+	for (t = 1; t < started; t++) pthread_join(tids[t], NULL);
+}
+
+
+static int fsck_entry_compare(const void *a, const void *b) {
+	const struct fsck_entry *x = a, *y = b;
+	if (x->dir != y->dir) return x->dir < y->dir ? -1 : 1;
+	if (x->block != y->block) return x->block < y->block ? -1 : 1;
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+
+static void fsck_fix_entries(struct fsck_state *state) {
+	struct ext2_fs *fs = state->fs;
+	unsigned int i;
+
+	qsort(state->entries, state->entries_count, sizeof(struct fsck_entry), fsck_entry_compare);
+	for (i = 0; i < state->entries_count; i++) {
+		struct fsck_entry *e = &state->entries[i];
+		unsigned char *data = (unsigned char *) get_block(fs, e->block);
+		struct ext2_dir_entry_2 *cur = (struct ext2_dir_entry_2 *) (data + e->offset);
+
+		if (e->corrupt) {
+			// Case: the entry itself, else the one before, takes the rest of the block, else it is emptied
+			if (state->repair && fsck_entry_whole(fs, e->offset, cur)) {
+				cur->rec_len = fs->block_size - e->offset;
+			}
+			else if (state->repair && e->prev < fs->block_size) {
+				((struct ext2_dir_entry_2 *) (data + e->prev))->rec_len = fs->block_size - e->prev;
+			}
+			else if (state->repair) {
+				cur->inode = 0;
+				cur->rec_len = fs->block_size;
+			}
+			fsck_report(state, state->repair, "directory %u: block %u is corrupt from offset %u", e->dir, e->block, e->offset);
+			continue;
+		}
+
+		unsigned int inode_index = cur->inode;
+		if (state->repair) cur->inode = 0;
+		fsck_report(state, state->repair, "directory %u: entry %.*s names inode %u, which is not in use", e->dir, cur->name_len, cur->name, inode_index);
+	}
+}
+
+
+static void fsck_check_blocks(struct fsck_state *state) {
+	struct ext2_fs *fs = state->fs;
+	unsigned int i, inode_index;
+
+	for (inode_index = 1; inode_index <= fs->inodes_count; inode_index++) {
+		struct ext2_inode *in = get_inode(fs, inode_index);
+		unsigned char flags = state->flags[inode_index];
+
+		if (flags & FSCK_BAD_MAP) {
+			fsck_inode(state, inode_index, 1);
+			if (state->repair) state->flags[inode_index] &= ~FSCK_BAD_MAP;
+		}
+		if (flags & FSCK_NO_MODE) {
+			if (state->repair) inode_bitmap_unset(fs, inode_index);
+			fsck_report(state, state->repair, "inode %u is marked in use, but has no mode", inode_index);
+		}
+		if (flags & FSCK_NO_DTIME) {
+			if (state->repair) in->i_dtime = time(NULL);
+			fsck_report(state, state->repair, "inode %u: deleted, but its deletion time is 0", inode_index);
+		}
+		if (flags & FSCK_DTIME) {
+			if (state->repair) in->i_dtime = 0;
+			fsck_report(state, state->repair, "inode %u is in use, but has a deletion time", inode_index);
+		}
+	}
+
+	/* i_blocks counts 512 byte sectors, data and indirect blocks alike */
+	for (i = 0; i < fs->groups_count; i++) {
+		unsigned char *bitmap = group_inode_bitmap(fs, i);
+		unsigned int n = find_set_bit(bitmap, fs->inodes_per_group, 0);
+
+		for (; n < fs->inodes_per_group; n = find_set_bit(bitmap, fs->inodes_per_group, n + 1)) {
+			inode_index = i * fs->inodes_per_group + n + 1;
+			struct ext2_inode *in = get_inode(fs, inode_index);
+			unsigned int sectors = state->blocks[inode_index] * (fs->block_size / 512);
+
+			if (inode_index == EXT2_RESIZE_INO || (state->flags[inode_index] & (FSCK_BAD_MAP | FSCK_NO_MODE)) || in->i_blocks == sectors) continue;
+			unsigned int was = in->i_blocks;
+			if (state->repair) in->i_blocks = sectors;
+			fsck_report(state, state->repair, "inode %u: i_blocks is %u, should be %u", inode_index, was, sectors);
+		}
+	}
+}
+
+
+static void fsck_check_bitmaps(struct fsck_state *state) {
+	struct ext2_fs *fs = state->fs;
+	unsigned char used[EXT2_MAX_BLOCK_SIZE];
+	unsigned int g, i, end, b;
+
+	for (g = 0; g < fs->groups_count; g++) {
+		unsigned int first = fs->first_data_block + g * fs->blocks_per_group;
+		unsigned int nbits = group_blocks_count(fs, g);
+		unsigned char *bitmap = group_block_bitmap(fs, g);
+
+		/* blocks found owned, laid out as the group's bitmap */
+		memset(used, 0, sizeof(used));
+		for (i = 0; i < nbits; i++) {
+			if (state->claims[first + i]) used[i >> 3] |= 1 << (i % 8);
+		}
+
+		/* differences are reported a run of the same kind at a time */
+		for (i = find_diff_bit(used, bitmap, nbits, 0); i < nbits; i = find_diff_bit(used, bitmap, nbits, end)) {
+			int owned = check_bit(used, 0, i);
+			for (end = i + 1; end < nbits && check_bit(used, 0, end) == owned && check_bit(bitmap, 0, end) != owned; end++);
+
+			if (state->repair) {
+				for (b = first + i; b < first + end; b++) {
+					if (owned) block_bitmap_set(fs, b);
+					else block_bitmap_unset(fs, b);
+				}
+			}
+			if (end - i == 1) {
+				fsck_report(state, state->repair, owned ? "block %u is in use, but marked free" : "block %u is marked in use, but nothing owns it", first + i);
+			}
+			else {
+				fsck_report(state, state->repair, owned ? "blocks %u-%u are in use, but marked free" : "blocks %u-%u are marked in use, but nothing owns them", 
+					first + i, first + end - 1);
+			}
+		}
+	}
+}
+
+
+/*
+ * Maps an empty directory block at logical index of directory, filling a hole.
+ */
+static int fsck_fill_hole(struct ext2_fs *fs, unsigned int dir_inode, unsigned int logical) {
+	struct block_map_cursor cursor;
+	int err;
+
+	unsigned int block_index = allocate_block_near(fs, inode_goal(fs, dir_inode));
+	if (block_index == 0) return ENOSPC;
+	((struct ext2_dir_entry_2 *) get_block(fs, block_index))->rec_len = fs->block_size;
+
+	block_map_init(fs, &cursor, dir_inode, logical, NULL);
+	if ((err = block_map_append(&cursor, block_index))) free_block(fs, block_index);
+	block_map_finish(&cursor);
+	return err;
+}
+
+
+/*
+ * Directories are read a block at a time up to i_size, so every block below the
+ * last one must be mapped and i_size must end with it. Runs once the bitmaps are
+ * repaired, as filling a hole allocates a block.
+ */
+static void fsck_check_dir_maps(struct fsck_state *state) {
+	struct ext2_fs *fs = state->fs;
+	struct next_slot_state slots;
+	struct ptr_with_err result;
+	unsigned int i, k;
+
+	for (i = 0; i < state->dirs_count; i++) {
+		unsigned int dir_inode = state->dirs[i];
+		struct ext2_inode *in = get_inode(fs, dir_inode);
+		unsigned int end = 0, was;
+
+		if (state->flags[dir_inode] & FSCK_BAD_MAP) continue;
+		initialize_state(fs, &slots, dir_inode);
+		while ((result = next_slot(&slots)).ptr != NULL && result.err == NO_ERR) {
+			end = slots.logical + 1;
+		}
+
+		for (k = 0; k + 1 < end; k++) {
+			if (inode_block(fs, dir_inode, k)) continue;
+			int fixed = state->repair && !fsck_fill_hole(fs, dir_inode, k);
+			fsck_report(state, fixed, "directory %u: block %u is not mapped", dir_inode, k);
+		}
+		if ((was = in->i_size) != end * fs->block_size) {
+			if (state->repair) in->i_size = end * fs->block_size;
+			fsck_report(state, state->repair, "directory %u: i_size is %u, should be %u", dir_inode, was, end * fs->block_size);
+		}
+	}
+}
+
+
+static void fsck_check_refcounts(struct fsck_state *state) {
+	struct ext2_fs *fs = state->fs;
+	unsigned int b, end;
+
+	if (get_inode(fs, EXT2_REFCOUNT_INO)->i_generation != EXT2_REFCOUNT_MAGIC) {
+		// Case: no clones, a block with several owners is claimed by mistake
+		for (b = fs->first_data_block; b < fs->blocks_count; b = end) {
+			for (end = b; end < fs->blocks_count && state->claims[end] > 1; end++);
+			if (end == b) {
+				end ++;
+				continue;
+			}
+			fsck_report(state, 0, "blocks %u-%u are each claimed by more than one inode", b, end - 1);
+		}
+		return;
+	}
+
+	/* every owner past the first is counted in the table */
+	for (b = fs->first_data_block; b < fs->blocks_count; b = end) {
+		unsigned short *refs = refcount_slot(fs, b, 0);
+		unsigned int want = state->claims[b] > 1 ? state->claims[b] - 1 : 0;
+		if (want > 0xFFFF) want = 0xFFFF;
+		end = b + 1;
+		if (refs == NULL || *refs == want) continue;
+
+		if (want == 0) {
+			// Case: counts left on blocks that lost their other owners (e2fsck -y copies shared blocks), which would leak them on delete
+			for (; end < fs->blocks_count && state->claims[end] <= 1; end++) {
+				unsigned short *next = refcount_slot(fs, end, 0);
+				if (next == NULL || *next == 0) break;
+				if (state->repair) *next = 0;
+			}
+			if (state->repair) *refs = 0;
+			fsck_report(state, state->repair, "blocks %u-%u are no longer shared, but have other owners counted", b, end - 1);
+			continue;
+		}
+
+		unsigned int was = *refs;
+		if (state->repair) *refs = want;
+		fsck_report(state, state->repair, "block %u: %u other owners counted, should be %u", b, was, want);
+	}
+}
+
+
+static void fsck_check_links(struct fsck_state *state) {
+	struct ext2_fs *fs = state->fs;
+	struct ext2_dir_entry_2 *lost = dir_find(fs, EXT2_ROOT_INO, "lost+found");
+	unsigned int lost_found = (lost && has_file_type(fs, EXT2_INODE_FT_DIR, lost->inode)) ? lost->inode : 0;
+	unsigned int g, n;
+
+	for (g = 0; g < fs->groups_count; g++) {
+		unsigned char *bitmap = group_inode_bitmap(fs, g);
+
+		for (n = find_set_bit(bitmap, fs->inodes_per_group, 0); n < fs->inodes_per_group; n = find_set_bit(bitmap, fs->inodes_per_group, n + 1)) {
+			unsigned int inode_index = g * fs->inodes_per_group + n + 1;
+			struct ext2_inode *in = get_inode(fs, inode_index);
+			unsigned int refs = state->refs[inode_index], links = in->i_links_count;
+
+			if (inode_index != EXT2_ROOT_INO && inode_index < EXT2_GOOD_OLD_FIRST_INO) continue;
+			if (state->flags[inode_index] & FSCK_NO_MODE) continue;
+			if (refs == 0) {
+				// Case: nothing names it, a file is given a name in lost+found
+				int fixed = 0;
+				if (state->repair && lost_found && (in->i_mode >> 12) != EXT2_INODE_FT_DIR) {
+					char name[16];
+					int file_type = (in->i_mode >> 12) == EXT2_INODE_FT_SYMLINK ? EXT2_FT_SYMLINK : EXT2_FT_REG_FILE;
+					sprintf(name, "#%u", inode_index);
+					in->i_links_count = 0;
+					fixed = !add_entry(fs, lost_found, inode_index, strlen(name), file_type, name);
+					if (!fixed) in->i_links_count = links;
+				}
+				fsck_report(state, fixed, "inode %u is in use, but no directory entry names it", inode_index);
+			}
+			else if (refs != links) {
+				if (state->repair) in->i_links_count = refs;
+				fsck_report(state, state->repair, "inode %u: link count is %u, should be %u", inode_index, links, refs);
+			}
 		}
 	}
-
-	inode[inode_dest].i_blocks = inode[inode_src].i_blocks;
-	inode[inode_dest].i_mode = inode[inode_src].i_mode;
-	inode[inode_dest].i_size = inode[inode_src].i_size;
-	inode[inode_dest].i_links_count = inode[inode_src].i_links_count;
 }
 
 
-/* DIRECTORY OPERATIONS */
+static void fsck_check_counters(struct fsck_state *state) {
+	struct ext2_fs *fs = state->fs;
+	unsigned int free_blocks = 0, free_inodes = 0, g, i, was;
 
-unsigned int align_to_nearest(unsigned int alignment, unsigned int value){
-	return (value % alignment) ? (value + alignment - (value % alignment)): value;
-}
+	unsigned int *dirs = calloc(fs->groups_count, sizeof(unsigned int));
+	if (dirs == NULL) {
+		state->err = ENOMEM;
+		return;
+	}
+	for (i = 0; i < state->dirs_count; i++) {
+		dirs[inode_group(fs, state->dirs[i])] ++;
+	}
 
-unsigned int dir_entry_size(unsigned int name_len){
-	return align_to_nearest(4, sizeof(struct ext2_dir_entry_2) + name_len);
-}
+	for (g = 0; g < fs->groups_count; g++) {
+		struct ext2_group_desc *desc = &fs->block_group[g];
+		unsigned int blocks = count_zero_bits(group_block_bitmap(fs, g), group_blocks_count(fs, g));
+		unsigned int inodes = count_zero_bits(group_inode_bitmap(fs, g), group_inodes_count(fs, g));
+		free_blocks += blocks;
+		free_inodes += inodes;
 
+		if ((was = desc->bg_free_blocks_count) != blocks) {
+			if (state->repair) desc->bg_free_blocks_count = blocks;
+			fsck_report(state, state->repair, "group %u: free blocks count is %u, should be %u", g, was, blocks);
+		}
+		if ((was = desc->bg_free_inodes_count) != inodes) {
+			if (state->repair) desc->bg_free_inodes_count = inodes;
+			fsck_report(state, state->repair, "group %u: free inodes count is %u, should be %u", g, was, inodes);
+		}
+		if ((was = desc->bg_used_dirs_count) != dirs[g]) {
+			if (state->repair) desc->bg_used_dirs_count = dirs[g];
+			fsck_report(state, state->repair, "group %u: directories count is %u, should be %u", g, was, dirs[g]);
+		}
+	}
+	free(dirs);
 
-int dir_entry_full(struct ext2_dir_entry_2 *de, int required_space){
-	return (de->rec_len - dir_entry_size(de->name_len) < required_space)? 1 : 0;
+	if ((was = fs->super_block->s_free_blocks_count) != free_blocks) {
+		if (state->repair) fs->super_block->s_free_blocks_count = free_blocks;
+		fsck_report(state, state->repair, "superblock: free blocks count is %u, should be %u", was, free_blocks);
+	}
+	if ((was = fs->super_block->s_free_inodes_count) != free_inodes) {
+		if (state->repair) fs->super_block->s_free_inodes_count = free_inodes;
+		fsck_report(state, state->repair, "superblock: free inodes count is %u, should be %u", was, free_inodes);
+	}
 }
 
 
-int dir_entry_next(struct ext2_dir_entry_2 **cur, int *remaining) {
-	if (*remaining - (*cur)->rec_len > 0) {
-		*remaining = *remaining - (*cur)->rec_len;
-		*cur = (struct ext2_dir_entry_2 *) (((unsigned char *)(*cur)) + (*cur)->rec_len);
-		return 1; 
-	} 
-	else 
-		return 0;
+int check_fs(struct ext2_fs *fs, int repair, unsigned int threads, unsigned int *found, unsigned int *left) {
+	struct fsck_state state;
+	int err = 0;
+
+	if (repair && (err = fs_writable(fs))) return err;
+	memset(&state, 0, sizeof(state));
+	state.fs = fs;
+	state.repair = repair;
+	pthread_mutex_init(&state.lock, NULL);
+	state.claims = calloc(fs->blocks_count, sizeof(unsigned int));
+	state.refs = calloc(fs->inodes_count + 1, sizeof(unsigned int));
+	state.blocks = calloc(fs->inodes_count + 1, sizeof(unsigned int));
+	state.flags = calloc(fs->inodes_count + 1, 1);
+
+	if (state.claims && state.refs && state.blocks && state.flags) {
+		/* block maps, claiming every block they reach */
+		fsck_claim_metadata(&state);
+		fsck_run(&state, fsck_scan_inodes, threads);
+		if (!state.err) fsck_check_blocks(&state);
+
+		/* directory entries, counting the names of every inode */
+		if (!state.err) fsck_run(&state, fsck_scan_dirs, threads);
+		if (!state.err) fsck_fix_entries(&state);
+
+		/* bitmaps are settled before lost+found may need a block */
+		if (!state.err) fsck_check_bitmaps(&state);
+		if (!state.err) fsck_check_dir_maps(&state);
+		if (!state.err) fsck_check_refcounts(&state);
+		if (!state.err) fsck_check_links(&state);
+		if (!state.err) fsck_check_counters(&state);
+		err = state.err;
+	}
+	else {
+		err = ENOMEM;
+	}
+
+	if (found) *found += state.found;
+	if (left) *left += state.left;
+	free(state.claims);
+	free(state.refs);
+	free(state.blocks);
+	free(state.flags);
+	free(state.dirs);
+	free(state.entries);
+	pthread_mutex_destroy(&state.lock);
+	return err;
 }
 
 
-struct ext2_dir_entry_2 *dir_find(unsigned int dir_inode, char *filename) {
-	struct next_slot_state state;
-	struct ptr_with_err result;
-	initialize_state(&state, dir_inode);
 
-	/* cycle through all blocks */
-	while (1) {
-		result = next_slot(&state);
 
-		if (result.ptr != NULL && result.err == NO_ERR) {
-			struct ext2_dir_entry_2 *cur = (struct ext2_dir_entry_2 *) &block[*((unsigned int *) result.ptr)];
-			int remaining = EXT2_BLOCK_SIZE;
+/* COMMANDS */
 
-			/* cycle through all directory entries in block */
-			do {
-				if ((strlen(filename) == cur->name_len) && !strncmp(filename, cur->name, cur->name_len)) {
-					return cur;
-				}
-			}
-			while (dir_entry_next(&cur, &remaining));
-		} 
-		else break;
+/*
+ * Resolves the directory holding the last component of path. Sets dir_inode to it,
+ * name to the last component and buf to the allocation backing name, which the 
+ * caller frees.
+ */
+static int resolve_parent(struct ext2_fs *fs, char *path, unsigned int *dir_inode, char **buf, char **name) {
+	int err;
+
+	if ((*buf = path_split(path, name)) == NULL) return ENOMEM;
+	if (**name == '\0') {
+		// Case: path names the root, which has no parent entry
+		err = EEXIST;
+	}
+	else if (strlen(*name) > EXT2_NAME_LEN) {
+		err = ENAMETOOLONG;
+	}
+	else {
+		err = inode_from_path(fs, *buf, dir_inode);
 	}
 
-	return NULL;
+	if (err) {
+		free(*buf);
+		*buf = NULL;
+	}
+	return err;
 }
 
 
-void add_entry(unsigned int dir_inode, unsigned int new_inode, int name_len, int file_type, char *filename){ 
-	inode[new_inode].i_links_count ++;
+int cmd_ls(struct ext2_fs *fs, char *path) {
+	unsigned int inode_index;
+	int err = inode_from_path(fs, path, &inode_index);
+	if (err) return err;
 
-	struct ext2_dir_entry_2 *new;
-	struct next_slot_state state;
-	struct ptr_with_err result;
-	initialize_state(&state, dir_inode);
+	if (!has_file_type(fs, EXT2_INODE_FT_DIR, inode_index)) return ENOTDIR;
+	print_dir(fs, inode_index);
+	return 0;
+}
 
-	int required_space = dir_entry_size(strlen(filename));
 
-	/* cycle through all blocks */
-	while (1) {
-		result = next_slot(&state);
-		if (result.ptr != NULL && result.err == NO_ERR) {
-			struct ext2_dir_entry_2 *cur = (struct ext2_dir_entry_2 *) &block[*((unsigned int *) result.ptr)];
-			int remaining = EXT2_BLOCK_SIZE;
+int cmd_cat(struct ext2_fs *fs, char *path) {
+	unsigned int inode_index;
+	int err = inode_from_path(fs, path, &inode_index);
+	if (err) return err;
 
-			/* cycle through all directory entries in block */
-			do {
-				if (!dir_entry_full(cur, required_space)) {
-					new = (struct ext2_dir_entry_2 *)(((unsigned char *) cur) + dir_entry_size(cur->name_len));
+	if (has_file_type(fs, EXT2_INODE_FT_DIR, inode_index)) return EISDIR;
+	return print_file(fs, inode_index);
+}
 
-					new->rec_len = cur->rec_len - dir_entry_size(cur->name_len);
-					cur->rec_len = dir_entry_size(cur->name_len);
 
-					new->inode = new_inode;
-					new->name_len = name_len;
-					new->file_type = file_type;
-					strncpy(new->name, filename, strlen(filename));
-					return;
-				}
-			}
-			while (dir_entry_next(&cur, &remaining));
-		} 
-		else break;
-	}
+int cmd_cp(struct ext2_fs *fs, char *host_path, char *path) {
+	unsigned int inode_dir;
+	char *buf, *filename;
+	int err;
 
-	// Case: no associated block can accomodate new entry
-	int new_block = allocate_block();
-	inode_add_block(dir_inode, new_block);
-	inode[dir_inode].i_size += EXT2_BLOCK_SIZE;
-	new =  (struct ext2_dir_entry_2 *) (&block[new_block]);
-	new->rec_len = EXT2_BLOCK_SIZE;
-	new->inode = new_inode;
-	new->name_len = name_len;
-	new->file_type = file_type;
-	strncpy(new->name, filename, strlen(filename));
-}
+	FILE *data_stream = fopen(host_path, "r");
+	if (data_stream == NULL) return errno;
 
+	if ((err = resolve_parent(fs, path, &inode_dir, &buf, &filename))) {
+		fclose(data_stream);
+		return err;
+	}
 
-void delete_entry(unsigned int dir_inode, char *filename){
-	struct ext2_dir_entry_2 *dbe = dir_find(dir_inode, filename);
-	if (dbe) {
-		unsigned int dbe_inode = dbe->inode;
-		unsigned int dir_block = (((unsigned char *) dbe) - disk) / EXT2_BLOCK_SIZE;
-		struct ext2_dir_entry_2 *cur = (struct ext2_dir_entry_2 *) &block[dir_block];
-		struct ext2_dir_entry_2 *last_dbe;
-		int remaining = EXT2_BLOCK_SIZE;
-		int rest;
-		do {
-			if (cur == dbe) {
-				rest = remaining;
-			}
-			else {
-				last_dbe = cur;
-			}
+	if (dir_find(fs, inode_dir, filename)) {
+		// Case: directory entry with file name already exists
+		err = EEXIST;
+	}
+	else {
+		/* allocate inode for new file and populate it with data from file */
+		unsigned int new_inode_index = allocate_inode_near(fs, inode_dir, 0);
+		if (new_inode_index == 0) {
+			err = ENOSPC;
 		}
-		while (dir_entry_next(&cur, &remaining));
-
-		if (last_dbe){
-			last_dbe->rec_len += dbe->rec_len;
-			/* move the rest of the directory entries back */
-			memmove((void *)dbe, (void *) (((unsigned char *) dbe) + dbe->rec_len), rest - dbe->rec_len);
-		} 
 		else {
-			inode_remove_block(dir_inode, dir_block);
-			inode[dir_inode].i_size -= EXT2_BLOCK_SIZE;
-			free_block(dir_block);
-		}
+			err = populate_inode(fs, new_inode_index, data_stream);
+			get_inode(fs, new_inode_index)->i_mode |= 8 << 12;
 
-		inode[dbe_inode].i_links_count --;
-		if (inode[dbe_inode].i_links_count == 0) {
-			free_inode(dbe_inode);
+			/* add new inode to destination directory */
+			if (err || (err = add_entry(fs, inode_dir, new_inode_index, strlen(filename), EXT2_FT_REG_FILE, filename))) {
+				free_inode(fs, new_inode_index);
+			}
 		}
 	}
-}
 
+	fclose(data_stream);
+	free(buf);
+	return err;
+}
 
-void init_dir_inode(unsigned int new_dir_inode, unsigned int parent_dir_inode, char *dir_filename){
-	/* add . and .. directory entries for new directory */
-	add_entry(new_dir_inode, new_dir_inode, strlen("."), EXT2_FT_DIR, ".");
-	add_entry(new_dir_inode, parent_dir_inode, strlen(".."), EXT2_FT_DIR, "..");
-
-	/* update metadata */
-	inode[new_dir_inode].i_mode = inode[parent_dir_inode].i_mode;
-	block_group->bg_used_dirs_count ++;
 
-	/* add directory entry for new directory in parent directory */
-	add_entry(parent_dir_inode, new_dir_inode, strlen(dir_filename), EXT2_FT_DIR, dir_filename);
-}
+int cmd_cp_tree(struct ext2_fs *fs, char *host_path, char *path) {
+	unsigned int inode_dir;
+	char *buf, *filename;
+	int err;
 
+	if ((err = resolve_parent(fs, path, &inode_dir, &buf, &filename))) return err;
 
-void print_dir(unsigned int dir_inode) {
-	struct next_slot_state state;
-	struct ptr_with_err result;
-	initialize_state(&state, dir_inode);
+	if (dir_find(fs, inode_dir, filename)) {
+		// Case: directory entry with file name already exists
+		err = EEXIST;
+	}
+	else {
+		err = import_tree(fs, host_path, inode_dir, filename);
+	}
 
-	/* cycle through all blocks */
-	while (1) {
-		result = next_slot(&state);
-		if (result.ptr != NULL && result.err == NO_ERR) {
-			struct ext2_dir_entry_2 *cur = (struct ext2_dir_entry_2 *) &block[*((unsigned int *) result.ptr)];
-			int remaining = EXT2_BLOCK_SIZE;
+	free(buf);
+	return err;
+}
 
-			/* cycle through all directory entries in block */
-			do {
-				printf("%.*s\n", cur->name_len, cur->name);
-			}
-			while (dir_entry_next(&cur, &remaining));
 
-		} 
-		else break;
-	}
+int cmd_extract(struct ext2_fs *fs, char *path, char *host_path) {
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	return export_tree(fs, path, host_path, threads > 0 ? threads : 1);
 }
 
 
+int cmd_mkdir(struct ext2_fs *fs, char *path) {
+	unsigned int inode_dir;
+	char *buf, *filename;
+	int err;
 
+	if ((err = resolve_parent(fs, path, &inode_dir, &buf, &filename))) return err;
 
-/* INODE OPERATIONS */
+	if (dir_find(fs, inode_dir, filename)) {
+		// Case: filename already exists
+		err = EEXIST;
+	}
+	else {
+		/* allocate inode for new directory, initialize it and add it to parent directory */
+		unsigned int new_inode = allocate_inode_near(fs, inode_dir, 1);
+		err = new_inode ? init_dir_inode(fs, new_inode, inode_dir, filename) : ENOSPC;
+	}
 
-void initialize_state_i(struct next_slot_state_i *state, unsigned int *start_slot_ptr, unsigned int indirection) {
-	int i;
-	for (i = 0; i < 4; i++) 
-		state->index[i] = 0;
-	state->start_slot_ptr = start_slot_ptr;
-	state->indirection = indirection;
+	free(buf);
+	return err;
 }
 
 
-void initialize_state(struct next_slot_state *state, unsigned int inode_index) {
-	state->in = &inode[inode_index];
-	state->block_index = 0;
-	initialize_state_i(&(state->indirection_state), state->in->i_block + state->block_index, 0);
-}
+int cmd_rm(struct ext2_fs *fs, char *path) {
+	unsigned int inode_dir;
+	char *buf, *filename;
+	int err;
 
+	if ((err = resolve_parent(fs, path, &inode_dir, &buf, &filename))) return err;
 
-struct ptr_with_err next_slot_i(struct next_slot_state_i *state) {
-	unsigned int *index = state->index;
-	unsigned int indirection = state->indirection;
-	unsigned int *start_slot_ptr = state->start_slot_ptr;
-	struct ptr_with_err result;
-	int i;
+	struct ext2_dir_entry_2 *de = dir_find(fs, inode_dir, filename);
+	if (de == NULL) {
+		err = ENOENT;
+	}
+	else if (has_file_type(fs, EXT2_INODE_FT_DIR, de->inode)) {
+		err = EISDIR;
+	}
+	else {
+		/* remove directory entry associated with file */
+		err = delete_entry(fs, inode_dir, filename);
+	}
 
-	if (!index[0]) {
-		unsigned int *slot = start_slot_ptr;
-		for (i = 1; i <= indirection; i++) {
+	free(buf);
+	return err;
+}
 
-			if (*slot == 0) {
-				// Case: Error. Indirection block missing.
-				result.ptr = slot;
-				result.err = INDIRECTION_BLOCK_MISSING;
-				return result;
-			}
 
-			/* move down one level of indirection */
-			slot = block[*slot].addr + index[i];
-		}
+int cmd_ln(struct ext2_fs *fs, char *target, char *path, int symbolic) {
+	unsigned int inode_dir, inode_target = 0, inode_existing;
+	char *buf, *filename;
+	int file_type = EXT2_FT_SYMLINK;
+	int err;
 
-		if (*slot == 0) {
-			// Case: Error. Data block missing.
-			result.ptr = slot;
-			result.err = DATA_BLOCK_MISSING;
-			return result;
+	if (!symbolic) {
+		/* get entry of file being linked to in its parent directory */
+		if ((err = resolve_parent(fs, target, &inode_dir, &buf, &filename))) return err;
+		struct ext2_dir_entry_2 *de = dir_find(fs, inode_dir, filename);
+		if (de) {
+			inode_target = de->inode;
+			file_type = de->file_type;
 		}
+		free(buf);
 
+		if (de == NULL) return ENOENT;
+		if (has_file_type(fs, EXT2_INODE_FT_DIR, inode_target)) return EISDIR;
+	}
 
-		// Case: No error. Data block found. Advance for next time.
-		result.ptr = slot;
-		result.err = NO_ERR;
+	/* get inode index of directory where link is being created */
+	if ((err = resolve_parent(fs, path, &inode_dir, &buf, &filename))) return err;
 
-		// Advance indices by one so that next call to next_block_i
-		// returns the next slot.
-		int add = 1;
-		for (i = indirection; i >= 0; i--) {
-			if (index[i] + add < EXT2_ADDR_PER_BLOCK) {
-				index[i] = index[i] + add;
-				add = 0;
-			} else {
-				index[i] = 0;
-			}
+	if (dir_find(fs, inode_dir, filename)) {
+		// Case: directory already contains entry by the same name
+		err = (inode_from_path(fs, path, &inode_existing) == 0 && has_file_type(fs, EXT2_INODE_FT_DIR, inode_existing)) ? EISDIR : EEXIST;
+	}
+	else if (symbolic) {
+		/* store target path in a new symlink inode */
+		unsigned int new_inode_index = allocate_inode_near(fs, inode_dir, 0);
+		if (new_inode_index == 0) {
+			err = ENOSPC;
+		}
+		else if ((err = init_symlink_inode(fs, new_inode_index, target)) || (err = add_entry(fs, inode_dir, new_inode_index, strlen(filename), EXT2_FT_SYMLINK, filename))) {
+			free_inode(fs, new_inode_index);
 		}
-
-		return result;
+	}
+	else {
+		/* add directory entry for hardlink */
+		err = add_entry(fs, inode_dir, inode_target, strlen(filename), file_type, filename);
 	}
 
-	// Case: No error. Data blocks at indirection level exhausted.
-	result.ptr = NULL;
-	result.err = NO_ERR;
-	return result;
+	free(buf);
+	return err;
 }
 
 
-struct ptr_with_err next_slot(struct next_slot_state *state) {
-	struct ptr_with_err result;
+/*
+ * Returns 1 if directory dir is ancestor or lies below it, following .. up to the root.
+ */
+static int dir_within(struct ext2_fs *fs, unsigned int dir, unsigned int ancestor) {
+	unsigned int steps;
 
-	int indirection = state->block_index >= 11 ? (state->block_index - 11) : 0;
+	/* a damaged chain of .. cannot loop forever */
+	for (steps = 0; steps < fs->inodes_count; steps++) {
+		if (dir == ancestor) return 1;
+		if (dir == EXT2_ROOT_INO) return 0;
+		struct ext2_dir_entry_2 *de = dir_find(fs, dir, "..");
+		if (de == NULL) return 0;
+		dir = de->inode;
+	}
+	return 0;
+}
 
-	/* cycle through the i_block pointers */
-	while (state->block_index < 15) {
-		struct ptr_with_err result = next_slot_i(&(state->indirection_state));
 
-		if (result.err != NO_ERR) return result;
+int cmd_mv(struct ext2_fs *fs, char *src, char *dest) {
+	unsigned int inode_src, inode_dest;
+	char *buf_src, *filename_src, *buf_dest, *filename_dest;
+	int err;
 
-		if (result.ptr == NULL) {
-			state->block_index ++;
-			indirection = state->block_index > 11 ? (state->block_index - 11) : 0;
-			initialize_state_i(&(state->indirection_state), state->in->i_block + state->block_index, indirection);
-		} 
-		else {
-			return result;
+	/* get inodes of parent directories of src and dest */
+	if ((err = resolve_parent(fs, src, &inode_src, &buf_src, &filename_src))) return err;
+	if ((err = resolve_parent(fs, dest, &inode_dest, &buf_dest, &filename_dest))) {
+		free(buf_src);
+		return err;
+	}
+
+	struct ext2_dir_entry_2 *de_src = dir_find(fs, inode_src, filename_src);
+	if (de_src == NULL) {
+		err = ENOENT;
+	}
+	else if (dir_find(fs, inode_dest, filename_dest)) {
+		err = EEXIST;
+	}
+	else if (has_file_type(fs, EXT2_INODE_FT_DIR, de_src->inode) && dir_within(fs, inode_dest, de_src->inode)) {
+		// Case: directory would become its own ancestor
+		err = EINVAL;
+	}
+	else {
+		/* adding to dest may move entries of src around when both are the same directory */
+		unsigned int moved_inode = de_src->inode;
+		err = add_entry(fs, inode_dest, moved_inode, strlen(filename_dest), de_src->file_type, filename_dest);
+		if (!err) {
+			struct ext2_dir_entry_2 *dotdot = has_file_type(fs, EXT2_INODE_FT_DIR, moved_inode) ? dir_find(fs, moved_inode, "..") : NULL;
+			if (dotdot) {
+				/* .. now links the new parent instead of the old one */
+				dotdot->inode = inode_dest;
+				get_inode(fs, inode_src)->i_links_count --;
+				get_inode(fs, inode_dest)->i_links_count ++;
+				dentry_cache_clear(fs);
+			}
+			err = delete_entry(fs, inode_src, filename_src);
 		}
 	}
 
-	return result;
+	free(buf_src);
+	free(buf_dest);
+	return err;
 }
 
 
-unsigned int *inode_free_slot(int inode_index) {
-	struct ptr_with_err result;
-	struct next_slot_state state;
-	initialize_state(&state, inode_index); 
-
-	while (1) {
-		result = next_slot(&state);
+int cmd_cp2(struct ext2_fs *fs, char *src, char *dest, int clone) {
+	unsigned int inode_src, inode_dir;
+	char *buf, *filename;
+	int err;
 
-		if (result.ptr == NULL) break;
+	/* get inode of src file, and of directory where copy is being created */
+	if ((err = inode_from_path(fs, src, &inode_src))) return err;
+	if ((err = resolve_parent(fs, dest, &inode_dir, &buf, &filename))) return err;
 
-		if (result.err == DATA_BLOCK_MISSING) {
-			return (unsigned int *) result.ptr;
+	if (dir_find(fs, inode_dir, filename)) {
+		// Case: destination dir already contains destination filename in dir entry
+		err = EEXIST;
+	}
+	else if (has_file_type(fs, EXT2_INODE_FT_DIR, inode_src)) {
+		// Case: file being copied is a directory
+		err = EISDIR;
+	}
+	else {
+		/* allocate inode for copy, add its directory entry and copy data */
+		unsigned int inode_dest = allocate_inode_near(fs, inode_dir, 0);
+		if (inode_dest == 0) {
+			err = ENOSPC;
 		}
-
-		if (result.err == INDIRECTION_BLOCK_MISSING) {
-			*((unsigned int *)(result.ptr)) = allocate_block();
+		else if ((err = add_entry(fs, inode_dir, inode_dest, strlen(filename), EXT2_FT_REG_FILE, filename))) {
+			free_inode(fs, inode_dest);
+		}
+		else if ((err = clone ? clone_inode(fs, inode_src, inode_dest) : copy_inode(fs, inode_src, inode_dest))) {
+			delete_entry(fs, inode_dir, filename);
 		}
 	}
 
-	fprintf(stderr, "inode at full capacity");
-	exit(ENOMEM);
+	free(buf);
+	return err;
 }
 
 
-void inode_add_block(int inode_index, int block_index) {
-	*inode_free_slot(inode_index) = block_index;
-}
-
-
-void inode_remove_block(int inode_index, int block_index) {
-	struct ptr_with_err result;
+/*
+ * Collects the inodes of the directories reached by walk_tree into a growing array.
+ */
+struct compact_dirs {
+	pthread_mutex_t lock;
+	unsigned int *inodes;
+	unsigned int count, capacity;
+};
 
-	unsigned int *last_data_slot = NULL;
-	unsigned int *target_data_slot = NULL;
 
-	struct next_slot_state state;
-	initialize_state(&state, inode_index); 
+static int compact_visit(struct ext2_fs *fs, struct walk_entry *entry, void *arg) {
+	struct compact_dirs *dirs = arg;
+	int err = 0;
 
-	while (1) {
-		result = next_slot(&state);
-		if (result.ptr == NULL || result.err) break;
-		if ( *((unsigned int *)result.ptr) == block_index) {
-			target_data_slot = (unsigned int *) result.ptr;
-		} else {
-			last_data_slot = (unsigned int *) result.ptr;
-		}
-	}
+	if ((entry->in->i_mode >> 12) != EXT2_INODE_FT_DIR) return 0;
+	// Case: lost+found keeps its preallocated blocks for fsck to reconnect into
+	if (entry->inode_index == EXT2_GOOD_OLD_FIRST_INO) return 0;
 
-	if (target_data_slot) {
-		if (last_data_slot) {
-			*target_data_slot = *last_data_slot;
-			*last_data_slot = 0;
-		} 
+	pthread_mutex_lock(&dirs->lock);
+	if (dirs->count == dirs->capacity) {
+		unsigned int capacity = dirs->capacity ? dirs->capacity * 2 : 64;
+		unsigned int *inodes = realloc(dirs->inodes, capacity * sizeof(unsigned int));
+		if (inodes == NULL) err = ENOMEM;
 		else {
-			*target_data_slot = 0;
+			dirs->inodes = inodes;
+			dirs->capacity = capacity;
 		}
 	}
+	if (!err) dirs->inodes[dirs->count++] = entry->inode_index;
+	pthread_mutex_unlock(&dirs->lock);
+	return err;
 }
 
-void populate_inode(unsigned int inode_index, FILE *stream) {
-	struct ext2_block read_block;
-	clear_block(&read_block);
 
-	int bytes, total_bytes = 0;
-	while ((bytes = fread(&read_block, 1, EXT2_BLOCK_SIZE, stream)) > 0){
-		total_bytes += bytes;
-		/* allocate a block for new data */
-		unsigned int block_index = allocate_block();
-		/* copy data to new block */
-		copy_block(&read_block, &block[block_index]);
-		/* add block to inode */
-		inode_add_block(inode_index, block_index);
+int cmd_dircompact(struct ext2_fs *fs, char *path, int recursive, unsigned int *freed) {
+	struct compact_dirs dirs = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+	unsigned int inode_dir, i;
+	int err;
 
-		clear_block(&read_block);
+	if ((err = fs_writable(fs))) return err;
+	if (!recursive) {
+		if ((err = inode_from_path(fs, path, &inode_dir))) return err;
+		return dir_compact(fs, inode_dir, freed);
 	}
 
-	/* update fields for new inode */
-	inode[inode_index].i_size = total_bytes;
+	/* the directories are listed first, the walk must not see them change */
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	err = walk_tree(fs, path, threads > 0 ? threads : 1, compact_visit, &dirs);
+	if (!err && dirs.count == 0) err = ENOTDIR;
+	for (i = 0; i < dirs.count && !err; i++) {
+		err = dir_compact(fs, dirs.inodes[i], freed);
+	}
+	free(dirs.inodes);
+	return err;
 }
 
-int has_file_type(int filetype, unsigned int inode_index){
-	return ((inode[inode_index].i_mode >> 12) == filetype)? 1 : 0;
-}
 
+/*
+ * Collects the fragmented files reached by walk_tree, with their paths.
+ */
+struct defrag_file {
+	struct inode_frag frag;
+	char *path;
+};
 
-/* PATH OPERATIONS */
+struct defrag_scan {
+	pthread_mutex_t lock;
+	struct defrag_file *files;
+	unsigned int count, capacity;
+};
 
-char *extract_parent_path(char *path) {
-	char *copy;
-	copy = copy_str(path);
-	int index = extract_filename_unsafe(copy) - copy;
-	free(copy);
-	copy = copy_str(path);
-	copy[index] = '\0';
-	return copy;
-}
 
+static int defrag_visit(struct ext2_fs *fs, struct walk_entry *entry, void *arg) {
+	struct defrag_scan *scan = arg;
+	struct inode_frag frag;
+	int err = 0;
 
-char *extract_filename_unsafe(char *path) {
-	char *token, *token_new;
-	token = strtok(path, "/");
-	while ((token_new = strtok(NULL, "/"))) {
-		token = token_new;
+	if (inode_fragmentation(fs, entry->inode_index, &frag) <= 1) return 0;
+
+	char *path = copy_str(entry->path);
+	if (path == NULL) return ENOMEM;
+	pthread_mutex_lock(&scan->lock);
+	if (scan->count == scan->capacity) {
+		unsigned int capacity = scan->capacity ? scan->capacity * 2 : 64;
+		struct defrag_file *files = realloc(scan->files, capacity * sizeof(struct defrag_file));
+		if (files == NULL) err = ENOMEM;
+		else {
+			scan->files = files;
+			scan->capacity = capacity;
+		}
 	}
-	return token;
+	if (!err) {
+		scan->files[scan->count].frag = frag;
+		scan->files[scan->count++].path = path;
+	}
+	pthread_mutex_unlock(&scan->lock);
+	if (err) free(path);
+	return err;
 }
 
 
-char *extract_filename(char *path) {
-	path = copy_str(path);
-	return extract_filename_unsafe(path);
+static int defrag_by_inode(const void *a, const void *b) {
+	unsigned int x = ((const struct defrag_file *) a)->frag.inode_index;
+	unsigned int y = ((const struct defrag_file *) b)->frag.inode_index;
+	return (x > y) - (x < y);
 }
 
 
-unsigned int inode_from_path(char *path){
-	char *token;
-	char *saveptr = NULL;
+/*
+ * Orders the most fragmented files first, and of those the largest.
+ */
+static int defrag_by_priority(const void *a, const void *b) {
+	const struct inode_frag *x = &((const struct defrag_file *) a)->frag;
+	const struct inode_frag *y = &((const struct defrag_file *) b)->frag;
+	if (x->extents != y->extents) return x->extents < y->extents ? 1 : -1;
+	if (x->blocks != y->blocks) return x->blocks < y->blocks ? 1 : -1;
+	return (x->inode_index > y->inode_index) - (x->inode_index < y->inode_index);
+}
 
-	path = copy_str(path);
 
-	token = strtok_r(path, "/", &saveptr);
-	unsigned int inode_index = EXT2_ROOT_INO;
+int cmd_defrag(struct ext2_fs *fs, char *path, int apply) {
+	struct defrag_scan scan = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+	unsigned long long moved = 0;
+	unsigned int i, n = 0;
+	int err;
 
-	do {
-		// Check if directory
-		if (token && strcmp(token, "") && inode_index != 0 && has_file_type(EXT2_INODE_FT_DIR, inode_index)) {
-			struct ext2_dir_entry_2 *de = dir_find(inode_index, token);
-			if (de == NULL) {
-				inode_index = 0;
-				break;
-			} 
-			inode_index =  de->inode;  
-			if (has_file_type(EXT2_INODE_FT_SYMLINK, inode_index)) {
-				inode_index = inode_from_symlink(inode_index);
-			}
+	if (apply && (err = fs_writable(fs))) return err;
+
+	/* files are measured first, the walk must not see them move */
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	err = walk_tree(fs, path, threads > 0 ? threads : 1, defrag_visit, &scan);
+
+	/* a file with several links is reached once per link, keep the first */
+	qsort(scan.files, scan.count, sizeof(struct defrag_file), defrag_by_inode);
+	for (i = 0; i < scan.count; i++) {
+		if (n && scan.files[n - 1].frag.inode_index == scan.files[i].frag.inode_index) free(scan.files[i].path);
+		else scan.files[n++] = scan.files[i];
+	}
+	qsort(scan.files, n, sizeof(struct defrag_file), defrag_by_priority);
+
+	for (i = 0; i < n && !err; i++) {
+		struct defrag_file *file = &scan.files[i];
+		struct inode_frag after;
+		int result;
+
+		if (!apply) {
+			printf("%s: %u blocks in %u extents\n", file->path, file->frag.blocks, file->frag.extents);
+			continue;
 		}
-		else {
-			if (inode_index == 0 || !has_file_type(EXT2_INODE_FT_DIR, inode_index)) inode_index = 0;
-			break;
+
+		result = defrag_inode(fs, file->frag.inode_index);
+		if (result == EBUSY || result == ENOSPC) {
+			// Case: file cannot move, the rest still may
+			printf("%s: %u blocks in %u extents, skipped (%s)\n", file->path, file->frag.blocks, file->frag.extents, 
+				result == EBUSY ? "shares blocks with a clone" : "no free run long enough");
+			continue;
+		}
+		if ((err = result)) break;
+		printf("%s: %u blocks in %u extents, now %u\n", file->path, file->frag.blocks, file->frag.extents, 
+			inode_fragmentation(fs, file->frag.inode_index, &after));
+
+		/* bound the memory held by moved data in a journaled handle */
+		if ((moved += (unsigned long long) file->frag.blocks * fs->block_size) >= DEFRAG_WRITEBACK_BYTES) {
+			moved = 0;
+			err = journal_writeback(fs);
 		}
 	}
-	while ((token = strtok_r(NULL, "/", &saveptr)));
 
-	if (inode_index == 0) {
-		fprintf(stderr, "No such file or directory\n");
-		exit(ENOENT);
+	for (i = 0; i < n; i++) {
+		free(scan.files[i].path);
 	}
-
-	free(path);
-	return inode_index;
+	free(scan.files);
+	return err;
 }
 
-unsigned int inode_from_symlink(unsigned int sym_inode_index){
-	char *sym_path = malloc(inode[sym_inode_index].i_size);
-	char *read_ptr = sym_path;
-
-	struct next_slot_state state;
-	struct ptr_with_err result;
-	initialize_state(&state, sym_inode_index);
 
-	int remaining = inode[sym_inode_index].i_size;
+int run_command(struct ext2_fs *fs, int argc, char **argv) {
+	if (argc == 0) return 0;
+
+	if (!strcmp(argv[0], "ls") && argc == 2) return cmd_ls(fs, argv[1]);
+	if (!strcmp(argv[0], "cat") && argc == 2) return cmd_cat(fs, argv[1]);
+	if (!strcmp(argv[0], "cp") && argc == 3) return cmd_cp(fs, argv[1], argv[2]);
+	if (!strcmp(argv[0], "cp") && argc == 4 && !strcmp(argv[1], "-r")) return cmd_cp_tree(fs, argv[2], argv[3]);
+	if (!strcmp(argv[0], "mkdir") && argc == 2) return cmd_mkdir(fs, argv[1]);
+	if (!strcmp(argv[0], "rm") && argc == 2) return cmd_rm(fs, argv[1]);
+	if (!strcmp(argv[0], "ln") && argc == 3) return cmd_ln(fs, argv[1], argv[2], 0);
+	if (!strcmp(argv[0], "ln") && argc == 4 && !strcmp(argv[1], "-s")) return cmd_ln(fs, argv[2], argv[3], 1);
+	if (!strcmp(argv[0], "mv") && argc == 3) return cmd_mv(fs, argv[1], argv[2]);
+	if (!strcmp(argv[0], "cp2") && argc == 3) return cmd_cp2(fs, argv[1], argv[2], 0);
+	if (!strcmp(argv[0], "cp2") && argc == 4 && !strcmp(argv[1], "-c")) return cmd_cp2(fs, argv[2], argv[3], 1);
+	if (!strcmp(argv[0], "extract") && argc == 3) return cmd_extract(fs, argv[1], argv[2]);
+	if (!strcmp(argv[0], "dircompact") && argc == 2) return cmd_dircompact(fs, argv[1], 0, NULL);
+	if (!strcmp(argv[0], "dircompact") && argc == 3 && !strcmp(argv[1], "-r")) return cmd_dircompact(fs, argv[2], 1, NULL);
+	if (!strcmp(argv[0], "defrag") && argc == 2) return cmd_defrag(fs, argv[1], 1);
+	if (!strcmp(argv[0], "defrag") && argc == 3 && !strcmp(argv[1], "-n")) return cmd_defrag(fs, argv[2], 0);
+	if (!strcmp(argv[0], "sync") && argc == 1) return ext2_commit(fs);
+
+	// Case: unknown command or wrong number of arguments
+	return EINVAL;
+}
 
-	/* cycle through all blocks */
-	while (1) {
-		result = next_slot(&state);
-		if (result.ptr != NULL && result.err == NO_ERR) {
-			int read_count = remaining < EXT2_BLOCK_SIZE ? remaining : EXT2_BLOCK_SIZE;
-			sprintf(read_ptr, "%.*s", read_count, (char *) &block[* (unsigned int *) result.ptr]);
-			read_ptr += read_count;
-			remaining -= read_count;
-		} 
-		else break;
-	}
 
-	unsigned int inode_index = inode_from_path(sym_path);
-	free(sym_path);
-	return inode_index;
-}
 
 
 /* DEBUG */
@@ -706,27 +6101,16 @@ void print_state(struct next_slot_state state) {
 }
 
 
-void print_block(struct ext2_block *blk){
+void print_block(struct ext2_fs *fs, struct ext2_block *blk){
 	char *b =  (char *) blk;
 	int i;
-	for (i = 0; i < EXT2_BLOCK_SIZE; i++) {
+	for (i = 0; i < fs->block_size; i++) {
 		printf("%c", b[i]);
 	}
 }
 
 
-void print_file(unsigned int inode_index){
-	struct ptr_with_err result;
-	struct next_slot_state state;
-	initialize_state(&state, inode_index); 
-	while (1) {
-		result = next_slot(&state);
-		if (result.ptr != NULL && result.err == NO_ERR) {
-			print_block(&block[* (unsigned int *)result.ptr]);
-		}
-		else {
-			printf("\n");
-			break;
-		}
-	}
+int print_file(struct ext2_fs *fs, unsigned int inode_index){
+	fflush(stdout);
+	return write_file(fs, inode_index, STDOUT_FILENO);
 }
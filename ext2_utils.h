@@ -1,17 +1,79 @@
+#include <stdio.h>
 #include "ext2.h"
 
-unsigned char *disk;
-unsigned char *INODE_BITMAP_START; /* pointer to start of inodes bitmap */
-unsigned char *BLOCK_BITMAP_START; /* pointer to start of blocks bitmap */
+#define EXT2_FIRST_ALLOC_INO (EXT2_GOOD_OLD_FIRST_INO + 1) /* first inode handed out, after lost+found */
 
-unsigned int inodes_count;
-unsigned int blocks_count;
+#define EXT2_FS_RDONLY 1  /* ext2_open flag: map the image read only */
+#define EXT2_FS_JOURNAL 2 /* ext2_open flag: hold changes in memory until ext2_commit journals them */
 
-struct ext2_super_block *super_block;
-struct ext2_group_desc *block_group;
+#define EXT2_REFCOUNT_INO EXT2_BOOT_LOADER_INO /* reserved inode holding the shared block reference counts */
+#define EXT2_REFCOUNT_MAGIC 0x52454643         /* i_generation of that inode once it holds them */
 
-struct ext2_inode *inode; /* pointer to "inode" 0. n_th inode at inode[n] */
-struct ext2_block *block; /* pointer to "block" 0. n_th block at block[n] */
+/*
+ * Name lookup cache, chained hash table of struct dentry (private to ext2_utils.c).
+ */
+struct dentry_table {
+	struct dentry **buckets;
+	unsigned int size; /* power of two, 0 until first insert */
+	unsigned int count;
+};
+
+/*
+ * Free extents of a bitmap (blocks or inodes) in a treap ordered by start and 
+ * annotated with the longest extent below each node, so finding, taking and 
+ * returning space and asking for the longest run are O(log n). Extents never
+ * cross a boundary base + k * span, as runs never cross block groups.
+ */
+struct extent_node;
+
+struct extent_tree {
+	struct extent_node *root;
+	struct extent_node *spare; /* nodes kept for reuse */
+	unsigned int base, span;
+	unsigned int seed;         /* priorities */
+	int stale;                 /* an update failed for lack of memory */
+};
+
+
+/*
+ * Open image. Every operation takes the handle of the image it works on, so 
+ * several images can be open at once, each used by one thread at a time.
+ */
+struct ext2_fs {
+	int flags;
+
+	unsigned char *disk;
+	size_t disk_size;
+
+	unsigned int inodes_count;
+	unsigned int blocks_count;
+
+	unsigned int groups_count;
+	unsigned int inodes_per_group;
+	unsigned int blocks_per_group;
+	unsigned int first_data_block;
+	unsigned int inode_size;
+	unsigned int block_size;     /* 1024 << s_log_block_size */
+	unsigned int addr_per_block; /* block numbers in an indirect block */
+
+	struct ext2_super_block *super_block;
+	struct ext2_group_desc *block_group; /* group descriptor table. n_th group at block_group[n] */
+
+	unsigned int block_cursor; /* lowest block index that may be free */
+	unsigned int inode_cursor; /* lowest inode index that may be free */
+	int counters_deferred;     /* free counts left stale until sync_counters */
+
+	struct extent_tree free_blocks; /* free space index over the block bitmaps */
+	struct extent_tree free_inodes; /* and over the inode bitmaps */
+
+	int fd;             /* image, kept open while journaling, -1 otherwise */
+	int journal_fd;     /* sidecar journal, -1 until the first commit needs it */
+	char *journal_path;
+
+	struct dentry_table dentries; /* (parent, name) to child */
+	struct dentry_table paths;    /* full path to inode */
+	struct dentry_table links;    /* (symbolic link, directory reached from) to the inode its target resolves to */
+};
 
 
 
@@ -19,9 +81,115 @@ struct ext2_block *block; /* pointer to "block" 0. n_th block at block[n] */
 /* DISK INITIALIZATION */
 
 /*
- * Maps img file to memory and sets up global variables.
+ * Maps img file to memory and sets fsp to a new handle for it. The whole image 
+ * is mapped (sized from s_blocks_count and s_log_block_size) so data blocks are
+ * faulted in lazily, while the group descriptor table and bitmaps of every
+ * block group are prefetched up front. A journal left by an interrupted commit
+ * is replayed first. With EXT2_FS_RDONLY in flags the image is mapped read only
+ * and every modifying operation fails with EROFS; with EXT2_FS_JOURNAL it is 
+ * mapped privately and nothing reaches the file until ext2_commit. Returns 0 on
+ * success, or an errno value (EINVAL if the image is not a usable ext2 image,
+ * or has blocks larger than EXT2_MAX_BLOCK_SIZE) otherwise.
+ */
+int ext2_open(char *filename, int flags, struct ext2_fs **fsp);
+
+
+/*
+ * Commits a journaled handle, unmaps the image of fs and frees the handle. 
+ * Returns 0, or the errno value of the failed commit.
+ */
+int ext2_close(struct ext2_fs *fs);
+
+
+/*
+ * Returns pointer to the block at given index, fs->block_size bytes long.
+ */
+struct ext2_block *get_block(struct ext2_fs *fs, unsigned int block_index);
+
+
+/*
+ * Returns pointer to inode at given index, in whichever block group holds it.
+ */
+struct ext2_inode *get_inode(struct ext2_fs *fs, unsigned int inode_index);
+
+
+/*
+ * Returns block group containing inode at given index.
+ */
+unsigned int inode_group(struct ext2_fs *fs, unsigned int inode_index);
+
+
+/*
+ * Returns block group containing block at given index.
+ */
+unsigned int block_group_of(struct ext2_fs *fs, unsigned int block_index);
+
+
+/*
+ * Returns number of blocks / inodes tracked by the bitmaps of given group.
+ */
+unsigned int group_blocks_count(struct ext2_fs *fs, unsigned int group);
+unsigned int group_inodes_count(struct ext2_fs *fs, unsigned int group);
+
+
+/*
+ * Returns pointer to block / inode bitmap of given group.
+ */
+unsigned char *group_block_bitmap(struct ext2_fs *fs, unsigned int group);
+unsigned char *group_inode_bitmap(struct ext2_fs *fs, unsigned int group);
+
+
+
+
+/* JOURNAL */
+
+/*
+ * A handle opened with EXT2_FS_JOURNAL changes a private copy of the image. 
+ * ext2_commit finds the pages changed since the last commit, writes the blocks
+ * that were free in the image's own block bitmap straight to their place (no 
+ * committed metadata names them yet), and logs every other block to the sidecar
+ * file <image>.journal before writing it in place:
+ *
+ *     block 0          struct ext2_journal_header
+ *     blocks 1..t      block numbers, count of them
+ *     blocks t+1..     block contents, in the same order
+ *
+ * The checksum covers everything after the header, so a journal cut short by a
+ * crash is discarded on recovery, while a complete one is replayed.
+ */
+#define EXT2_JOURNAL_MAGIC 0x4C4A3245 /* "E2JL" */
+#define JOURNAL_PAGEMAP_BATCH 4096    /* pagemap entries read at once */
+
+struct ext2_journal_header {
+	unsigned int magic;
+	unsigned int count;           /* blocks logged */
+	unsigned long long checksum;
+};
+
+
+/*
+ * Replays the journal next to img file if it holds a complete transaction, and 
+ * removes it. Returns 0 (also when there is none), or an errno value.
  */
-void disk_initialization(char *filename);
+int journal_recover(char *filename);
+
+
+/*
+ * Writes back the changed blocks of fs that were free in the image as last 
+ * committed, releasing the memory of pages holding nothing else. Long operations
+ * call this to bound the memory held by uncommitted data; it does not commit.
+ * Returns 0 (also for a handle that is not journaled), or an errno value.
+ */
+int journal_writeback(struct ext2_fs *fs);
+
+
+/*
+ * Makes every change to fs so far durable as one atomic transaction: data of 
+ * newly allocated blocks is synced first, then the journal, then the metadata 
+ * in place. Any number of operations may be grouped into a commit. For a handle
+ * mapped shared this is an msync. Returns 0, or an errno value.
+ */
+int ext2_commit(struct ext2_fs *fs);
 
 
 
@@ -31,6 +199,82 @@ void disk_initialization(char *filename);
 void unset_bit(unsigned char *first, int start_index, int target_index);
 void set_bit(unsigned char *first, int start_index, int target_index);
 int check_bit(unsigned char *first, int start_index, int target_index);
+void set_bit_range(unsigned char *first, int start_index, int target_index, int count);
+void unset_bit_range(unsigned char *first, int start_index, int target_index, int count);
+
+
+/*
+ * Returns offset of first unset bit at or after offset start in bitmap of nbits
+ * bits, or -1 if there is none. Scans a 64 bit word at a time.
+ */
+int find_zero_bit(unsigned char *first, unsigned int nbits, unsigned int start);
+
+
+/*
+ * Returns number of clear bits among the first nbits bits of bitmap.
+ */
+unsigned int count_zero_bits(unsigned char *first, unsigned int nbits);
+
+
+/*
+ * Returns offset of first set bit at or after offset start in bitmap of nbits
+ * bits, or nbits if there is none.
+ */
+unsigned int find_set_bit(unsigned char *first, unsigned int nbits, unsigned int start);
+
+
+/*
+ * Returns offset of first bit at or after offset start where bitmaps a and b of
+ * nbits bits differ, or nbits if they agree. Compares a 64 bit word at a time.
+ */
+unsigned int find_diff_bit(unsigned char *a, unsigned char *b, unsigned int nbits, unsigned int start);
+
+
+
+
+/* FREE SPACE INDEX */
+
+/*
+ * Marks the range of len units at start free / in use in tree. A freed range 
+ * lies within one span and joins the extents it touches there.
+ */
+void extent_insert(struct extent_tree *tree, unsigned int start, unsigned int len);
+void extent_remove(struct extent_tree *tree, unsigned int start, unsigned int len);
+
+
+/*
+ * Finds the first free stretch of at least min units at or after goal, the part
+ * of an extent before goal left out. Sets start and len to it and returns 1, or 
+ * returns 0 if there is none.
+ */
+int extent_find(struct extent_tree *tree, unsigned int goal, unsigned int min, unsigned int *start, unsigned int *len);
+
+
+/*
+ * Returns length of the longest free extent of tree.
+ */
+unsigned int extent_longest(struct extent_tree *tree);
+
+
+/*
+ * Frees every node of tree.
+ */
+void extent_tree_clear(struct extent_tree *tree);
+
+
+/*
+ * Rebuilds the free block and inode indices of fs from its bitmaps. ext2_open 
+ * builds them for a writable handle; the bitmap operations below keep them up 
+ * to date, so this is only needed after the bitmaps are changed directly.
+ * Returns 0 or ENOMEM.
+ */
+int free_index_build(struct ext2_fs *fs);
+
+
+/*
+ * Returns length of the longest run of free blocks within one block group.
+ */
+unsigned int longest_free_run(struct ext2_fs *fs);
 
 
 
@@ -40,19 +284,19 @@ int check_bit(unsigned char *first, int start_index, int target_index);
 /*
  * Sets bitmap bit representing inode at index target_index.
  */
-void inode_bitmap_set(int target_index);
+void inode_bitmap_set(struct ext2_fs *fs, int target_index);
 
 
 /*
  * Unsets bitmap bit representing inode at index target_index.
  */
-void inode_bitmap_unset(int target_index);
+void inode_bitmap_unset(struct ext2_fs *fs, int target_index);
 
 
 /*
  * Returns 0 if inode at index target_index is allocated, or 1 otherwise.
  */
-int inode_available(int target_index);
+int inode_available(struct ext2_fs *fs, int target_index);
 
 
 
@@ -62,19 +306,19 @@ int inode_available(int target_index);
 /*
  * Sets bitmap bit representing block at index target_index.
  */
-void block_bitmap_set(int target_index);
+void block_bitmap_set(struct ext2_fs *fs, int target_index);
 
 
 /*
  * Unsets bitmap bit representing block at index target_index.
  */
-void block_bitmap_unset(int target_index);
+void block_bitmap_unset(struct ext2_fs *fs, int target_index);
 
 
 /*
  * Returns 0 if block at index target_index is allocated, or 1 otherwise.
  */
-int block_available(int target_index);
+int block_available(struct ext2_fs *fs, int target_index);
 
 
 
@@ -82,35 +326,143 @@ int block_available(int target_index);
 /* ALLOCATION / DEALLOCATION */
 
 /*
- * Searches for available block. Allocates block if found, returning the index,
- * or exits with ENOMEM otherwise.
+ * Searches the free space index for available block, starting from block_cursor.
+ * Allocates block if found, returning the index, or returns 0 otherwise. The 
+ * allocation and freeing calls below expect fs to be writable.
+ */
+unsigned int allocate_block(struct ext2_fs *fs);
+
+
+/*
+ * Searches for a run of at least min (and at most max) contiguous available blocks
+ * within one block group, starting at goal and wrapping around the image. Marks the
+ * whole run allocated and returns its first block index, setting count to its length,
+ * or returns 0 with count set to 0 if no such run exists. Blocks are not zeroed. 
+ * The search takes O(log n) in the number of free extents.
+ */
+unsigned int allocate_block_run(struct ext2_fs *fs, unsigned int goal, unsigned int min, unsigned int max, unsigned int *count);
+
+
+/*
+ * Run of allocated but not yet used blocks, handed out one at a time.
  */
-unsigned int allocate_block();
+struct block_run {
+	unsigned int next;   /* next block to hand out (or goal once exhausted) */
+	unsigned int count;  /* blocks left in run */
+	unsigned int wanted; /* blocks still expected to be needed, or 0 if unknown */
+};
+
+#define BLOCK_RUN_MAX 2048 /* largest run taken at once, in blocks */
+#define BLOCK_RUN_UNKNOWN 64 /* run taken when the final length is unknown */
 
 
 /*
- * Searches for available inode. Allocates inode if found, returning the index,
- * or exits with ENOMEM otherwise.
+ * Returns next block of run, allocating a new run of up to run->wanted blocks 
+ * (placed after the previous one when possible) once it is exhausted. Returns 0
+ * if no blocks are available.
  */
-unsigned int allocate_inode();
+unsigned int block_run_next(struct ext2_fs *fs, struct block_run *run);
 
 
 /*
- * Recycles block at given index.
+ * Frees the blocks of run that were never handed out.
  */
-void free_block(int block_index);
+void block_run_release(struct ext2_fs *fs, struct block_run *run);
 
 
 /*
- * Recycles inode at given index.
+ * Searches for available inode, starting from inode_cursor. Allocates inode if 
+ * found, returning the index, or returns 0 otherwise.
  */
-void free_inode(int inode_index);
+unsigned int allocate_inode(struct ext2_fs *fs);
+
+
+/*
+ * Allocates up to count inodes at once, in index order from the first free inode
+ * of group on, storing their indices in inodes. Returns how many were allocated.
+ */
+unsigned int allocate_inodes(struct ext2_fs *fs, unsigned int group, unsigned int count, unsigned int *inodes);
+
+
+/*
+ * Picks the block group for a new directory under parent_inode (Orlov). 
+ * Directories under the root are spread out: of the groups with at least the 
+ * average free inodes and blocks, the one holding fewest directories. Deeper 
+ * ones go to the first group from their parent's on that still has fair free 
+ * space and is not crowded with directories, which is normally the parent's.
+ */
+unsigned int find_group_dir(struct ext2_fs *fs, unsigned int parent_inode);
+
+
+/*
+ * Picks the block group for a new file under parent_inode: the parent's if it 
+ * has a free inode and free blocks, else the next one that does.
+ */
+unsigned int find_group_file(struct ext2_fs *fs, unsigned int parent_inode);
+
+
+/*
+ * Allocates inode for a new directory (if dir is set) or file under parent_inode,
+ * in the group find_group_dir / find_group_file picks, or the first free one 
+ * after it. Returns the index, or 0 if no inode is available.
+ */
+unsigned int allocate_inode_near(struct ext2_fs *fs, unsigned int parent_inode, int dir);
+
+
+/*
+ * Returns the block the data of inode at given index is best placed from, the
+ * start of its group, so a file's blocks sit near its inode and directory.
+ */
+unsigned int inode_goal(struct ext2_fs *fs, unsigned int inode_index);
+
+
+/*
+ * Allocates the first available block at or after goal, wrapping around the 
+ * image, and zeroes it. Returns its index, or 0 if no block is available.
+ */
+unsigned int allocate_block_near(struct ext2_fs *fs, unsigned int goal);
+
+
+/*
+ * Recycles block at given index, or only drops one owner if it is shared (see
+ * block_unref).
+ */
+void free_block(struct ext2_fs *fs, int block_index);
+
+
+/*
+ * Recycles count blocks starting at given index, none of which may be shared.
+ */
+void free_block_run(struct ext2_fs *fs, unsigned int block_index, unsigned int count);
+
+
+/*
+ * Recycles inode at given index, freeing its data and indirect blocks and 
+ * stamping its deletion time.
+ */
+void free_inode(struct ext2_fs *fs, int inode_index);
+
+
+/*
+ * Stops the calls above from updating the free block and inode counts of the 
+ * groups and superblock, for bulk updates that would otherwise touch them once
+ * per allocation. Groups are then searched regardless of their stale counts.
+ */
+void defer_counters(struct ext2_fs *fs);
+
+
+/*
+ * Recounts the free blocks and inodes of every group from the bitmaps, sets the
+ * superblock totals and ends deferral. ext2_close does this for a handle left
+ * deferred.
+ */
+void sync_counters(struct ext2_fs *fs);
 
 
 /*
  * Zeroes out the block.
  */
-void clear_block(struct ext2_block *b);
+void clear_block(struct ext2_fs *fs, struct ext2_block *b);
 
 
 
@@ -126,13 +478,21 @@ char *copy_str(char *str);
 /*
  * Replicates data from src block to dest block.
  */
-void copy_block(struct ext2_block *blk_src, struct ext2_block *blk_dest);
+void copy_block(struct ext2_fs *fs, struct ext2_block *blk_src, struct ext2_block *blk_dest);
 
 
+#define COPY_THREAD_BLOCKS 8192 /* least blocks per thread when copy_inode splits a copy */
+#define COPY_MAX_THREADS 16
+
 /*
- * Replicates data from inode at src index and returns inode index of copy.
+ * Replicates data from inode at src index into inode at dest index (newly 
+ * allocated, with no blocks), keeping the link count of dest. The destination
+ * block map is built in one pass over the source from runs reserved up front,
+ * then data moves with one memcpy per stretch contiguous on both sides, split
+ * over threads for large files. Returns 0, or an errno value (ENOSPC, EROFS,
+ * ENOMEM) otherwise.
  */
-void copy_inode(unsigned int inode_src, unsigned int inode_dest);
+int copy_inode(struct ext2_fs *fs, unsigned int inode_src, unsigned int inode_dest);
 
 
 
@@ -166,35 +526,118 @@ int dir_entry_full(struct ext2_dir_entry_2 *de, int required_space);
 int dir_entry_next(struct ext2_dir_entry_2 **cur, int *remaining);
 
 
+/*
+ * Returns pointer to directory entry of filename in directory block at given
+ * block index, or NULL otherwise. Unused entries (inode 0) never match.
+ */
+struct ext2_dir_entry_2 *dir_block_find(struct ext2_fs *fs, unsigned int block_index, char *filename, int name_len);
+
+
+/*
+ * Adds entry with given fields to directory block at given block index, reusing
+ * an unused entry or splitting the slack off another. Returns the new entry, or
+ * NULL if the block has no room.
+ */
+struct ext2_dir_entry_2 *dir_block_insert(struct ext2_fs *fs, unsigned int block_index, unsigned int new_inode, int name_len, int file_type, char *filename);
+
+
+/*
+ * Appends a cleared block to directory, preferably right after its last block.
+ * Sets block_index to the new block and logical (unless NULL) to its logical 
+ * index. Returns 0, or ENOSPC if no block is available.
+ */
+int dir_append_block(struct ext2_fs *fs, unsigned int dir_inode, unsigned int *logical, unsigned int *block_index);
+
+
 /*
  * Returns pointer to directory entry of filename in directory given by inode index,
  * or NULL otherwise.
  */
-struct ext2_dir_entry_2 *dir_find(unsigned int dir_inode, char *filename);
+struct ext2_dir_entry_2 *dir_find(struct ext2_fs *fs, unsigned int dir_inode, char *filename);
 
 
 /*
  * Adds entry with given fields to directory with given directory inode index.
+ * A directory outgrowing its first block is converted to an indexed directory
+ * when the file system has the dir_index feature. The new name is added to the
+ * dentry cache. Returns 0, or an errno value (ENOSPC, EIO for a damaged index,
+ * EROFS) otherwise.
  */
-void add_entry(unsigned int dir_inode, unsigned int inode, int name_len, int file_type, char *filename);
+int add_entry(struct ext2_fs *fs, unsigned int dir_inode, unsigned int inode, int name_len, int file_type, char *filename);
 
 
 /*
- * Deletes entry for given filename in directory with given directory inode index.
+ * Deletes entry for given filename in directory with given directory inode index,
+ * and drops it from the dentry cache. Returns 0, or an errno value (ENOENT, 
+ * EROFS) otherwise.
  */
-void delete_entry(unsigned int  dir_inode, char *filename);
+int delete_entry(struct ext2_fs *fs, unsigned int  dir_inode, char *filename);
 
 
 /*
  * Initializes a new directory, including adding "." and ".." directory entries.
+ * Returns 0, or an errno value as for add_entry otherwise, in which case the 
+ * parent is left as it was and new_dir_inode is freed.
  */
-void init_dir_inode(unsigned int new_dir_inode, unsigned int parent_dir_inode, char *dir_filename);
+int init_dir_inode(struct ext2_fs *fs, unsigned int new_dir_inode, unsigned int parent_dir_inode, char *dir_filename);
+
+
+/*
+ * Repacks the live entries of directory into as few blocks as they fit, in 
+ * their current order, and frees the blocks left over along with any indirect 
+ * block no longer needed. A directory that was indexed and still spans several
+ * blocks gets its index rebuilt. Adds the number of blocks given back to freed
+ * if it is not NULL. Returns 0 or an errno value (ENOTDIR, ENOMEM, EROFS, or
+ * EIO if a block below i_size is unmapped).
+ */
+int dir_compact(struct ext2_fs *fs, unsigned int dir_inode, unsigned int *freed);
 
 
 /*
  * Prints the directory given by inode index.
  */
-void print_dir(unsigned int dir_inode);
+void print_dir(struct ext2_fs *fs, unsigned int dir_inode);
+
+
+
+
+/* DIRECTORY INDEX OPERATIONS */
+
+/*
+ * Returns the ext2 directory hash of name for given DX_HASH_* version, seeded 
+ * from the superblock.
+ */
+unsigned int dx_hash(struct ext2_fs *fs, const char *name, int len, int hash_version);
+
+
+/*
+ * Returns 1 if directory has a hash index this implementation can use, 0 otherwise.
+ */
+int dir_indexed(struct ext2_fs *fs, unsigned int dir_inode);
+
+
+/*
+ * Returns pointer to directory entry of filename in indexed directory, looking
+ * only in the leaves the hash of filename leads to, or NULL otherwise.
+ */
+struct ext2_dir_entry_2 *dx_find(struct ext2_fs *fs, unsigned int dir_inode, char *filename, int name_len);
+
+
+/*
+ * Adds entry with given fields to indexed directory, splitting its leaf, and 
+ * the index above it, when full. Link counts are left to add_entry. Returns 0,
+ * or an errno value (ENOSPC, EIO) otherwise.
+ */
+int dx_add_entry(struct ext2_fs *fs, unsigned int dir_inode, unsigned int new_inode, int name_len, int file_type, char *filename);
+
+
+/*
+ * Rebuilds linear directory as an indexed one, with leaves sorted by hash and 
+ * left partly empty for later inserts. Returns 0 on success, EOPNOTSUPP if the
+ * file system lacks dir_index, EFBIG if the directory is too large for two 
+ * index levels, or ENOSPC / ENOMEM, leaving the directory linear.
+ */
+int dx_build(struct ext2_fs *fs, unsigned int dir_inode);
 
 
 
@@ -207,17 +650,25 @@ struct ptr_with_err {
 };
 
 struct next_slot_state_i {
+	struct ext2_fs *fs;
 	unsigned int index[4];
 	unsigned int indirection;
 	unsigned int *start_slot_ptr;
+	unsigned int offset; /* position of the last slot returned within the tree */
 };
 
 struct next_slot_state {
+	struct ext2_fs *fs;
 	struct ext2_inode *in;
 	unsigned int block_index;
+	unsigned int logical; /* logical index of the last slot returned */
 	struct next_slot_state_i indirection_state;
 };
 
+/*
+ * Returned by earlier versions of next_slot at the first hole. Holes are now 
+ * skipped, and only NO_ERR is returned.
+ */
 enum {
 	NO_ERR											= 0,
 	INDIRECTION_BLOCK_MISSING		= 1,
@@ -228,57 +679,330 @@ enum {
 /*
  * Initializes indirection state for next_slot_i function.
  */
-void initialize_state_i(struct next_slot_state_i *state, unsigned int *start_slot_ptr, unsigned int indirection);
+void initialize_state_i(struct ext2_fs *fs, struct next_slot_state_i *state, unsigned int *start_slot_ptr, unsigned int indirection);
 
 
 /*
  * Initializes state for next_slot function.
  */
-void initialize_state(struct next_slot_state *state, unsigned int inode_index);
+void initialize_state(struct ext2_fs *fs, struct next_slot_state *state, unsigned int inode_index);
 
 
 /*
- * Handles indirection for next_slot function.
+ * Handles indirection for next_slot function, returning the next slot that maps
+ * a block in the tree under start_slot_ptr, or NULL once there is none.
  */
 struct ptr_with_err next_slot_i(struct next_slot_state_i *state);
 
 
 /*
- * Returns pointer (with error code) to the slot expected to contain next data block index 
- * for inode specified by state 
+ * Returns pointer (with error code) to the next slot holding a data block index 
+ * for inode specified by state, with its logical index in state->logical, or NULL
+ * past the last one. Holes (missing data or indirect blocks) are skipped, so 
+ * the logical index may jump.
  */
 struct ptr_with_err next_slot(struct next_slot_state *state);
 
 
 /*
- * Returns pointer in inode with given inode index to first available slot to store 
- * a new block index.
+ * Append cursor over the block map of an inode. It keeps the table holding the
+ * next slot, so appending is constant time and each indirect block is created
+ * exactly once, when the first slot it maps is reached.
+ */
+struct block_map_cursor {
+	struct ext2_fs *fs;
+	struct ext2_inode *in;
+	unsigned int logical;     /* logical index of the next block appended */
+	unsigned int *leaf;       /* table (i_block or indirect block) holding the next slot */
+	unsigned int leaf_slot;   /* next slot in leaf */
+	unsigned int leaf_slots;  /* number of slots in leaf */
+	unsigned int blocks;      /* blocks added since last block_map_finish, including indirect */
+	struct block_run *run;    /* source of new blocks, or NULL to use allocate_block_near */
+	unsigned int goal;        /* where blocks are placed from without a run */
+};
+
+
+/*
+ * Returns number of indirect blocks created when appending count blocks to a
+ * block map already holding logical blocks.
  */
-unsigned int *inode_free_slot(int inode_index);
+unsigned int indirect_blocks_needed(struct ext2_fs *fs, unsigned int logical, unsigned int count);
 
 
 /*
- * Adds block with given block index to inode with given inode index.
+ * Initializes cursor to append to inode at given index, whose block map holds
+ * blocks 0 to logical - 1. New blocks are placed from inode_goal, which also 
+ * becomes the goal of run if it has not been used yet.
  */
-void inode_add_block(int inode_index, int block_index);
+void block_map_init(struct ext2_fs *fs, struct block_map_cursor *cursor, unsigned int inode_index, unsigned int logical, struct block_run *run);
 
 
 /*
- * Frees and removes block with given block index from inode with given inode index.
+ * Appends block with given block index to block map of cursor. Returns 0, or 
+ * EFBIG / ENOSPC if the indirect block needed cannot be added.
  */
-void inode_remove_block(int inode_index, int block_index);
+int block_map_append(struct block_map_cursor *cursor, unsigned int block_index);
 
 
 /*
- * Reads blocks from fd and adds data to inode at inode_index
+ * Takes next block from the run of cursor, appends it and sets block_index to it.
+ * Any indirect block needed is taken from the run first. Returns 0, or an errno
+ * value as for block_map_append otherwise.
  */
-void populate_inode(unsigned int inode_index, FILE *stream);
+int block_map_append_run(struct block_map_cursor *cursor, unsigned int *block_index);
+
+
+/*
+ * Moves cursor forward to logical index, leaving a hole before it.
+ */
+void block_map_seek(struct block_map_cursor *cursor, unsigned int logical);
+
+
+/*
+ * Accounts the blocks added through cursor in i_blocks of its inode.
+ */
+void block_map_finish(struct block_map_cursor *cursor);
+
+
+/*
+ * Returns number of data blocks mapped by inode at given index.
+ */
+unsigned int inode_data_blocks(struct ext2_fs *fs, unsigned int inode_index);
+
+
+/*
+ * Returns block index mapped at logical index of inode, or 0 if none is.
+ */
+unsigned int inode_block(struct ext2_fs *fs, unsigned int inode_index, unsigned int logical);
+
+
+/*
+ * Frees the data blocks of inode from logical index keep onwards, along with the
+ * indirect blocks left mapping nothing.
+ */
+void inode_truncate(struct ext2_fs *fs, unsigned int inode_index, unsigned int keep);
+
+
+/*
+ * Adds block with given block index to inode with given inode index. Appending many
+ * blocks should go through a block_map_cursor instead. Returns 0, or an errno value
+ * as for block_map_append otherwise.
+ */
+int inode_add_block(struct ext2_fs *fs, int inode_index, int block_index);
+
+
+/*
+ * Removes block with given block index from inode with given inode index. The
+ * inode's last block takes its place (unless it is the last), and indirect 
+ * blocks left mapping nothing are freed. The block itself is left for the 
+ * caller to free.
+ */
+void inode_remove_block(struct ext2_fs *fs, int inode_index, int block_index);
+
+
+/*
+ * Returns 1 if the block holds only zeros.
+ */
+int block_is_zero(struct ext2_fs *fs, const void *data);
+
+
+/*
+ * File data written but not yet given blocks (delayed allocation). Bytes are 
+ * staged in memory, or in an unlinked temporary file past STAGE_MEMORY_MAX, and 
+ * only placed by stage_flush or stage_close, once their length is known: each 
+ * flush takes one run sized to exactly the data and indirect blocks it needs, 
+ * placed after the previous one, so files written side by side do not 
+ * interleave their blocks.
+ */
+struct staged_file {
+	struct ext2_fs *fs;
+	unsigned int inode_index;
+	struct block_map_cursor cursor;
+	struct block_run run;
+	unsigned char *buf;         /* staged bytes, unless spilled */
+	size_t len, capacity;       /* bytes staged since the last flush, size of buf */
+	FILE *spill;                /* temporary file holding the staged bytes, or NULL */
+	unsigned long long size;    /* bytes written in total */
+};
+
+#define STAGE_MEMORY_MAX (16 << 20) /* staged bytes held in memory before spilling */
+#define STAGE_READ_BYTES 65536      /* piece populate_inode reads a stream in */
+
+
+/*
+ * Starts staging data for new, empty inode at inode_index. Returns 0 or EROFS.
+ */
+int stage_open(struct ext2_fs *fs, unsigned int inode_index, struct staged_file *file);
+
+
+/*
+ * Appends len bytes at data to the staged data of file. Returns 0, or an errno 
+ * value (EFBIG, or that of the failed spill).
+ */
+int stage_write(struct staged_file *file, const void *data, size_t len);
+
+
+/*
+ * Allocates blocks for the whole blocks staged so far and writes them out, 
+ * keeping a partial last block staged. Blocks of zeros become holes. Returns 0, 
+ * or an errno value (ENOSPC, EFBIG) otherwise, in which case the blocks already
+ * mapped are left for free_inode.
+ */
+int stage_flush(struct staged_file *file);
+
+
+/*
+ * Writes out everything still staged as stage_flush does, sets the size of the
+ * inode, and releases file whether or not that succeeds. Returns 0, or an errno
+ * value as for stage_flush.
+ */
+int stage_close(struct staged_file *file);
+
+
+/*
+ * Reads all data from stream and adds it to inode at inode_index. Regular files
+ * are mapped and copied into contiguous runs of destination blocks directly, 
+ * only visiting the ranges SEEK_DATA reports; other streams are staged to their 
+ * end and then placed the same way. Blocks of zeros are left as holes either 
+ * way. Returns 0, or an errno value (ENOSPC, EFBIG, EROFS) otherwise, in which 
+ * case the blocks already mapped are left for free_inode.
+ */
+int populate_inode(struct ext2_fs *fs, unsigned int inode_index, FILE *stream);
+
+
+#define WRITE_FILE_IOVECS 256 /* extents handed to each writev */
+#define WRITE_FILE_ZEROS 65536 /* largest piece of a hole in one iovec */
+
+/*
+ * Writes the contents of inode at given index to fd, up to exactly i_size bytes.
+ * Physically contiguous data blocks are coalesced into extents which are written
+ * straight from the mapped image with writev. Holes are written as zeros from 
+ * memory without reading the image. Returns 0 on success, or the errno value of
+ * the failed write.
+ */
+int write_file(struct ext2_fs *fs, unsigned int inode_index, int fd);
 
 
 /*
  * Checks if inode at given index has specified file type.
  */
-int has_file_type(int filetype, unsigned int inode_index);
+int has_file_type(struct ext2_fs *fs, int filetype, unsigned int inode_index);
+
+
+
+
+/* BLOCK SHARING */
+
+/*
+ * Data blocks may be shared between files cloned with clone_inode. The unused
+ * boot loader inode (EXT2_REFCOUNT_INO, a regular file to e2fsck) then holds 
+ * one 16 bit count per block of the image, the number of owners a block has 
+ * beyond the first (0 for unshared blocks). The table is created on the first
+ * clone, and is only trusted while its inode carries EXT2_REFCOUNT_MAGIC. e2fsck does 
+ * not know it and reports shared blocks as multiply claimed; letting it fix 
+ * them gives every owner a copy, which leaves stale counts behind: deleting
+ * a file would then only drop the counts and leak its blocks, until check_fs
+ * clears the counts of blocks with a single owner. Nothing 
+ * writes into a block a file already has (files are written whole when they
+ * are created), so shared blocks are never copied; a path overwriting file 
+ * data in place would first have to give the inode its own copy of any block
+ * with a count.
+ */
+
+/*
+ * Returns the number of owners of block beyond the first.
+ */
+unsigned int block_refs(struct ext2_fs *fs, unsigned int block_index);
+
+
+/*
+ * Adds an owner to block, creating the table if needed. Returns 0, ENOSPC if
+ * the table cannot be created, or EMLINK if the count is at its maximum.
+ */
+int block_ref(struct ext2_fs *fs, unsigned int block_index);
+
+
+/*
+ * Drops an owner of a shared block. Returns 1 if it still has one, or 0 if block
+ * was not shared (and may be freed by the caller).
+ */
+int block_unref(struct ext2_fs *fs, unsigned int block_index);
+
+
+/*
+ * Gives inode_dest (newly allocated, with no blocks) the size, mode and data of
+ * inode_src, mapping the same data blocks rather than copying them. Indirect 
+ * blocks are not shared. Returns 0 or an errno value (ENOSPC, EFBIG), in which
+ * case the blocks mapped so far are still owned by inode_dest.
+ */
+int clone_inode(struct ext2_fs *fs, unsigned int inode_src, unsigned int inode_dest);
+
+
+
+
+
+/* DEFRAGMENTATION */
+
+/*
+ * Fragmentation of an inode: the runs of consecutive blocks its data takes, in 
+ * logical order. A run goes on over the indirect blocks that block_map_append_run
+ * places in front of the data they map, so a file laid out in one allocation has 
+ * a single extent.
+ */
+struct inode_frag {
+	unsigned int inode_index;
+	unsigned int blocks;  /* data blocks mapped */
+	unsigned int extents; /* runs they form, 0 for an inode with no blocks */
+	int shared;           /* set if a data block is shared with a clone */
+};
+
+#define DEFRAG_WRITEBACK_BYTES (256 << 20) /* data moved between journal_writeback calls */
+
+
+/*
+ * Measures inode into frag by walking its block map. Returns frag->extents.
+ */
+unsigned int inode_fragmentation(struct ext2_fs *fs, unsigned int inode_index, struct inode_frag *frag);
+
+
+/*
+ * Moves the data of inode into one run of free blocks near its group (or the 
+ * longest runs there are, if fewer than its extents), with its indirect blocks 
+ * rebuilt in front of the data they map, and frees the old blocks. Inodes in one
+ * extent are left alone. Returns 0, EBUSY if a block is shared with a clone, or 
+ * ENOSPC if the free runs would not leave it in fewer pieces.
+ */
+int defrag_inode(struct ext2_fs *fs, unsigned int inode_index);
+
+
+
+
+/* DENTRY CACHE */
+
+/*
+ * Returns child inode index cached for name in directory parent, or 0 if none is.
+ */
+unsigned int dentry_lookup(struct ext2_fs *fs, unsigned int parent, char *name);
+
+
+/*
+ * Caches that name in directory parent refers to child. "." and ".." are never
+ * cached.
+ */
+void dentry_insert(struct ext2_fs *fs, unsigned int parent, char *name, int name_len, unsigned int child);
+
+
+/*
+ * Drops the cached entry for name in directory parent, along with every cached
+ * full path, since any of them may have gone through it.
+ */
+void dentry_forget(struct ext2_fs *fs, unsigned int parent, char *name, int name_len);
+
+
+/*
+ * Drops every cached entry and full path.
+ */
+void dentry_cache_clear(struct ext2_fs *fs);
 
 
 
@@ -305,15 +1029,250 @@ char *extract_filename(char *path);
 
 
 /*
- * Returns index of inode determined by path if it exists, or exits with
- * ENOENT otherwise.
+ * Splits path into the path of its parent directory, which is returned, and its
+ * last component, which name is set to. Trailing slashes are ignored and the name
+ * is empty for the root. Both strings live in the returned allocation, which the
+ * caller frees. Returns NULL if out of memory.
  */
-unsigned int inode_from_path(char *path);
+char *path_split(char *path, char **name);
+
+
+#define EXT2_SYMLOOP_MAX 40 /* symbolic links followed while resolving one path */
+
+/*
+ * Sets inode_found to index of inode determined by path and returns 0 if it 
+ * exists, or returns ENOENT otherwise. Symbolic links are followed at every 
+ * component, the last one included; relative targets start from the directory
+ * holding the link. Following more than EXT2_SYMLOOP_MAX links fails with ELOOP,
+ * so cycles end there. Resolution is iterative. Resolved paths, the names along
+ * them and what each link resolved to are cached until an entry is deleted.
+ */
+int inode_from_path(struct ext2_fs *fs, char *path, unsigned int *inode_found);
+
 
 /*
- * Returns index of inode determined by path stored in symbolic link
+ * Returns the path stored in symbolic link as a new string, or NULL if out of memory.
  */
-unsigned int inode_from_symlink(unsigned int sym_inode_index);
+char *symlink_target(struct ext2_fs *fs, unsigned int sym_inode_index);
+
+
+#define EXT2_FAST_SYMLINK_MAX 60 /* targets shorter than this live in i_block */
+
+/*
+ * Returns 1 if inode is a fast symlink, its target held in i_block with no data block.
+ */
+int inode_fast_symlink(struct ext2_fs *fs, unsigned int inode_index);
+
+
+/*
+ * Stores target in newly allocated inode and makes it a symbolic link, inline 
+ * as a fast symlink when shorter than EXT2_FAST_SYMLINK_MAX. Returns 0 or an 
+ * errno value as for populate_inode.
+ */
+int init_symlink_inode(struct ext2_fs *fs, unsigned int inode_index, char *target);
+
+
+/*
+ * Sets inode_found to index of inode determined by path stored in symbolic link,
+ * a relative one taken from the root, returning 0 or an errno value as for 
+ * inode_from_path.
+ */
+int inode_from_symlink(struct ext2_fs *fs, unsigned int sym_inode_index, unsigned int *inode_found);
+
+
+
+/* TREE WALK */
+
+/*
+ * Entry reached by walk_tree, valid only during the visit call.
+ */
+struct walk_entry {
+	char *path;
+	unsigned int inode_index;
+	struct ext2_inode *in;
+	unsigned int depth;  /* 0 for the starting point */
+	unsigned int worker; /* index of the thread making the call, below the thread count */
+};
+
+/*
+ * Called for every entry reached. Returning nonzero stops the walk, which then
+ * returns that value.
+ */
+typedef int (*walk_visit)(struct ext2_fs *fs, struct walk_entry *entry, void *arg);
+
+
+/*
+ * Calls visit for path and every entry below it ("." and ".." aside, symbolic 
+ * links not followed), reading directories in parallel on the given number of
+ * threads, the calling one included. Each thread works through the directories
+ * it found itself, depth first, and steals the oldest queued directory of 
+ * another thread when it runs out, so visit is called concurrently and in no 
+ * particular order across threads. The image must not be modified during the 
+ * walk. Returns 0, an errno value (ENOENT, ENOMEM), or the value visit stopped with.
+ */
+int walk_tree(struct ext2_fs *fs, char *path, unsigned int threads, walk_visit visit, void *arg);
+
+
+
+
+/* TREE IMPORT */
+
+#define IMPORT_PIPE_SLOTS 64               /* host files read ahead of the image writes */
+#define IMPORT_PIPE_BYTES (64 << 20)       /* bytes read ahead */
+#define IMPORT_READ_MAX (1 << 20)          /* larger files are mapped by the writer instead */
+#define IMPORT_WRITEBACK_BYTES (256 << 20) /* file data between journal_writeback calls */
+
+/*
+ * Copies host file, symbolic link or directory tree at host_path into directory
+ * dir_inode under name, which must not exist yet. The host tree is listed first,
+ * failing with ENOSPC before anything is written if the image cannot hold it, 
+ * or EOPNOTSUPP if it holds other kinds of files. A reader thread then reads 
+ * host files ahead while this one writes them out. Inodes are allocated all at
+ * once, blocks in long runs shared by consecutive files, directories get their
+ * blocks sized for all their entries up front, and free counts are deferred to
+ * one recount at the end. Entries are only added once their inode is complete,
+ * so on failure the files copied so far stay in place. Returns 0 or an errno value.
+ */
+int import_tree(struct ext2_fs *fs, char *host_path, unsigned int dir_inode, char *name);
+
+
+
+
+/* TREE EXPORT */
+
+/*
+ * Copies file, symbolic link or directory tree at path in the image to new 
+ * host_path, reading the image on the given number of threads through walk_tree.
+ * File data goes out with one pwrite per physically contiguous run of blocks
+ * straight from the mapping. Names of one inode become hard links to the first
+ * one written. Modes and times are kept, except that directories stay writable 
+ * by their owner. Returns 0 or an errno value (EEXIST if host_path exists, 
+ * EOPNOTSUPP for special files).
+ */
+int export_tree(struct ext2_fs *fs, char *path, char *host_path, unsigned int threads);
+
+
+
+
+/* CONSISTENCY CHECK */
+
+#define FSCK_MAX_THREADS 16
+
+/*
+ * Checks the image against itself on up to threads threads, printing one line
+ * per problem to stdout. The inode tables are scanned group by group in
+ * parallel, walking every block map into a count of owners per block, then the
+ * directories are scanned in parallel, counting the entries naming each inode.
+ * What they found is then compared in turn with the block bitmaps (a word at a
+ * time), the reference count table, i_blocks, deletion times, the maps and 
+ * sizes of directories, link counts and the free and directory counters of 
+ * groups and superblock. With repair set, problems are fixed as they are found:
+ * bad pointers and entries cleared, holes in directories given empty blocks, 
+ * bitmaps, sizes, counters and deletion times rewritten, and files nothing 
+ * names linked into lost+found. Blocks
+ * claimed twice and lost directories are only reported. Adds the problems
+ * found to found, and those still left to left. Returns 0 or an errno value.
+ */
+int check_fs(struct ext2_fs *fs, int repair, unsigned int threads, unsigned int *found, unsigned int *left);
+
+
+
+
+/* COMMANDS */
+
+/*
+ * Operations behind the command line tools, each returning 0 or an errno value
+ * (EEXIST, ENOENT, EISDIR, ENOTDIR, ENOSPC, ...) instead of exiting.
+ */
+
+/*
+ * Prints names in directory at path, one per line.
+ */
+int cmd_ls(struct ext2_fs *fs, char *path);
+
+
+/*
+ * Writes contents of file at path to stdout.
+ */
+int cmd_cat(struct ext2_fs *fs, char *path);
+
+
+/*
+ * Copies file at host_path in the native file system to new file at path.
+ */
+int cmd_cp(struct ext2_fs *fs, char *host_path, char *path);
+
+
+/*
+ * Copies host file or directory tree at host_path to new entry at path.
+ */
+int cmd_cp_tree(struct ext2_fs *fs, char *host_path, char *path);
+
+
+/*
+ * Copies file or directory tree at path to new host_path in the native file 
+ * system, on one thread per online processor.
+ */
+int cmd_extract(struct ext2_fs *fs, char *path, char *host_path);
+
+
+/*
+ * Creates directory at path.
+ */
+int cmd_mkdir(struct ext2_fs *fs, char *path);
+
+
+/*
+ * Removes file (not directory) at path.
+ */
+int cmd_rm(struct ext2_fs *fs, char *path);
+
+
+/*
+ * Creates link at path to target, a symbolic link storing target as given if 
+ * symbolic is set, or a hard link to the file at target otherwise.
+ */
+int cmd_ln(struct ext2_fs *fs, char *target, char *path, int symbolic);
+
+
+/*
+ * Moves entry at src to dest. A directory moved to another parent has its .. 
+ * and both parents' link counts updated, and cannot be moved below itself 
+ * (EINVAL).
+ */
+int cmd_mv(struct ext2_fs *fs, char *src, char *dest);
+
+
+/*
+ * Copies file at src to new file at dest within the image, sharing its data 
+ * blocks instead of copying them if clone is set.
+ */
+int cmd_cp2(struct ext2_fs *fs, char *src, char *dest, int clone);
+
+
+/*
+ * Compacts directory at path, and every directory below it if recursive is set.
+ * Adds the number of blocks given back to freed if it is not NULL.
+ */
+int cmd_dircompact(struct ext2_fs *fs, char *path, int recursive, unsigned int *freed);
+
+
+/*
+ * Prints the fragmented files at path and below, most fragmented first, and 
+ * defragments them in that order if apply is set. Files that cannot be moved 
+ * are reported and skipped.
+ */
+int cmd_defrag(struct ext2_fs *fs, char *path, int apply);
+
+
+/*
+ * Runs command given as words (name followed by its arguments, the arguments of
+ * the tool without the image): ls, cat, cp, mkdir, rm, ln [-s], mv, cp2, 
+ * extract, dircompact [-r], defrag [-n], or sync to commit the commands so far. Returns the result of the 
+ * command, or EINVAL if it is not one of these.
+ */
+int run_command(struct ext2_fs *fs, int argc, char **argv);
+
 
 
 
@@ -322,6 +1281,11 @@ unsigned int inode_from_symlink(unsigned int sym_inode_index);
 void print_result(struct ptr_with_err result);
 void print_state_i(struct next_slot_state_i state);
 void print_state(struct next_slot_state state);
-void print_block(struct ext2_block *blk);
-void print_file(unsigned int inode_index);
+void print_block(struct ext2_fs *fs, struct ext2_block *blk);
+
+/*
+ * Writes contents of inode at given index to stdout, returning 0 or the errno 
+ * value of the failed write.
+ */
+int print_file(struct ext2_fs *fs, unsigned int inode_index);
 
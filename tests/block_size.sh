@@ -0,0 +1,27 @@
+#!/bin/sh
+# Images with 2 and 4 KiB blocks (the mke2fs default for larger images) open, 
+# and files reaching their double indirect blocks read back intact.
+set -e
+cd "$(dirname "$0")/.."
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+head -c 9000000 /dev/urandom > "$tmp/big"
+echo data > "$tmp/small"
+for bs in 2048 4096; do
+	mke2fs -q -F -t ext2 -b $bs "$tmp/img" 32768K > /dev/null 2>&1
+	{
+		printf 'mkdir /d\ncp %s /d/big\ncp %s /d/small\nmkdir /d/many\n' "$tmp/big" "$tmp/small"
+		for i in $(seq 1 300); do echo "ln /d/small /d/many/entry_with_a_long_name_$i"; done
+		for i in $(seq 1 250); do echo "rm /d/many/entry_with_a_long_name_$i"; done
+		printf 'dircompact /d/many\nmv /d/small /d/many/small\n'
+	} | ./ext2_batch "$tmp/img" > /dev/null 2> "$tmp/log" || { cat "$tmp/log"; echo "FAIL: batch on $bs byte blocks"; exit 1; }
+	./ext2_cat "$tmp/img" /d/big | cmp -s - "$tmp/big" || { echo "FAIL: big file on $bs byte blocks"; exit 1; }
+	[ "$(./ext2_ls "$tmp/img" /d/many | wc -l)" -eq 53 ] || { echo "FAIL: directory on $bs byte blocks"; exit 1; }
+	./ext2_fsck "$tmp/img" > "$tmp/out" || { cat "$tmp/out"; echo "FAIL: fsck on $bs byte blocks"; exit 1; }
+	if command -v e2fsck > /dev/null; then e2fsck -fn "$tmp/img" > /dev/null 2>&1 || { echo "FAIL: e2fsck on $bs byte blocks"; exit 1; }; fi
+
+	./ext2_rm "$tmp/img" /d/big
+	./ext2_fsck "$tmp/img" > "$tmp/out" || { cat "$tmp/out"; echo "FAIL: rm on $bs byte blocks"; exit 1; }
+done
+echo "PASS: block_size"
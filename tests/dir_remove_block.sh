@@ -0,0 +1,36 @@
+#!/bin/sh
+# Removing the last block of a directory leaves no hole in its map, and
+# ext2_dircompact gives blocks back, indirect ones included, without touching
+# anything outside the directory.
+set -e
+cd "$(dirname "$0")/.."
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+check() {
+	./ext2_fsck "$tmp/img" > "$tmp/out" || { cat "$tmp/out"; echo "FAIL: $1"; exit 1; }
+	if command -v e2fsck > /dev/null; then e2fsck -fn "$tmp/img" > "$tmp/out" 2>&1 || { cat "$tmp/out"; echo "FAIL: e2fsck, $1"; exit 1; }; fi
+}
+
+# entries of 256 bytes fit four to a block (three beside . and ..), so twelve
+# of them fill four blocks, the last one alone in block 3
+long=$(printf 'n%.0s' $(seq 1 245))
+mke2fs -q -F -b 1024 -O ^dir_index "$tmp/img" 4096 > /dev/null 2>&1
+echo data > "$tmp/small"
+{ echo "mkdir /dd"; for i in $(seq 10 21); do echo "cp $tmp/small /dd/$long$i"; done; echo "rm /dd/${long}21"; } | ./ext2_batch "$tmp/img" > /dev/null 2>&1
+check "rm of the only entry in the last block"
+dd if="$tmp/img" bs=1024 count=1 2> /dev/null | md5sum > "$tmp/boot"
+./ext2_dircompact "$tmp/img" /dd > /dev/null
+check "dircompact after rm"
+dd if="$tmp/img" bs=1024 count=1 2> /dev/null | md5sum | cmp -s - "$tmp/boot" || { echo "FAIL: block 0 changed"; exit 1; }
+[ "$(./ext2_ls "$tmp/img" /dd | wc -l)" -eq 13 ] || { echo "FAIL: entries lost"; exit 1; }
+
+# fourteen blocks need an indirect block, which removing entries must free
+{ for i in $(seq 22 65); do echo "cp $tmp/small /dd/$long$i"; done; } | ./ext2_batch "$tmp/img" > /dev/null 2>&1
+debugfs -R "stat /dd" "$tmp/img" 2> /dev/null | grep -q "(IND)" || { echo "FAIL: no indirect block to free"; exit 1; }
+{ for i in $(seq 22 64); do echo "rm /dd/$long$i"; done; } | ./ext2_batch "$tmp/img" > /dev/null 2>&1
+check "rm across the indirect block"
+debugfs -R "stat /dd" "$tmp/img" 2> /dev/null | grep -q "(IND)" && { echo "FAIL: empty indirect block kept"; exit 1; }
+./ext2_dircompact "$tmp/img" /dd > /dev/null
+check "dircompact"
+echo "PASS: dir_remove_block"
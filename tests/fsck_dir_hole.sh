@@ -0,0 +1,27 @@
+#!/bin/sh
+# A directory with an unmapped block below its end, and an i_size short of its
+# last block, is reported and repaired into an image e2fsck accepts.
+set -e
+cd "$(dirname "$0")/.."
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# twelve entries of 256 bytes fill four blocks of a linear directory
+long=$(printf 'n%.0s' $(seq 1 245))
+mke2fs -q -F -b 1024 -O ^dir_index "$tmp/img" 4096 > /dev/null 2>&1
+echo data > "$tmp/small"
+{ echo "mkdir /dd"; for i in $(seq 10 21); do echo "cp $tmp/small /dd/$long$i"; done; } | ./ext2_batch "$tmp/img" > /dev/null 2>&1
+
+# punch out block 2, as a map left with a hole and i_size one block short
+block=$(debugfs -R "bmap /dd 2" "$tmp/img" 2> /dev/null)
+for request in "sif /dd block[2] 0" "freeb $block" "sif /dd size 3072" "sif /dd blocks 6"; do
+	debugfs -w -R "$request" "$tmp/img" > /dev/null 2>&1
+done
+
+if ./ext2_fsck "$tmp/img" > "$tmp/out"; then cat "$tmp/out"; echo "FAIL: hole not reported"; exit 1; fi
+grep -q "block 2 is not mapped" "$tmp/out" || { cat "$tmp/out"; echo "FAIL: hole"; exit 1; }
+grep -q "i_size is 3072, should be 4096" "$tmp/out" || { cat "$tmp/out"; echo "FAIL: i_size"; exit 1; }
+./ext2_fsck "$tmp/img" -y > /dev/null || [ $? -eq 1 ] || { echo "FAIL: repair"; exit 1; }
+./ext2_fsck "$tmp/img" > "$tmp/out" || { cat "$tmp/out"; echo "FAIL: not repaired"; exit 1; }
+if command -v e2fsck > /dev/null; then e2fsck -fn "$tmp/img" > "$tmp/out" 2>&1 || { cat "$tmp/out"; echo "FAIL: e2fsck"; exit 1; }; fi
+echo "PASS: fsck_dir_hole"
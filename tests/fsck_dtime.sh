@@ -0,0 +1,21 @@
+#!/bin/sh
+# Inodes reused after rm must not keep their deletion time, and ext2_fsck must
+# report and clear one left on an inode in use.
+set -e
+cd "$(dirname "$0")/.."
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+mke2fs -q -F -b 1024 "$tmp/img" 8192 > /dev/null 2>&1
+echo data > "$tmp/small"
+printf 'mkdir /bb\ncp %s /bb/s\nrm /bb/s\nmkdir /bb/x\ncp %s /bb/y\nln /bb/y /bb/z\n' "$tmp/small" "$tmp/small" | ./ext2_batch "$tmp/img" > /dev/null 2>&1
+./ext2_fsck "$tmp/img" > "$tmp/out" || { cat "$tmp/out"; echo "FAIL: reused inode left with a deletion time"; exit 1; }
+if command -v e2fsck > /dev/null; then e2fsck -fn "$tmp/img" > /dev/null 2>&1 || { echo "FAIL: e2fsck"; exit 1; }; fi
+
+# a deletion time on an inode in use is found, then repaired
+debugfs -w -R "sif /bb/x dtime 12345" "$tmp/img" > /dev/null 2>&1
+if ./ext2_fsck "$tmp/img" > "$tmp/out"; then echo "FAIL: deletion time not reported"; exit 1; fi
+grep -q "in use, but has a deletion time" "$tmp/out" || { cat "$tmp/out"; echo "FAIL: wrong report"; exit 1; }
+./ext2_fsck "$tmp/img" -y > /dev/null || [ $? -eq 1 ] || { echo "FAIL: repair"; exit 1; }
+./ext2_fsck "$tmp/img" > /dev/null || { echo "FAIL: not repaired"; exit 1; }
+echo "PASS: fsck_dtime"
@@ -0,0 +1,27 @@
+#!/bin/sh
+# After e2fsck -y copies the blocks of a clone, ext2_fsck must drop the counts
+# it left behind, so deleting the files frees their blocks.
+set -e
+cd "$(dirname "$0")/.."
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+command -v e2fsck > /dev/null || { echo "SKIP: fsck_refcount (no e2fsck)"; exit 0; }
+
+mke2fs -q -F -b 1024 "$tmp/img" 8192 > /dev/null 2>&1
+head -c 20000 /dev/urandom > "$tmp/data"
+printf 'mkdir /cc\ncp %s /cc/a\n' "$tmp/data" | ./ext2_batch "$tmp/img" > /dev/null 2>&1
+./ext2_cp2 "$tmp/img" -c /cc/a /cc/b
+./ext2_fsck "$tmp/img" > "$tmp/out" || { cat "$tmp/out"; echo "FAIL: clone"; exit 1; }
+
+# e2fsck copies the shared blocks; the counts are now stale
+e2fsck -fy "$tmp/img" > /dev/null 2>&1 || true
+if ./ext2_fsck "$tmp/img" > "$tmp/out"; then echo "FAIL: stale counts not reported"; exit 1; fi
+grep -q "no longer shared" "$tmp/out" || { cat "$tmp/out"; echo "FAIL: wrong report"; exit 1; }
+./ext2_fsck "$tmp/img" -y > /dev/null || [ $? -eq 1 ] || { echo "FAIL: repair"; exit 1; }
+./ext2_fsck "$tmp/img" > "$tmp/out" || { cat "$tmp/out"; echo "FAIL: not repaired"; exit 1; }
+
+# with the counts gone, deletes free the blocks again
+printf 'rm /cc/a\nrm /cc/b\n' | ./ext2_batch "$tmp/img" > /dev/null 2>&1
+./ext2_fsck "$tmp/img" > "$tmp/out" || { cat "$tmp/out"; echo "FAIL: blocks leaked"; exit 1; }
+e2fsck -fn "$tmp/img" > /dev/null 2>&1 || { echo "FAIL: e2fsck"; exit 1; }
+echo "PASS: fsck_refcount"
@@ -0,0 +1,15 @@
+#!/bin/sh
+# A mkdir failing with ENOSPC at any step must leave the image consistent.
+set -e
+cd "$(dirname "$0")/.."
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+for size in 500000 650000 800000 860000; do
+	mke2fs -q -F -b 1024 -N 2048 "$tmp/img" 1200 > /dev/null 2>&1
+	head -c $size /dev/urandom > "$tmp/data"
+	{ echo "cp $tmp/data /data"; for i in $(seq 1 700); do echo "mkdir /directory_with_a_rather_long_name_to_fill_blocks_$i"; done; } | ./ext2_batch "$tmp/img" > /dev/null 2>&1 || true
+	./ext2_fsck "$tmp/img" > "$tmp/out" || { cat "$tmp/out"; echo "FAIL: mkdir after $size bytes"; exit 1; }
+	if command -v e2fsck > /dev/null; then e2fsck -fn "$tmp/img" > /dev/null 2>&1 || { echo "FAIL: e2fsck after $size bytes"; exit 1; }; fi
+done
+echo "PASS: mkdir_enospc"
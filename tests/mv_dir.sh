@@ -0,0 +1,17 @@
+#!/bin/sh
+# Moving a directory to another parent moves its .. link count with it, and a
+# directory cannot be moved into its own subtree.
+set -e
+cd "$(dirname "$0")/.."
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+mke2fs -q -F -b 1024 "$tmp/img" 4096 > /dev/null 2>&1
+printf 'mkdir /d1\nmkdir /d2\nmkdir /d1/sub\nmkdir /d1/sub/deeper\n' | ./ext2_batch "$tmp/img" > /dev/null 2>&1
+./ext2_mv "$tmp/img" /d1/sub /d2/sub
+if ./ext2_mv "$tmp/img" /d2/sub /d2/sub/deeper/loop 2> /dev/null; then echo "FAIL: directory moved into itself"; exit 1; fi
+
+./ext2_fsck "$tmp/img" > "$tmp/out" || { cat "$tmp/out"; echo "FAIL: link counts after mv"; exit 1; }
+if command -v e2fsck > /dev/null; then e2fsck -fn "$tmp/img" > /dev/null 2>&1 || { echo "FAIL: e2fsck"; exit 1; }; fi
+./ext2_ls "$tmp/img" /d2/sub/deeper > /dev/null
+echo "PASS: mv_dir"
@@ -0,0 +1,18 @@
+#!/bin/sh
+# A relative symbolic link hard linked into two directories resolves from
+# whichever directory it is reached through, even after being cached.
+set -e
+cd "$(dirname "$0")/.."
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+mke2fs -q -F -b 1024 "$tmp/img" 4096 > /dev/null 2>&1
+echo in-a > "$tmp/a"
+echo in-b > "$tmp/b"
+printf 'mkdir /a\nmkdir /b\ncp %s /a/f\ncp %s /b/f\nln -s f /a/lnk\n' "$tmp/a" "$tmp/b" | ./ext2_batch "$tmp/img" > /dev/null 2>&1
+debugfs -w -R "ln /a/lnk /b/lnk" "$tmp/img" > /dev/null 2>&1
+debugfs -w -R "sif /a/lnk links_count 2" "$tmp/img" > /dev/null 2>&1
+
+printf 'cat /a/lnk\ncat /b/lnk\ncat /a/lnk\n' | ./ext2_batch "$tmp/img" > "$tmp/out" 2>&1
+grep "^in-" "$tmp/out" | tr "\n" " " | grep -qx "in-a in-b in-a " || { cat "$tmp/out"; echo "FAIL: link resolved from the wrong directory"; exit 1; }
+echo "PASS: symlink_relative"